@@ -0,0 +1,9 @@
+#version 430 core
+
+out uint fragId;
+
+flat in uint instanceId;
+
+void main() {
+    fragId = instanceId;
+}
@@ -0,0 +1,36 @@
+#version 430 core
+
+layout(location = 0) in vec3 iPos;
+layout(location = 3) in uint iInstance;
+
+
+layout(location = 0) uniform mat4 M;
+layout(location = 1) uniform mat4 V;
+layout(location = 2) uniform mat4 P;
+layout(location = 3) uniform vec3 posOffset;
+layout(location = 4) uniform vec3 posScale;
+
+// See InstanceTransform
+struct Instance {
+    vec4 rotation;
+    vec4 positionScale;
+};
+layout(std430, binding = 2) readonly buffer Instances {
+    Instance instances[];
+};
+
+flat out uint instanceId;
+
+vec3 rotate(vec4 q, vec3 v) {
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+void main(){
+    // 0 is left for the background
+    instanceId = iInstance + 1u;
+    Instance instance = instances[iInstance];
+    vec3 pos = posOffset + posScale * iPos;
+    vec3 posModel = (M * vec4(pos, 1.0)).xyz;
+    vec4 posWorld = vec4(instance.positionScale.xyz + instance.positionScale.w * rotate(instance.rotation, posModel), 1.0);
+    gl_Position = P * V * posWorld;
+}
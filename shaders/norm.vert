@@ -3,20 +3,51 @@
 layout(location = 0) in vec3 iPos;
 layout(location = 1) in vec3 iNorm;
 layout(location = 2) in vec2 iUv;
-layout(location = 3) in vec2 iOffsetXZ;
+layout(location = 3) in uint iInstance;
 
 
 layout(location = 0) uniform mat4 M;
 layout(location = 1) uniform mat4 V;
 layout(location = 2) uniform mat4 P;
+// Decode of the compressed vertices, see Mesh::setCompressedVertices
+layout(location = 3) uniform vec3 posOffset;
+layout(location = 4) uniform vec3 posScale;
+layout(location = 5) uniform bool octahedralNormals;
+
+// See InstanceTransform. Ids out of the buffer have no transform
+struct Instance {
+    vec4 rotation;
+    vec4 positionScale;
+};
+layout(std430, binding = 2) readonly buffer Instances {
+    Instance instances[];
+};
 
 out vec3 normWorld;
 out vec2 uv;
 
+vec3 octahedralDecode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if(n.z < 0.0) {
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    }
+    return normalize(n);
+}
+
+vec3 rotate(vec4 q, vec3 v) {
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
 void main(){
     
+    Instance instance = Instance(vec4(0, 0, 0, 1), vec4(0, 0, 0, 1));
+    if(iInstance < uint(instances.length())) {
+        instance = instances[iInstance];
+    }
+
     uv = iUv;
-    normWorld = (V * M * vec4(iNorm, 0.0)).xyz;
+    vec3 norm = octahedralNormals ? octahedralDecode(iNorm.xy) : iNorm;
+    normWorld = (V * vec4(rotate(instance.rotation, (M * vec4(norm, 0.0)).xyz), 0.0)).xyz;
     /*
     if(gl_VertexID  < 6){
         normWorld = vec3(1,0,0);
@@ -37,6 +68,8 @@ void main(){
         normWorld = vec3(0,0,1);
     }
     */
-    vec4 posWorld = M * vec4(iPos, 1.0) + vec4(iOffsetXZ.x, 0, iOffsetXZ.y, 0);
+    vec3 pos = posOffset + posScale * iPos;
+    vec3 posModel = (M * vec4(pos, 1.0)).xyz;
+    vec4 posWorld = vec4(instance.positionScale.xyz + instance.positionScale.w * rotate(instance.rotation, posModel), 1.0);
     gl_Position = P * V * posWorld;
 }
@@ -0,0 +1,117 @@
+#include "DepthReprojection.hpp"
+
+#include <algorithm>
+#include <glad/glad.h>
+
+DepthReprojection::DepthReprojection()
+{
+    for(Capture& c : mCaptures) {
+        glGenBuffers(1, &c.pbo);
+    }
+}
+
+DepthReprojection::~DepthReprojection()
+{
+    for(Capture& c : mCaptures) {
+        if(c.fence != nullptr) {
+            glDeleteSync(c.fence);
+        }
+        glDeleteBuffers(1, &c.pbo);
+    }
+}
+
+void DepthReprojection::capture(uint32_t width, uint32_t height, const glm::mat4 &viewProj)
+{
+    if(width != mWidth || height != mHeight) {
+        mWidth = width;
+        mHeight = height;
+        for(Capture& c : mCaptures) {
+            if(c.fence != nullptr) {
+                glDeleteSync(c.fence);
+                c.fence = nullptr;
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, c.pbo);
+            glBufferData(GL_PIXEL_PACK_BUFFER, size_t(width) * height * sizeof(float), nullptr, GL_STREAM_READ);
+        }
+    }
+
+    Capture& c = mCaptures[mNextCapture];
+    mNextCapture = 1 - mNextCapture;
+    // Returns immediately, the copy finishes with the rest of the frame
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, c.pbo);
+    glReadPixels(0, 0, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, (void*)0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    if(c.fence != nullptr) {
+        glDeleteSync(c.fence);
+    }
+    c.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    c.viewProj = viewProj;
+}
+
+void DepthReprojection::reproject(const glm::mat4 &viewProj)
+{
+    mValid = false;
+    Capture& c = mCaptures[mNextCapture];
+    if(c.fence == nullptr) {
+        return;
+    }
+
+    // Mapping the buffer before the copy is done would wait for the GPU
+    GLint status = GL_UNSIGNALED;
+    glGetSynciv(c.fence, GL_SYNC_STATUS, 1, nullptr, &status);
+    if(status != GL_SIGNALED) {
+        ++mUnfinishedFrames;
+        return;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, c.pbo);
+    const float* lastDepth = (const float*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                                                          size_t(mWidth) * mHeight * sizeof(float),
+                                                          GL_MAP_READ_BIT);
+    if(lastDepth == nullptr) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        return;
+    }
+
+    mDepth.assign(size_t(mWidth) * mHeight, 1.0f);
+
+    // From the clip space of the captured frame to the one of the actual
+    const glm::mat4 lastToActual = viewProj * glm::inverse(c.viewProj);
+    const glm::vec2 invSize = 1.0f / glm::vec2(mWidth, mHeight);
+    for(uint32_t y = 0; y < mHeight; ++y) {
+        for(uint32_t x = 0; x < mWidth; ++x) {
+            float d = lastDepth[size_t(y) * mWidth + x];
+            if(d >= 1.0f) {
+                continue; // background
+            }
+            glm::vec4 ndc(2.0f * (x + 0.5f) * invSize.x - 1.0f,
+                          2.0f * (y + 0.5f) * invSize.y - 1.0f,
+                          2.0f * d - 1.0f,
+                          1.0f);
+            glm::vec4 clip = lastToActual * ndc;
+            if(clip.w <= 1e-5f) {
+                continue; // behind the camera
+            }
+            glm::vec3 p = glm::vec3(clip) / clip.w;
+            if(p.x < -1.0f || p.x >= 1.0f || p.y < -1.0f || p.y >= 1.0f || p.z < -1.0f || p.z > 1.0f) {
+                continue;
+            }
+            uint32_t tx = uint32_t((p.x * 0.5f + 0.5f) * mWidth);
+            uint32_t ty = uint32_t((p.y * 0.5f + 0.5f) * mHeight);
+            float& target = mDepth[size_t(ty) * mWidth + tx];
+            target = std::min(target, p.z * 0.5f + 0.5f);
+        }
+    }
+
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    mHiZ.buildFromDepth(mDepth.data(), mWidth, mHeight, viewProj);
+    mValid = true;
+}
+
+bool DepthReprojection::testBox(const glm::vec3 &min, const glm::vec3 &max)
+{
+    return !mValid || mHiZ.testBox(min, max);
+}
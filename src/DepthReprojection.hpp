@@ -0,0 +1,62 @@
+#ifndef DEPTHREPROJECTION_HPP
+#define DEPTHREPROJECTION_HPP
+
+#include "HiZ.hpp"
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// GLsync of glad, to not include GL in the header
+struct __GLsync;
+
+// Reprojects the depth buffer of a previous frame into the view of the actual one,
+// to have an occluder before rendering anything. Pixels that receive no sample
+// are left at the far plane, so the reprojected depth does not hide more than
+// the scene does, up to the size of a pixel. The depth is read in one of two
+// buffers, and reprojected two frames later, when the copy has finished
+class DepthReprojection
+{
+public:
+    DepthReprojection();
+    ~DepthReprojection();
+
+    DepthReprojection& operator=(const DepthReprojection&o) = delete;
+
+    // Start an asynchronous read of the depth of the actual frame, rendered with viewProj
+    void capture(uint32_t width, uint32_t height, const glm::mat4& viewProj);
+
+    // Reproject the depth captured two frames ago into viewProj, and build the pyramid
+    // to test boxes. Nothing is reprojected if the copy hasn't finished, to not wait for it
+    void reproject(const glm::mat4& viewProj);
+
+    // False if the box is hidden by the reprojected depth. Always true if nothing
+    // has been reprojected yet
+    bool testBox(const glm::vec3& min, const glm::vec3& max);
+
+    bool isValid() const { return mValid; }
+
+    // Calls to reproject that found the copy unfinished
+    uint64_t getUnfinishedFrames() const { return mUnfinishedFrames; }
+
+private:
+    struct Capture
+    {
+        uint32_t pbo;
+        // Signalled when the copy to the buffer is done, null if nothing was captured
+        __GLsync* fence = nullptr;
+        glm::mat4 viewProj = glm::mat4(1.0f);
+    };
+    Capture mCaptures[2];
+    // The one written by the next capture, and read by the next reproject
+    uint32_t mNextCapture = 0;
+    uint32_t mWidth = 0;
+    uint32_t mHeight = 0;
+    bool mValid = false;
+    uint64_t mUnfinishedFrames = 0;
+
+    std::vector<float> mDepth;
+    HiZ mHiZ;
+};
+
+#endif // DEPTHREPROJECTION_HPP
@@ -0,0 +1,111 @@
+#include "DepthSorter.hpp"
+
+#include <limits>
+#include <algorithm>
+#include <iterator>
+
+void DepthSorter::sort(const Scene &scene, const glm::vec3 &cameraPosition, const glm::vec3 &viewDirection,
+                       std::vector<uint32_t> &instances)
+{
+    auto depth = [&](uint32_t i) {
+        const glm::vec3 center = 0.5f * (scene.getInstanceMin(i) + scene.getInstanceMax(i));
+        return glm::dot(center - cameraPosition, viewDirection);
+    };
+
+    mInList.resize(scene.numInstances(), 0);
+    for(uint32_t i : instances) {
+        mInList[i] = 1;
+    }
+
+    // The instances still in the list keep the order of the last frame, almost
+    // sorted, and the new ones are sorted on their own and merged with them
+    mKept.clear();
+    for(const Entry& e : mEntries) {
+        if(mInList[e.instance] == 1) {
+            mKept.push_back({depth(e.instance), e.instance});
+            mInList[e.instance] = 2;
+        }
+    }
+    mAdded.clear();
+    for(uint32_t i : instances) {
+        if(mInList[i] == 1) {
+            mAdded.push_back({depth(i), i});
+        }
+        mInList[i] = 0;
+    }
+
+    mEntries.clear();
+    if(insertionSort(mKept, uint64_t(MAX_SHIFTS_PER_ELEMENT) * mKept.size())) {
+        radixSort(mAdded);
+        std::merge(mKept.begin(), mKept.end(), mAdded.begin(), mAdded.end(), std::back_inserter(mEntries),
+                   [](const Entry& a, const Entry& b) { return a.depth < b.depth; });
+        ++mIncrementalSorts;
+    } else {
+        mEntries.insert(mEntries.end(), mKept.begin(), mKept.end());
+        mEntries.insert(mEntries.end(), mAdded.begin(), mAdded.end());
+        radixSort(mEntries);
+        ++mRadixSorts;
+    }
+
+    for(uint32_t k = 0; k < mEntries.size(); ++k) {
+        instances[k] = mEntries[k].instance;
+    }
+}
+
+bool DepthSorter::insertionSort(std::vector<Entry> &entries, uint64_t maxShifts)
+{
+    uint64_t shifts = 0;
+    for(uint32_t k = 1; k < entries.size(); ++k) {
+        const Entry e = entries[k];
+        uint32_t j = k;
+        while(j > 0 && entries[j - 1].depth > e.depth) {
+            entries[j] = entries[j - 1];
+            --j;
+        }
+        entries[j] = e;
+        shifts += k - j;
+        if(shifts > maxShifts) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void DepthSorter::radixSort(std::vector<Entry> &entries)
+{
+    if(entries.empty()) {
+        return;
+    }
+    float minDepth = std::numeric_limits<float>::infinity();
+    float maxDepth = -std::numeric_limits<float>::infinity();
+    for(const Entry& e : entries) {
+        minDepth = std::min(minDepth, e.depth);
+        maxDepth = std::max(maxDepth, e.depth);
+    }
+    const float scale = maxDepth > minDepth ? 65535.0f / (maxDepth - minDepth) : 0.0f;
+    auto key = [&](const Entry& e) {
+        return uint32_t((e.depth - minDepth) * scale);
+    };
+
+    // Two stable passes of 8 bits over the 16 bit keys
+    mScratch.resize(entries.size());
+    std::vector<Entry>* src = &entries;
+    std::vector<Entry>* dst = &mScratch;
+    for(uint32_t shift = 0; shift < 16; shift += 8) {
+        uint32_t offsets[256] = {};
+        for(const Entry& e : *src) {
+            ++offsets[(key(e) >> shift) & 0xff];
+        }
+        uint32_t sum = 0;
+        for(uint32_t& o : offsets) {
+            const uint32_t count = o;
+            o = sum;
+            sum += count;
+        }
+        for(const Entry& e : *src) {
+            (*dst)[offsets[(key(e) >> shift) & 0xff]++] = e;
+        }
+        std::swap(src, dst);
+    }
+    // After an even number of passes the result is back in entries
+}
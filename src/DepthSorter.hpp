@@ -0,0 +1,56 @@
+#ifndef DEPTHSORTER_HPP
+#define DEPTHSORTER_HPP
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+#include "Scene.hpp"
+
+// Sorts render lists front to back, by the view depth of the center of the box of
+// each instance. The camera moves smoothly, so the order of the last frame is
+// almost right: it is reused and fixed with an insertion sort, and only when that
+// moves too many elements is the whole list sorted again with a radix sort of the
+// quantized depths
+class DepthSorter
+{
+public:
+    DepthSorter() = default;
+
+    // viewDirection has to be normalized
+    void sort(const Scene& scene, const glm::vec3& cameraPosition, const glm::vec3& viewDirection,
+              std::vector<uint32_t>& instances);
+
+    // Sorts done since the start by each method
+    uint64_t getIncrementalSorts() const { return mIncrementalSorts; }
+    uint64_t getRadixSorts() const { return mRadixSorts; }
+
+private:
+    struct Entry
+    {
+        float depth;
+        uint32_t instance;
+    };
+
+    // Insertion sort gives up after moving this many elements per element
+    static constexpr uint32_t MAX_SHIFTS_PER_ELEMENT = 8;
+
+    // Sorted list of the last call
+    std::vector<Entry> mEntries;
+    // Instances of the last call still in the list, and the new ones
+    std::vector<Entry> mKept;
+    std::vector<Entry> mAdded;
+    // Second buffer of the radix sort
+    std::vector<Entry> mScratch;
+    // Per instance of the scene, if it is in the actual list
+    std::vector<uint8_t> mInList;
+
+    uint64_t mIncrementalSorts = 0;
+    uint64_t mRadixSorts = 0;
+
+    // False if it needs more shifts than allowed
+    static bool insertionSort(std::vector<Entry>& entries, uint64_t maxShifts);
+    void radixSort(std::vector<Entry>& entries);
+};
+
+#endif // DEPTHSORTER_HPP
@@ -0,0 +1,233 @@
+#include "FrameReport.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <random>
+
+namespace {
+
+// Linear interpolation between the closest ranks of the sorted values
+double percentile(const std::vector<double>& sorted, double p)
+{
+    if(sorted.empty()) {
+        return 0.0;
+    }
+    const double rank = p * double(sorted.size() - 1);
+    const size_t i = size_t(rank);
+    if(i + 1 >= sorted.size()) {
+        return sorted.back();
+    }
+    return sorted[i] + (rank - double(i)) * (sorted[i + 1] - sorted[i]);
+}
+
+// Blocks of consecutive frames starting anywhere, until as many frames as the original
+template<typename F>
+void resampleBlocks(const std::vector<double>& times, uint32_t blockSize, std::mt19937& rng, F&& add)
+{
+    const size_t blocks = times.size() > blockSize ? times.size() - blockSize + 1 : 1;
+    std::uniform_int_distribution<size_t> start(0, blocks - 1);
+    size_t n = 0;
+    while(n < times.size()) {
+        const size_t s = start(rng);
+        for(size_t k = s; k < s + blockSize && k < times.size() && n < times.size(); ++k, ++n) {
+            add(times[k]);
+        }
+    }
+}
+
+void writeSummaryJSON(std::ostream& out, const FrameReport::Summary& s)
+{
+    out << "{\"frames\": " << s.frames << ", \"mean\": " << s.mean << ", \"median\": " << s.median <<
+           ", \"stddev\": " << s.stddev << ", \"p1\": " << s.p1 << ", \"p5\": " << s.p5 <<
+           ", \"p95\": " << s.p95 << ", \"p99\": " << s.p99 <<
+           ", \"mean_ci\": [" << s.meanLow << ", " << s.meanHigh << "]" <<
+           ", \"median_ci\": [" << s.medianLow << ", " << s.medianHigh << "]}";
+}
+
+void writeSummaryCSV(std::ostream& out, const std::string& segment, const FrameReport::Summary& s)
+{
+    out << segment << "," << s.frames << "," << s.mean << "," << s.median << "," << s.stddev << "," <<
+           s.p1 << "," << s.p5 << "," << s.p95 << "," << s.p99 << "," <<
+           s.meanLow << "," << s.meanHigh << "," << s.medianLow << "," << s.medianHigh << "\n";
+}
+
+void printSummary(std::ostream& out, const char* name, const FrameReport::Summary& s)
+{
+    out << name << ": " << s.frames << " frames, mean " << s.mean << " ms [" << s.meanLow << ", " <<
+           s.meanHigh << "], median " << s.median << " ms, p99 " << s.p99 << " ms" << std::endl;
+}
+
+} // namespace
+
+FrameReport::FrameReport(const std::vector<std::pair<double, double>> &frames, double duration,
+                         uint32_t numSegments, double warmup)
+{
+    assert(numSegments != 0 && duration > 0.0);
+    std::vector<std::vector<double>> segments(numSegments);
+    for(const auto& f : frames) {
+        if(f.first < warmup) {
+            continue;
+        }
+        const double ms = 1e3 * f.second;
+        mTimes.push_back(ms);
+        const uint32_t segment = std::min(uint32_t(f.first / duration * double(numSegments)), numSegments - 1);
+        segments[segment].push_back(ms);
+    }
+
+    mTotal = summarize(mTimes);
+    for(const std::vector<double>& times : segments) {
+        mSegments.push_back(summarize(times));
+    }
+}
+
+bool FrameReport::readFrames(const std::string &fileName, std::vector<std::pair<double, double>> &frames)
+{
+    std::ifstream file(fileName);
+    if(!file) {
+        return false;
+    }
+    frames.clear();
+    std::string line;
+    while(std::getline(file, line)) {
+        std::istringstream stream(line);
+        std::pair<double, double> frame;
+        if(stream >> frame.first >> frame.second) {
+            frames.push_back(frame);
+        }
+    }
+    return true;
+}
+
+FrameReport::Summary FrameReport::summarize(const std::vector<double> &times)
+{
+    Summary s;
+    s.frames = times.size();
+    if(times.empty()) {
+        return s;
+    }
+
+    std::vector<double> sorted = times;
+    std::sort(sorted.begin(), sorted.end());
+    double sum = 0.0;
+    for(double t : times) {
+        sum += t;
+    }
+    s.mean = sum / double(times.size());
+    double squares = 0.0;
+    for(double t : times) {
+        squares += (t - s.mean) * (t - s.mean);
+    }
+    s.stddev = times.size() > 1 ? std::sqrt(squares / double(times.size() - 1)) : 0.0;
+    s.median = percentile(sorted, 0.5);
+    s.p1 = percentile(sorted, 0.01);
+    s.p5 = percentile(sorted, 0.05);
+    s.p95 = percentile(sorted, 0.95);
+    s.p99 = percentile(sorted, 0.99);
+
+    const std::vector<double> means = bootstrapMeans(times, 1);
+    s.meanLow = percentile(means, 0.025);
+    s.meanHigh = percentile(means, 0.975);
+
+    std::mt19937 rng(2);
+    std::vector<double> medians(BOOTSTRAP_SAMPLES);
+    std::vector<double> resample;
+    resample.reserve(times.size());
+    for(double& median : medians) {
+        resample.clear();
+        resampleBlocks(times, BOOTSTRAP_BLOCK, rng, [&](double t) { resample.push_back(t); });
+        std::nth_element(resample.begin(), resample.begin() + resample.size() / 2, resample.end());
+        median = resample[resample.size() / 2];
+    }
+    std::sort(medians.begin(), medians.end());
+    s.medianLow = percentile(medians, 0.025);
+    s.medianHigh = percentile(medians, 0.975);
+    return s;
+}
+
+std::vector<double> FrameReport::bootstrapMeans(const std::vector<double> &times, uint32_t seed)
+{
+    // Fixed seeds, so the same files give the same report
+    std::mt19937 rng(seed);
+    std::vector<double> means(BOOTSTRAP_SAMPLES, 0.0);
+    if(times.empty()) {
+        return means;
+    }
+    for(double& mean : means) {
+        double sum = 0.0;
+        resampleBlocks(times, BOOTSTRAP_BLOCK, rng, [&](double t) { sum += t; });
+        mean = sum / double(times.size());
+    }
+    std::sort(means.begin(), means.end());
+    return means;
+}
+
+bool FrameReport::writeJSON(const std::string &fileName) const
+{
+    std::ofstream file(fileName);
+    if(!file) {
+        return false;
+    }
+    file << "{\n\"unit\": \"ms\",\n\"total\": ";
+    writeSummaryJSON(file, mTotal);
+    file << ",\n\"segments\": [";
+    for(size_t s = 0; s < mSegments.size(); ++s) {
+        file << (s == 0 ? "\n" : ",\n");
+        writeSummaryJSON(file, mSegments[s]);
+    }
+    file << "\n]\n}\n";
+    return bool(file);
+}
+
+bool FrameReport::writeCSV(const std::string &fileName) const
+{
+    std::ofstream file(fileName);
+    if(!file) {
+        return false;
+    }
+    file << "segment,frames,mean,median,stddev,p1,p5,p95,p99,mean_low,mean_high,median_low,median_high\n";
+    writeSummaryCSV(file, "total", mTotal);
+    for(size_t s = 0; s < mSegments.size(); ++s) {
+        writeSummaryCSV(file, std::to_string(s), mSegments[s]);
+    }
+    return bool(file);
+}
+
+bool FrameReport::compare(const FrameReport &base, const FrameReport &other, std::ostream &out)
+{
+    printSummary(out, "Base", base.mTotal);
+    printSummary(out, "Other", other.mTotal);
+
+    // Differences of the resampled means of both runs, paired at random
+    const std::vector<double> baseMeans = bootstrapMeans(base.mTimes, 1);
+    std::vector<double> otherMeans = bootstrapMeans(other.mTimes, 3);
+    std::shuffle(otherMeans.begin(), otherMeans.end(), std::mt19937(4));
+    std::vector<double> differences(BOOTSTRAP_SAMPLES);
+    for(uint32_t i = 0; i < BOOTSTRAP_SAMPLES; ++i) {
+        differences[i] = otherMeans[i] - baseMeans[i];
+    }
+    std::sort(differences.begin(), differences.end());
+    const double low = percentile(differences, 0.025);
+    const double high = percentile(differences, 0.975);
+
+    const double difference = other.mTotal.mean - base.mTotal.mean;
+    out << "Mean frame time difference: " << difference << " ms (" <<
+           (base.mTotal.mean > 0.0 ? 100.0 * difference / base.mTotal.mean : 0.0) << "%), 95% interval [" <<
+           low << ", " << high << "]" << std::endl;
+
+    for(size_t s = 0; s < base.mSegments.size() && s < other.mSegments.size(); ++s) {
+        out << "\tsegment " << s << ": " << base.mSegments[s].mean << " -> " << other.mSegments[s].mean << " ms" << std::endl;
+    }
+
+    const bool regression = low > 0.0;
+    if(regression) {
+        out << "Significant regression" << std::endl;
+    } else if(high < 0.0) {
+        out << "Significant improvement" << std::endl;
+    } else {
+        out << "No significant difference" << std::endl;
+    }
+    return regression;
+}
@@ -0,0 +1,62 @@
+#ifndef FRAMEREPORT_HPP
+#define FRAMEREPORT_HPP
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <ostream>
+
+// Statistics of the frame times of a run, without the warm-up, for the whole route
+// of the camera and for each of its segments. The confidence intervals come from
+// a block bootstrap, since consecutive frames are correlated
+class FrameReport
+{
+public:
+    // Frame times in ms
+    struct Summary
+    {
+        size_t frames = 0;
+        double mean = 0.0;
+        double median = 0.0;
+        double stddev = 0.0;
+        double p1 = 0.0, p5 = 0.0, p95 = 0.0, p99 = 0.0;
+        // 95% confidence intervals
+        double meanLow = 0.0, meanHigh = 0.0;
+        double medianLow = 0.0, medianHigh = 0.0;
+    };
+
+    // frames are pairs of time since the start and duration of the frame, in s,
+    // along a route of the given duration and segments. Frames before warmup s
+    // are left out
+    FrameReport(const std::vector<std::pair<double, double>>& frames, double duration,
+                uint32_t numSegments, double warmup);
+
+    // Frame times written by -out
+    static bool readFrames(const std::string& fileName, std::vector<std::pair<double, double>>& frames);
+
+    const Summary& getTotal() const { return mTotal; }
+    const std::vector<Summary>& getSegments() const { return mSegments; }
+
+    bool writeJSON(const std::string& fileName) const;
+    bool writeCSV(const std::string& fileName) const;
+
+    // Prints both, and the difference of the mean frame times of other from base.
+    // True if other is significantly slower
+    static bool compare(const FrameReport& base, const FrameReport& other, std::ostream& out);
+
+private:
+    static constexpr uint32_t BOOTSTRAP_SAMPLES = 1000;
+    // Frames resampled together, longer than the correlation of the frame times
+    static constexpr uint32_t BOOTSTRAP_BLOCK = 32;
+
+    Summary mTotal;
+    std::vector<Summary> mSegments;
+    // Of mTotal, for the comparisons
+    std::vector<double> mTimes;
+
+    static Summary summarize(const std::vector<double>& times);
+    // Resampled means of the times, sorted
+    static std::vector<double> bootstrapMeans(const std::vector<double>& times, uint32_t seed);
+};
+
+#endif // FRAMEREPORT_HPP
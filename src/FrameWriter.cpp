@@ -0,0 +1,66 @@
+#include "FrameWriter.hpp"
+
+#include <chrono>
+
+FrameWriter::~FrameWriter()
+{
+    close();
+}
+
+bool FrameWriter::open(const std::string &fileName)
+{
+    close();
+    mFile.open(fileName, std::ofstream::out | std::ofstream::trunc);
+    if(!mFile) {
+        return false;
+    }
+    // The times of hours long runs still to the us
+    mFile.precision(10);
+    mStop = false;
+    mThread = std::thread(&FrameWriter::writerLoop, this);
+    return true;
+}
+
+void FrameWriter::close()
+{
+    if(mThread.joinable()) {
+        mStop = true;
+        mThread.join();
+    }
+    if(mFile.is_open()) {
+        mFile.close();
+    }
+}
+
+void FrameWriter::push(const Frame &frame)
+{
+    if(mFrames.push(frame)) {
+        return;
+    }
+    ++mFullWaits;
+    while(!mFrames.push(frame)) {
+        std::this_thread::yield();
+    }
+}
+
+void FrameWriter::writerLoop()
+{
+    Frame frame;
+    while(true) {
+        // Read before draining, so the frames pushed before close are written
+        const bool stop = mStop;
+        while(mFrames.pop(&frame)) {
+            mFile << frame.time << "\t" << frame.delta;
+            for(uint32_t s = 0; s < frame.numStats; ++s) {
+                mFile << "\t" << frame.stats[s];
+            }
+            mFile << "\n";
+        }
+        mFile.flush();
+        if(stop) {
+            return;
+        }
+        // Not spinning, to leave the cores to the frames being measured
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef FRAMEWRITER_HPP
+#define FRAMEWRITER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "SpscQueue.hpp"
+
+// Writes the times of the frames to a file while running, from a thread of its
+// own. The frames go through a ring buffer of fixed size, so long runs don't grow
+// in memory, and the file is flushed each time the buffer is drained, so a crash
+// only loses the last frames
+class FrameWriter
+{
+public:
+    static constexpr uint32_t MAX_STATS = 8;
+
+    struct Frame
+    {
+        double time;  // since the start, s
+        double delta; // duration, s
+        uint32_t numStats = 0;
+        uint64_t stats[MAX_STATS];
+    };
+
+    FrameWriter() = default;
+    ~FrameWriter();
+
+    // Truncates the file and starts the thread
+    bool open(const std::string& fileName);
+    // Writes what is left and stops the thread
+    void close();
+
+    // From a single thread. Waits for the writer if the buffer is full
+    void push(const Frame& frame);
+
+    // Times push had to wait for the writer
+    uint64_t getFullWaits() const { return mFullWaits; }
+
+private:
+    // Frames, about a minute at a few hundred fps
+    static constexpr size_t CAPACITY = 1 << 14;
+
+    std::ofstream mFile;
+    SpscQueue<Frame, CAPACITY> mFrames;
+    std::thread mThread;
+    std::atomic<bool> mStop{false};
+    uint64_t mFullWaits = 0;
+
+    void writerLoop();
+};
+
+#endif // FRAMEWRITER_HPP
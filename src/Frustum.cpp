@@ -0,0 +1,58 @@
+#include "Frustum.hpp"
+
+Frustum::Frustum(const glm::mat4 &viewProj)
+{
+    // Gribb and Hartmann
+    const glm::mat4 m = glm::transpose(viewProj);
+    for(uint32_t a = 0; a < 3; ++a) {
+        mPlanes[2 * a] = m[3] + m[a];
+        mPlanes[2 * a + 1] = m[3] - m[a];
+    }
+    for(glm::vec4& plane : mPlanes) {
+        plane /= glm::length(glm::vec3(plane));
+    }
+}
+
+Frustum::Result Frustum::testBox(const glm::vec3 &min, const glm::vec3 &max,
+                                 uint8_t *mask, uint8_t *lastPlane) const
+{
+    const glm::vec3 center = 0.5f * (min + max);
+    const glm::vec3 half = 0.5f * (max - min);
+
+    // Distance of the center and projected radius of the box give the side of the
+    // corner furthest along the normal (p-vertex) and of the opposite one (n-vertex)
+    auto test = [&](uint32_t p) {
+        const glm::vec3 normal(mPlanes[p]);
+        const float d = glm::dot(normal, center) + mPlanes[p].w;
+        const float r = glm::dot(half, glm::abs(normal));
+        if(d + r < 0.0f) {
+            return eOutside;
+        }
+        return d - r < 0.0f ? eIntersecting : eInside;
+    };
+
+    if((*mask >> *lastPlane) & 1) {
+        Result r = test(*lastPlane);
+        if(r == eOutside) {
+            return eOutside;
+        }
+        if(r == eInside) {
+            *mask &= ~(1 << *lastPlane);
+        }
+    }
+
+    for(uint32_t p = 0; p < 6; ++p) {
+        if(p == *lastPlane || ((*mask >> p) & 1) == 0) {
+            continue;
+        }
+        Result r = test(p);
+        if(r == eOutside) {
+            *lastPlane = (uint8_t)p;
+            return eOutside;
+        }
+        if(r == eInside) {
+            *mask &= ~(1 << p);
+        }
+    }
+    return *mask == 0 ? eInside : eIntersecting;
+}
@@ -0,0 +1,33 @@
+#ifndef FRUSTUM_HPP
+#define FRUSTUM_HPP
+
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Planes of a view frustum in world space, to cull a hierarchy of boxes: the
+// planes that a box is fully inside of also contain its children, so these skip them
+class Frustum
+{
+public:
+    static constexpr uint8_t ALL_PLANES = 0x3f;
+
+    enum Result {
+        eOutside,
+        eIntersecting,
+        eInside
+    };
+
+    Frustum() = default;
+    explicit Frustum(const glm::mat4& viewProj);
+
+    // Test a box against the planes in mask, which is replaced by the planes the box
+    // straddles, for its children. lastPlane is tested first, and is updated with
+    // the plane that rejects the box, since it will likely reject it next frame too
+    Result testBox(const glm::vec3& min, const glm::vec3& max, uint8_t* mask, uint8_t* lastPlane) const;
+
+private:
+    // Pointing inwards
+    glm::vec4 mPlanes[6];
+};
+
+#endif // FRUSTUM_HPP
@@ -0,0 +1,106 @@
+#include "FrustumBVH.hpp"
+
+#include <limits>
+#include <algorithm>
+
+void FrustumBVH::build(const Scene *scene)
+{
+    mScene = scene;
+    const uint32_t numInstances = (uint32_t)scene->numInstances();
+
+    mInstances.resize(numInstances);
+    for(uint32_t i = 0; i < numInstances; ++i) {
+        mInstances[i] = i;
+    }
+    mInstanceLastPlane.assign(numInstances, 0);
+
+    mNodes.clear();
+    mNodes.reserve(2 * (numInstances / LEAF_SIZE + 1));
+    if(numInstances != 0) {
+        buildNode(0, numInstances);
+    }
+}
+
+uint32_t FrustumBVH::buildNode(uint32_t first, uint32_t count)
+{
+    const uint32_t index = (uint32_t)mNodes.size();
+    mNodes.emplace_back();
+
+    glm::vec3 min( std::numeric_limits<float>::infinity());
+    glm::vec3 max(-std::numeric_limits<float>::infinity());
+    glm::vec3 centerMin = min;
+    glm::vec3 centerMax = max;
+    for(uint32_t k = first; k < first + count; ++k) {
+        const uint32_t i = mInstances[k];
+        min = glm::min(min, mScene->getInstanceMin(i));
+        max = glm::max(max, mScene->getInstanceMax(i));
+        const glm::vec3 center = mScene->getInstanceMin(i) + mScene->getInstanceMax(i);
+        centerMin = glm::min(centerMin, center);
+        centerMax = glm::max(centerMax, center);
+    }
+
+    uint32_t secondChild = 0;
+    if(count > LEAF_SIZE) {
+        // Median of the centers along the axis where they spread more
+        const glm::vec3 extent = centerMax - centerMin;
+        const uint32_t axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+        const uint32_t half = count / 2;
+        std::nth_element(mInstances.begin() + first, mInstances.begin() + first + half, mInstances.begin() + first + count,
+                         [&](uint32_t a, uint32_t b) {
+            return mScene->getInstanceMin(a)[axis] + mScene->getInstanceMax(a)[axis] <
+                   mScene->getInstanceMin(b)[axis] + mScene->getInstanceMax(b)[axis];
+        });
+        buildNode(first, half);
+        secondChild = buildNode(first + half, count - half);
+    }
+
+    // After the children, the vector may have grown
+    Node& node = mNodes[index];
+    node.min = min;
+    node.max = max;
+    node.first = first;
+    node.count = count;
+    node.secondChild = secondChild;
+    return index;
+}
+
+void FrustumBVH::cull(const glm::mat4 &viewProj, std::vector<uint32_t> &visible)
+{
+    visible.clear();
+    mTestedBoxes = 0;
+    if(mNodes.empty()) {
+        return;
+    }
+    cullNode(0, Frustum::ALL_PLANES, Frustum(viewProj), visible);
+}
+
+void FrustumBVH::cullNode(uint32_t index, uint8_t mask, const Frustum &frustum, std::vector<uint32_t> &visible)
+{
+    Node& node = mNodes[index];
+    ++mTestedBoxes;
+    Frustum::Result result = frustum.testBox(node.min, node.max, &mask, &node.lastPlane);
+    if(result == Frustum::eOutside) {
+        return;
+    }
+    if(result == Frustum::eInside) {
+        visible.insert(visible.end(), mInstances.begin() + node.first, mInstances.begin() + node.first + node.count);
+        return;
+    }
+
+    if(node.secondChild != 0) {
+        cullNode(index + 1, mask, frustum, visible);
+        cullNode(node.secondChild, mask, frustum, visible);
+        return;
+    }
+
+    // Leaf straddling some planes, its instances only test those
+    for(uint32_t k = node.first; k < node.first + node.count; ++k) {
+        const uint32_t i = mInstances[k];
+        uint8_t instanceMask = mask;
+        ++mTestedBoxes;
+        if(frustum.testBox(mScene->getInstanceMin(i), mScene->getInstanceMax(i),
+                           &instanceMask, &mInstanceLastPlane[i]) != Frustum::eOutside) {
+            visible.push_back(i);
+        }
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef FRUSTUMBVH_HPP
+#define FRUSTUMBVH_HPP
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+#include "Frustum.hpp"
+#include "Scene.hpp"
+
+// Bounding volume hierarchy over the boxes of the instances of a scene, only for
+// frustum culling, so without GL objects. Nodes fully inside of the frustum take
+// their whole subtree without testing it, and the others only test their children
+// against the planes they straddle
+class FrustumBVH
+{
+public:
+    FrustumBVH() = default;
+
+    void build(const Scene* scene);
+
+    // Replace visible with the instances whose box is in the frustum of viewProj.
+    // Not const, each node remembers the last plane that rejected it
+    void cull(const glm::mat4& viewProj, std::vector<uint32_t>& visible);
+
+    size_t numNodes() const { return mNodes.size(); }
+    // Boxes tested, of nodes and instances, in the last cull
+    uint32_t getTestedBoxes() const { return mTestedBoxes; }
+
+private:
+    // Depth first, so the first child of an inner node is the next one
+    struct Node
+    {
+        glm::vec3 min;
+        uint32_t first;     // of its instances in mInstances
+        glm::vec3 max;
+        uint32_t count;
+        uint32_t secondChild; // 0 in the leaves
+        uint8_t lastPlane = 0;
+    };
+
+    static constexpr uint32_t LEAF_SIZE = 4;
+
+    const Scene* mScene = nullptr;
+    std::vector<Node> mNodes;
+    // Instances in the order of the leaves, so each node covers a range
+    std::vector<uint32_t> mInstances;
+    // Last plane that rejected each instance
+    std::vector<uint8_t> mInstanceLastPlane;
+    uint32_t mTestedBoxes = 0;
+
+    uint32_t buildNode(uint32_t first, uint32_t count);
+    void cullNode(uint32_t node, uint8_t mask, const Frustum& frustum, std::vector<uint32_t>& visible);
+};
+
+#endif // FRUSTUMBVH_HPP
@@ -0,0 +1,148 @@
+#include "GeometryArena.hpp"
+
+#include <algorithm>
+#include <glad/glad.h>
+
+GeometryArena::GeometryArena()
+{
+    glGenVertexArrays(1, &mVAO);
+    glGenBuffers(1, &mVertexBO);
+    glGenBuffers(1, &mIndexBO);
+    glGenBuffers(1, &mInstanceBO);
+    glGenBuffers(1, &mTransformBO);
+
+    glGenVertexArrays(1, &mBatchVAO);
+    glGenBuffers(1, &mBatchInstanceBO);
+
+    // The vertex format is set by the meshes, the instance ids are always the same
+    glBindVertexArray(mVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, mInstanceBO);
+    uint32_t id = 0;
+    glBufferData(GL_ARRAY_BUFFER, sizeof(id), &id, GL_DYNAMIC_DRAW);
+    glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(uint32_t), (void*)0);
+    glEnableVertexAttribArray(3);
+    glVertexAttribDivisor(3, 1);
+
+    glBindVertexArray(mBatchVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, mBatchInstanceBO);
+    glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(uint32_t), (void*)0);
+    glEnableVertexAttribArray(3);
+    glVertexAttribDivisor(3, 1);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+
+    // A storage buffer can't be empty
+    InstanceTransform identity;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, mTransformBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(identity), &identity, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+GeometryArena::~GeometryArena()
+{
+    glDeleteBuffers(1, &mVertexBO);
+    glDeleteBuffers(1, &mIndexBO);
+    glDeleteBuffers(1, &mInstanceBO);
+    glDeleteBuffers(1, &mTransformBO);
+    glDeleteVertexArrays(1, &mVAO);
+
+    glDeleteBuffers(1, &mBatchInstanceBO);
+    glDeleteVertexArrays(1, &mBatchVAO);
+}
+
+bool GeometryArena::append(const void* vertices, uint32_t numVertices, uint32_t vertexSize,
+                           const uint32_t* indices, uint32_t numIndices,
+                           uint32_t* baseVertex, uint32_t* firstIndex)
+{
+    if(mNumVertices != 0 && vertexSize != mVertexSize) {
+        return false;
+    }
+    mVertexSize = vertexSize;
+
+    const size_t vertexUsed = size_t(mNumVertices) * mVertexSize;
+    const size_t indexUsed = size_t(mNumIndices) * sizeof(uint32_t);
+    const size_t vertexBytes = size_t(numVertices) * mVertexSize;
+    const size_t indexBytes = size_t(numIndices) * sizeof(uint32_t);
+    grow(mVertexBO, vertexUsed, vertexUsed + vertexBytes, &mVertexCapacity);
+    grow(mIndexBO, indexUsed, indexUsed + indexBytes, &mIndexCapacity);
+
+    // The copy targets do not touch the element buffer of any vao
+    glBindBuffer(GL_COPY_WRITE_BUFFER, mVertexBO);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, vertexUsed, vertexBytes, vertices);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, mIndexBO);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, indexUsed, indexBytes, indices);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    *baseVertex = mNumVertices;
+    *firstIndex = mNumIndices;
+    mNumVertices += numVertices;
+    mNumIndices += numIndices;
+    return true;
+}
+
+void GeometryArena::clear()
+{
+    mNumVertices = 0;
+    mNumIndices = 0;
+}
+
+void GeometryArena::setInstances(const std::vector<InstanceTransform>& transforms)
+{
+    if(transforms.empty()) {
+        return;
+    }
+
+    std::vector<uint32_t> ids(transforms.size());
+    for(uint32_t i = 0; i < ids.size(); ++i) {
+        ids[i] = i;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, mInstanceBO);
+    glBufferData(GL_ARRAY_BUFFER,
+                 sizeof(uint32_t) * ids.size(),
+                 ids.data(),
+                 GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, mTransformBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER,
+                 sizeof(InstanceTransform) * transforms.size(),
+                 transforms.data(),
+                 GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void GeometryArena::bindTransforms() const
+{
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, mTransformBO);
+}
+
+void GeometryArena::grow(uint32_t buffer, size_t used, size_t size, size_t* capacity)
+{
+    if(size <= *capacity) {
+        return;
+    }
+    // Doubling, so loading many meshes copies each byte a constant number of times
+    const size_t newCapacity = std::max(size, 2 * *capacity);
+
+    uint32_t tmp = 0;
+    if(used != 0) {
+        glGenBuffers(1, &tmp);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, tmp);
+        glBufferData(GL_COPY_WRITE_BUFFER, used, nullptr, GL_STREAM_COPY);
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used);
+    }
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, newCapacity, nullptr, GL_STATIC_DRAW);
+
+    if(used != 0) {
+        glBindBuffer(GL_COPY_READ_BUFFER, tmp);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used);
+        glDeleteBuffers(1, &tmp);
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    *capacity = newCapacity;
+}
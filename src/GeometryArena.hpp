@@ -0,0 +1,76 @@
+#ifndef GEOMETRYARENA_HPP
+#define GEOMETRYARENA_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <glm/glm.hpp>
+
+#include "InstanceTransform.hpp"
+
+// Vertex, index and instance buffers shared by several meshes, so that all of them
+// are drawn from the same vao, each with its own base vertex and first index.
+// The vaos have the id of the instance as attribute 3, and the shaders read its
+// transform from the storage buffer at binding 2 (0 and 1 are used by the Hi-Z test)
+class GeometryArena
+{
+public:
+    GeometryArena();
+    ~GeometryArena();
+
+    GeometryArena(const GeometryArena&o) = delete;
+    GeometryArena& operator=(const GeometryArena&o) = delete;
+
+    // Copy the vertices and indices of a mesh after the ones already in the arena,
+    // growing the buffers if needed. All the meshes need vertices of the same size,
+    // returns false otherwise
+    bool append(const void* vertices, uint32_t numVertices, uint32_t vertexSize,
+                const uint32_t* indices, uint32_t numIndices,
+                uint32_t* baseVertex, uint32_t* firstIndex);
+
+    // Forget the geometry, keeping the buffers
+    void clear();
+
+    // Transforms of all the instances. The instance ids of the vao are 0..n-1, so
+    // the base instance of the draws selects the instance
+    void setInstances(const std::vector<InstanceTransform>& transforms);
+
+    // Bind the transforms for the shaders
+    void bindTransforms() const;
+
+    uint32_t getVAO() const { return mVAO; }
+    uint32_t getVertexBO() const { return mVertexBO; }
+    uint32_t getIndexBO() const { return mIndexBO; }
+    uint32_t getInstanceBO() const { return mInstanceBO; }
+    uint32_t getTransformBO() const { return mTransformBO; }
+
+    // Same geometry, with the instance ids taken from a buffer filled per draw
+    uint32_t getBatchVAO() const { return mBatchVAO; }
+    uint32_t getBatchInstanceBO() const { return mBatchInstanceBO; }
+
+    uint32_t numVertices() const { return mNumVertices; }
+    uint32_t numIndices() const { return mNumIndices; }
+
+private:
+    uint32_t mVAO;
+    uint32_t mVertexBO;
+    uint32_t mIndexBO;
+    uint32_t mInstanceBO;
+    uint32_t mTransformBO;
+
+    uint32_t mBatchVAO;
+    uint32_t mBatchInstanceBO;
+
+    uint32_t mVertexSize = 0;
+    uint32_t mNumVertices = 0;
+    uint32_t mNumIndices = 0;
+    // In bytes
+    size_t mVertexCapacity = 0;
+    size_t mIndexCapacity = 0;
+
+    // Make room for size bytes, keeping the first used bytes and the buffer name,
+    // so the vaos still point to it
+    static void grow(uint32_t buffer, size_t used, size_t size, size_t* capacity);
+};
+
+#endif // GEOMETRYARENA_HPP
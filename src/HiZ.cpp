@@ -0,0 +1,263 @@
+#include "HiZ.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <glad/glad.h>
+
+namespace {
+uint32_t nextPowerOfTwo(uint32_t v) {
+    uint32_t p = 1;
+    while(p < v) {
+        p <<= 1;
+    }
+    return p;
+}
+}
+
+HiZ::HiZ()
+{
+    glGenTextures(1, &mDepthTex);
+    glGenTextures(1, &mPyramidTex);
+    glGenBuffers(1, &mBoxesSSBO);
+    glGenBuffers(1, &mVisibleSSBO);
+}
+
+HiZ::~HiZ()
+{
+    glDeleteTextures(1, &mDepthTex);
+    glDeleteTextures(1, &mPyramidTex);
+    glDeleteBuffers(1, &mBoxesSSBO);
+    glDeleteBuffers(1, &mVisibleSSBO);
+}
+
+void HiZ::setPrograms(uint32_t buildProgram, uint32_t testProgram)
+{
+    mBuildProgram = buildProgram;
+    mTestProgram = testProgram;
+}
+
+void HiZ::resize(uint32_t width, uint32_t height)
+{
+    if(mSize == glm::ivec2(width, height)) {
+        return;
+    }
+    mSize = glm::ivec2(width, height);
+
+    mLevelSize.clear();
+    glm::ivec2 s(nextPowerOfTwo(width), nextPowerOfTwo(height));
+    mLevelSize.push_back(s);
+    while(s.x > 1 || s.y > 1) {
+        s = glm::max(s / 2, glm::ivec2(1));
+        mLevelSize.push_back(s);
+    }
+    mLevels.resize(mLevelSize.size());
+    for(uint32_t i = 0; i < mLevelSize.size(); ++i) {
+        mLevels[i].resize(size_t(mLevelSize[i].x) * mLevelSize[i].y);
+    }
+
+    // Immutable storage can't be resized, so create the textures again
+    glDeleteTextures(1, &mDepthTex);
+    glDeleteTextures(1, &mPyramidTex);
+    glGenTextures(1, &mDepthTex);
+    glGenTextures(1, &mPyramidTex);
+
+    glBindTexture(GL_TEXTURE_2D, mDepthTex);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glBindTexture(GL_TEXTURE_2D, mPyramidTex);
+    glTexStorage2D(GL_TEXTURE_2D, numLevels(), GL_R32F, mLevelSize[0].x, mLevelSize[0].y);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void HiZ::build(uint32_t width, uint32_t height, const glm::mat4 &viewProj)
+{
+    if(!mUseCompute) {
+        // Reading back the depth waits for all the rendering of the frame
+        mReadDepth.resize(size_t(width) * height);
+        glReadPixels(0, 0, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, mReadDepth.data());
+        buildFromDepth(mReadDepth.data(), width, height, viewProj);
+        return;
+    }
+
+    assert(mBuildProgram != 0);
+    resize(width, height);
+    mViewProj = viewProj;
+
+    int32_t prevProgram;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &prevProgram);
+
+    // Copy the depth of the framebuffer
+    glBindTexture(GL_TEXTURE_2D, mDepthTex);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+
+    glUseProgram(mBuildProgram);
+    glActiveTexture(GL_TEXTURE0);
+    for(uint32_t i = 0; i < numLevels(); ++i) {
+        glUniform1i(0, i);
+        if(i > 0) {
+            glBindImageTexture(0, mPyramidTex, i - 1, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+        }
+        glBindImageTexture(1, mPyramidTex, i, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glDispatchCompute((mLevelSize[i].x + 7) / 8, (mLevelSize[i].y + 7) / 8, 1);
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glUseProgram(prevProgram);
+
+    mGPUValid = true;
+    mCPUValid = false;
+}
+
+void HiZ::buildFromDepth(const float *depth, uint32_t width, uint32_t height, const glm::mat4 &viewProj)
+{
+    resize(width, height);
+    mViewProj = viewProj;
+
+    std::vector<float>& level0 = mLevels[0];
+    const glm::ivec2 s0 = mLevelSize[0];
+    std::fill(level0.begin(), level0.end(), 0.0f);
+    for(uint32_t y = 0; y < height; ++y) {
+        std::copy(depth + size_t(y) * width, depth + size_t(y + 1) * width,
+                  level0.begin() + size_t(y) * s0.x);
+    }
+
+    for(uint32_t i = 1; i < numLevels(); ++i) {
+        const std::vector<float>& src = mLevels[i - 1];
+        const glm::ivec2 sSize = mLevelSize[i - 1];
+        std::vector<float>& dst = mLevels[i];
+        const glm::ivec2 dSize = mLevelSize[i];
+        for(int32_t y = 0; y < dSize.y; ++y) {
+            int32_t y0 = 2 * y, y1 = std::min(2 * y + 1, sSize.y - 1);
+            for(int32_t x = 0; x < dSize.x; ++x) {
+                int32_t x0 = 2 * x, x1 = std::min(2 * x + 1, sSize.x - 1);
+                dst[size_t(y) * dSize.x + x] = std::max(
+                    std::max(src[size_t(y0) * sSize.x + x0], src[size_t(y0) * sSize.x + x1]),
+                    std::max(src[size_t(y1) * sSize.x + x0], src[size_t(y1) * sSize.x + x1]));
+            }
+        }
+    }
+
+    mCPUValid = true;
+    mGPUValid = false;
+}
+
+bool HiZ::testBox(const glm::vec3 &min, const glm::vec3 &max)
+{
+    if(!mCPUValid) {
+        readback();
+    }
+
+    glm::vec3 ndcMin( std::numeric_limits<float>::infinity());
+    glm::vec3 ndcMax(-std::numeric_limits<float>::infinity());
+    for(uint32_t i = 0; i < 8; ++i) {
+        glm::vec3 interp(i & 0b1, (i & 0b10) >> 1, (i & 0b100) >> 2);
+        glm::vec4 corner = mViewProj * glm::vec4(min * (1.0f - interp) + max * interp, 1.0f);
+        if(corner.w <= 1e-5f) {
+            // Crosses the camera plane
+            return true;
+        }
+        glm::vec3 ndc = glm::vec3(corner) / corner.w;
+        ndcMin = glm::min(ndcMin, ndc);
+        ndcMax = glm::max(ndcMax, ndc);
+    }
+
+    if(ndcMin.x > 1.0f || ndcMin.y > 1.0f || ndcMax.x < -1.0f || ndcMax.y < -1.0f) {
+        return false;
+    }
+
+    glm::vec2 size(mSize);
+    glm::vec2 pMin = glm::clamp(glm::vec2(ndcMin) * 0.5f + 0.5f, 0.0f, 1.0f) * size;
+    glm::vec2 pMax = glm::clamp(glm::vec2(ndcMax) * 0.5f + 0.5f, 0.0f, 1.0f) * size;
+
+    // Level where the rectangle covers at most 2x2 texels
+    float extent = std::max(std::max(pMax.x - pMin.x, pMax.y - pMin.y), 1.0f);
+    uint32_t lod = std::min((uint32_t)std::ceil(std::log2(extent)), numLevels() - 1);
+    // Last texel of each level with pixels of the framebuffer, not of the padding
+    const glm::ivec2 lvlMax = (mSize - 1) >> int32_t(lod);
+    glm::ivec2 t0 = glm::min(glm::ivec2(pMin) >> int32_t(lod), lvlMax);
+    glm::ivec2 t1 = glm::min(glm::ivec2(pMax) >> int32_t(lod), lvlMax);
+
+    const std::vector<float>& level = mLevels[lod];
+    float maxDepth = 0.0f;
+    for(int32_t y = t0.y; y <= t1.y; ++y) {
+        for(int32_t x = t0.x; x <= t1.x; ++x) {
+            maxDepth = std::max(maxDepth, level[size_t(y) * mLevelSize[lod].x + x]);
+        }
+    }
+
+    float boxDepth = ndcMin.z * 0.5f + 0.5f;
+    return boxDepth <= maxDepth;
+}
+
+void HiZ::testBoxesGPU(const std::vector<glm::vec4> &boxes, std::vector<uint32_t> &visible)
+{
+    assert(mTestProgram != 0 && boxes.size() % 2 == 0);
+    if(!mGPUValid) {
+        upload();
+    }
+
+    uint32_t numBoxes = (uint32_t)boxes.size() / 2;
+    visible.resize(numBoxes);
+    if(numBoxes == 0) {
+        return;
+    }
+
+    int32_t prevProgram;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &prevProgram);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, mBoxesSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, boxes.size() * sizeof(glm::vec4), boxes.data(), GL_STREAM_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, mBoxesSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, mVisibleSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, numBoxes * sizeof(uint32_t), nullptr, GL_STREAM_READ);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, mVisibleSSBO);
+
+    glUseProgram(mTestProgram);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, mPyramidTex);
+    glUniformMatrix4fv(0, 1, GL_FALSE, &mViewProj[0][0]);
+    glUniform1ui(1, numBoxes);
+    glUniform1i(2, numLevels());
+    glUniform2i(3, mSize.x, mSize.y);
+    glDispatchCompute((numBoxes + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    // Waits for the results
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, numBoxes * sizeof(uint32_t), visible.data());
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glUseProgram(prevProgram);
+}
+
+void HiZ::readback()
+{
+    assert(mGPUValid);
+    glBindTexture(GL_TEXTURE_2D, mPyramidTex);
+    for(uint32_t i = 0; i < numLevels(); ++i) {
+        glGetTexImage(GL_TEXTURE_2D, i, GL_RED, GL_FLOAT, mLevels[i].data());
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    mCPUValid = true;
+}
+
+void HiZ::upload()
+{
+    assert(mCPUValid);
+    glBindTexture(GL_TEXTURE_2D, mPyramidTex);
+    for(uint32_t i = 0; i < numLevels(); ++i) {
+        glTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, mLevelSize[i].x, mLevelSize[i].y,
+                        GL_RED, GL_FLOAT, mLevels[i].data());
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    mGPUValid = true;
+}
@@ -0,0 +1,70 @@
+#ifndef HIZ_HPP
+#define HIZ_HPP
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Hierarchical max-depth buffer. Each texel of level i stores the maximum depth
+// of the 2x2 texels of level i-1 that it covers, so a box whose nearest depth is
+// farther than the texels under its screen rectangle is hidden
+class HiZ
+{
+public:
+    HiZ();
+    ~HiZ();
+
+    HiZ& operator=(const HiZ&o) = delete;
+
+    // Programs from shaders/hiz.comp and shaders/hiz_test.comp
+    void setPrograms(uint32_t buildProgram, uint32_t testProgram);
+
+    // Build the pyramid with a compute shader, or reading back the depth buffer
+    void setUseCompute(bool useCompute) { mUseCompute = useCompute; }
+    bool usesCompute() const { return mUseCompute; }
+
+    // Build the pyramid from the depth buffer of the actual framebuffer, rendered
+    // with viewProj. Resizes the pyramid if the framebuffer size changed
+    void build(uint32_t width, uint32_t height, const glm::mat4& viewProj);
+
+    // Build the pyramid in the CPU from a depth buffer, with the first row at the bottom.
+    // The pyramid is padded to a power of two, and the padding does not hide anything
+    void buildFromDepth(const float* depth, uint32_t width, uint32_t height, const glm::mat4& viewProj);
+
+    // Test a world space box against the CPU pyramid. Returns false if it is hidden.
+    // When built with compute, the first call after build reads back the pyramid
+    bool testBox(const glm::vec3& min, const glm::vec3& max);
+
+    // Test a batch of world space boxes, in pairs of min and max, with the compute shader
+    void testBoxesGPU(const std::vector<glm::vec4>& boxes, std::vector<uint32_t>& visible);
+
+    uint32_t numLevels() const { return (uint32_t)mLevelSize.size(); }
+    const glm::mat4& getViewProj() const { return mViewProj; }
+
+private:
+    bool mUseCompute = true;
+    glm::mat4 mViewProj = glm::mat4(1.0f);
+
+    // Size of the depth buffer, and of each level of the pyramid
+    glm::ivec2 mSize = glm::ivec2(0);
+    std::vector<glm::ivec2> mLevelSize;
+    // CPU copy of the pyramid
+    std::vector<std::vector<float>> mLevels;
+    bool mCPUValid = false;
+    bool mGPUValid = false;
+    std::vector<float> mReadDepth;
+
+    uint32_t mBuildProgram = 0;
+    uint32_t mTestProgram = 0;
+
+    uint32_t mDepthTex;
+    uint32_t mPyramidTex;
+    uint32_t mBoxesSSBO;
+    uint32_t mVisibleSSBO;
+
+    void resize(uint32_t width, uint32_t height);
+    void readback();
+    void upload();
+};
+
+#endif // HIZ_HPP
@@ -0,0 +1,50 @@
+#include "InstanceTransform.hpp"
+
+#include <cmath>
+
+glm::vec4 InstanceTransform::axisAngle(const glm::vec3& axis, float angle)
+{
+    return glm::vec4(axis * std::sin(0.5f * angle), std::cos(0.5f * angle));
+}
+
+glm::vec4 InstanceTransform::compose(const glm::vec4& b, const glm::vec4& a)
+{
+    const glm::vec3 bv(b), av(a);
+    return glm::vec4(b.w * av + a.w * bv + glm::cross(bv, av), b.w * a.w - glm::dot(bv, av));
+}
+
+glm::vec3 InstanceTransform::rotate(const glm::vec3& v) const
+{
+    // Same as in the shaders
+    const glm::vec3 q(rotation);
+    return v + 2.0f * glm::cross(q, glm::cross(q, v) + rotation.w * v);
+}
+
+glm::mat4 InstanceTransform::toMatrix() const
+{
+    glm::mat4 m(1.0f);
+    for(int c = 0; c < 3; ++c) {
+        glm::vec3 axis(0.0f);
+        axis[c] = 1.0f;
+        m[c] = glm::vec4(scale * rotate(axis), 0.0f);
+    }
+    m[3] = glm::vec4(position, 1.0f);
+    return m;
+}
+
+void InstanceTransform::transformBox(const glm::vec3& min, const glm::vec3& max,
+                                     glm::vec3* outMin, glm::vec3* outMax) const
+{
+    // The extent of the box along each world axis is the sum of the absolute
+    // values of the rotated half sizes (Arvo)
+    const glm::vec3 center = apply(0.5f * (min + max));
+    const glm::vec3 half = 0.5f * scale * (max - min);
+    glm::vec3 extent(0.0f);
+    for(int c = 0; c < 3; ++c) {
+        glm::vec3 axis(0.0f);
+        axis[c] = half[c];
+        extent += glm::abs(rotate(axis));
+    }
+    *outMin = center - extent;
+    *outMax = center + extent;
+}
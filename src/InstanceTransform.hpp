@@ -0,0 +1,34 @@
+#ifndef INSTANCETRANSFORM_HPP
+#define INSTANCETRANSFORM_HPP
+
+#include <glm/glm.hpp>
+
+// Rotation, uniform scale and translation of an instance, applied after the model
+// matrix of its mesh: p' = position + scale * rotate(p). 32 bytes, with the layout
+// of the storage buffer of the shaders
+struct InstanceTransform
+{
+    glm::vec4 rotation = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f); // unit quaternion, w last
+    glm::vec3 position = glm::vec3(0.0f);
+    float scale = 1.0f;
+
+    InstanceTransform() = default;
+    explicit InstanceTransform(const glm::vec3& position) : position(position) {}
+
+    // Rotation of angle radians around a unit axis
+    static glm::vec4 axisAngle(const glm::vec3& axis, float angle);
+    // Rotation of b after a
+    static glm::vec4 compose(const glm::vec4& b, const glm::vec4& a);
+
+    glm::vec3 rotate(const glm::vec3& v) const;
+    glm::vec3 apply(const glm::vec3& p) const { return position + scale * rotate(p); }
+    glm::mat4 toMatrix() const;
+
+    // Axis aligned box containing the transformed box
+    void transformBox(const glm::vec3& min, const glm::vec3& max,
+                      glm::vec3* outMin, glm::vec3* outMax) const;
+};
+
+static_assert(sizeof(InstanceTransform) == 32, "InstanceTransform must match the shaders");
+
+#endif // INSTANCETRANSFORM_HPP
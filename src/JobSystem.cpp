@@ -0,0 +1,124 @@
+#include "JobSystem.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+JobSystem::JobSystem(uint32_t numThreads)
+{
+    numThreads = std::max(1u, numThreads);
+    for(uint32_t t = 0; t < numThreads; ++t) {
+        mQueues.push_back(std::make_unique<Queue>());
+    }
+    for(uint32_t t = 1; t < numThreads; ++t) {
+        mThreads.emplace_back(&JobSystem::workerLoop, this, t);
+    }
+}
+
+JobSystem::~JobSystem()
+{
+    {
+        std::lock_guard<std::mutex> lock(mWakeMutex);
+        mStop = true;
+    }
+    mWake.notify_all();
+    for(std::thread& t : mThreads) {
+        t.join();
+    }
+}
+
+void JobSystem::parallelFor(uint32_t n, uint32_t chunkSize,
+                            const std::function<void(uint32_t, uint32_t, uint32_t)>& f)
+{
+    if(n == 0) {
+        return;
+    }
+    chunkSize = std::max(1u, chunkSize);
+    const uint32_t numChunks = (n + chunkSize - 1) / chunkSize;
+    if(mThreads.empty() || numChunks == 1) {
+        for(uint32_t begin = 0; begin < n; begin += chunkSize) {
+            f(begin, std::min(n, begin + chunkSize), 0);
+        }
+        return;
+    }
+
+    assert(mRemaining == 0);
+    mFunction = &f;
+    mRemaining = numChunks;
+
+    // Consecutive chunks to the same thread, so each one walks contiguous memory
+    // until it runs out and steals
+    const uint32_t numQueues = numThreads();
+    for(uint32_t q = 0; q < numQueues; ++q) {
+        const uint32_t first = uint32_t(uint64_t(numChunks) * q / numQueues);
+        const uint32_t last = uint32_t(uint64_t(numChunks) * (q + 1) / numQueues);
+        std::lock_guard<std::mutex> lock(mQueues[q]->mutex);
+        for(uint32_t c = first; c < last; ++c) {
+            mQueues[q]->jobs.push_back({c * chunkSize, std::min(n, (c + 1) * chunkSize)});
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mWakeMutex);
+        ++mGeneration;
+    }
+    mWake.notify_all();
+
+    runJobs(0);
+    // The last chunks may still be running in other threads
+    while(mRemaining.load(std::memory_order_acquire) != 0) {
+        std::this_thread::yield();
+    }
+    mFunction = nullptr;
+}
+
+void JobSystem::workerLoop(uint32_t thread)
+{
+    uint64_t generation = 0;
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(mWakeMutex);
+            mWake.wait(lock, [&] { return mStop || mGeneration != generation; });
+            if(mStop) {
+                return;
+            }
+            generation = mGeneration;
+        }
+        runJobs(thread);
+    }
+}
+
+void JobSystem::runJobs(uint32_t thread)
+{
+    Job job;
+    while(popJob(thread, &job) || stealJob(thread, &job)) {
+        (*mFunction)(job.begin, job.end, thread);
+        mRemaining.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+bool JobSystem::popJob(uint32_t thread, Job* job)
+{
+    Queue& queue = *mQueues[thread];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if(queue.jobs.empty()) {
+        return false;
+    }
+    *job = queue.jobs.front();
+    queue.jobs.pop_front();
+    return true;
+}
+
+bool JobSystem::stealJob(uint32_t thread, Job* job)
+{
+    // From the back, the chunks furthest from the ones the owner is running
+    for(uint32_t i = 1; i < mQueues.size(); ++i) {
+        Queue& queue = *mQueues[(thread + i) % mQueues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if(!queue.jobs.empty()) {
+            *job = queue.jobs.back();
+            queue.jobs.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
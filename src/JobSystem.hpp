@@ -0,0 +1,68 @@
+#ifndef JOBSYSTEM_HPP
+#define JOBSYSTEM_HPP
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <cstdint>
+
+// Fixed set of worker threads that run the chunks of parallel loops. Each thread
+// has its own queue of chunks, and when it is empty takes them from the back of
+// the queues of the others (work stealing), so uneven chunks still balance
+class JobSystem
+{
+public:
+    // numThreads counts the calling thread, so with 1 everything runs inline
+    explicit JobSystem(uint32_t numThreads);
+    ~JobSystem();
+
+    JobSystem(const JobSystem&o) = delete;
+    JobSystem& operator=(const JobSystem&o) = delete;
+
+    uint32_t numThreads() const { return (uint32_t)mQueues.size(); }
+
+    // Run f(begin, end, thread) over [0, n) in chunks of chunkSize, and return once
+    // all of them are done. The calling thread runs chunks too, as thread 0.
+    // Only one thread can call it at a time
+    void parallelFor(uint32_t n, uint32_t chunkSize,
+                     const std::function<void(uint32_t, uint32_t, uint32_t)>& f);
+
+private:
+    struct Job
+    {
+        uint32_t begin;
+        uint32_t end;
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    std::vector<std::unique_ptr<Queue>> mQueues;
+    std::vector<std::thread> mThreads;
+
+    // The loop being run, valid while mRemaining is not 0
+    const std::function<void(uint32_t, uint32_t, uint32_t)>* mFunction = nullptr;
+    std::atomic<uint32_t> mRemaining{0};
+
+    // The workers sleep while there is no loop
+    std::mutex mWakeMutex;
+    std::condition_variable mWake;
+    uint64_t mGeneration = 0;
+    bool mStop = false;
+
+    void workerLoop(uint32_t thread);
+    // Run the chunks of the own queue and then steal, until all are taken
+    void runJobs(uint32_t thread);
+    bool popJob(uint32_t thread, Job* job);
+    bool stealJob(uint32_t thread, Job* job);
+};
+
+#endif // JOBSYSTEM_HPP
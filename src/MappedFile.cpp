@@ -0,0 +1,107 @@
+#include "MappedFile.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string &fileName)
+{
+    close();
+
+    mFile = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(mFile == INVALID_HANDLE_VALUE) {
+        mFile = nullptr;
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(mFile, &size) || size.QuadPart == 0) {
+        close();
+        return false;
+    }
+    mSize = size_t(size.QuadPart);
+
+    mMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if(mMapping == nullptr) {
+        close();
+        return false;
+    }
+    mData = (const uint8_t*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+    if(mData == nullptr) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::close()
+{
+    if(mData != nullptr) {
+        UnmapViewOfFile(mData);
+    }
+    if(mMapping != nullptr) {
+        CloseHandle(mMapping);
+    }
+    if(mFile != nullptr) {
+        CloseHandle(mFile);
+    }
+    mData = nullptr;
+    mMapping = nullptr;
+    mFile = nullptr;
+    mSize = 0;
+}
+
+#else
+
+bool MappedFile::open(const std::string &fileName)
+{
+    close();
+
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* ptr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+    if(ptr == MAP_FAILED) {
+        return false;
+    }
+
+    mData = (const uint8_t*)ptr;
+    mSize = size_t(st.st_size);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if(mData != nullptr) {
+        munmap((void*)mData, mSize);
+    }
+    mData = nullptr;
+    mSize = 0;
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&o) = delete;
+    MappedFile& operator=(const MappedFile&o) = delete;
+
+    // Returns false if the file can't be opened or mapped
+    bool open(const std::string& fileName);
+    void close();
+
+    bool isOpen() const { return mData != nullptr; }
+    const uint8_t* data() const { return mData; }
+    size_t size() const { return mSize; }
+
+private:
+    const uint8_t* mData = nullptr;
+    size_t mSize = 0;
+
+#ifdef _WIN32
+    void* mFile = nullptr;
+    void* mMapping = nullptr;
+#endif
+};
+
+#endif // MAPPEDFILE_HPP
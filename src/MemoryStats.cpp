@@ -0,0 +1,141 @@
+#include "MemoryStats.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <glad/glad.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#ifdef TRACK_ALLOCATIONS
+
+static std::atomic<uint64_t> g_allocationCount{0};
+static std::atomic<uint64_t> g_allocationBytes{0};
+static thread_local MemoryStats::Allocations g_threadAllocations;
+
+static void* trackedAlloc(size_t size)
+{
+    g_allocationCount.fetch_add(1, std::memory_order_relaxed);
+    g_allocationBytes.fetch_add(size, std::memory_order_relaxed);
+    ++g_threadAllocations.count;
+    g_threadAllocations.bytes += size;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+// The over-aligned versions are left to the standard library, and not counted
+void* operator new(size_t size)
+{
+    void* p = trackedAlloc(size);
+    if(p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return trackedAlloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return trackedAlloc(size);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+
+bool MemoryStats::isTrackingAllocations()
+{
+    return true;
+}
+
+MemoryStats::Allocations MemoryStats::getAllocations()
+{
+    Allocations a;
+    a.count = g_allocationCount.load(std::memory_order_relaxed);
+    a.bytes = g_allocationBytes.load(std::memory_order_relaxed);
+    return a;
+}
+
+MemoryStats::Allocations MemoryStats::getThreadAllocations()
+{
+    return g_threadAllocations;
+}
+
+#else
+
+bool MemoryStats::isTrackingAllocations()
+{
+    return false;
+}
+
+MemoryStats::Allocations MemoryStats::getAllocations()
+{
+    return Allocations();
+}
+
+MemoryStats::Allocations MemoryStats::getThreadAllocations()
+{
+    return Allocations();
+}
+
+#endif // TRACK_ALLOCATIONS
+
+uint64_t MemoryStats::getPeakResidentBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+#else
+    rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return uint64_t(usage.ru_maxrss);
+#else
+    // In KiB
+    return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+uint64_t MemoryStats::getGLBufferBytes()
+{
+    // GL can't list its buffers, but the names are handed out in increasing order,
+    // so they are scanned until a long run of names that aren't buffers
+    const uint32_t MAX_GAP = 1024;
+    uint64_t bytes = 0;
+    uint32_t gap = 0;
+    for(uint32_t name = 1; gap < MAX_GAP; ++name) {
+        if(!glIsBuffer(name)) {
+            ++gap;
+            continue;
+        }
+        gap = 0;
+        GLint64 size = 0;
+        glGetNamedBufferParameteri64v(name, GL_BUFFER_SIZE, &size);
+        bytes += uint64_t(size);
+    }
+    return bytes;
+}
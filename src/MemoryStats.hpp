@@ -0,0 +1,33 @@
+#ifndef MEMORYSTATS_HPP
+#define MEMORYSTATS_HPP
+
+#include <cstdint>
+
+// Memory used by the program. The heap allocations are only counted when built
+// with TRACK_ALLOCATIONS (cmake -DTRACK_ALLOCATIONS=ON), which replaces the global
+// operator new and delete
+class MemoryStats
+{
+public:
+    struct Allocations
+    {
+        uint64_t count = 0;
+        uint64_t bytes = 0;
+    };
+
+    static bool isTrackingAllocations();
+
+    // Since the start of the program, from all the threads. Zero if not tracking
+    static Allocations getAllocations();
+
+    // Since the start of the calling thread. Zero if not tracking
+    static Allocations getThreadAllocations();
+
+    // Peak resident set size of the process, 0 if unknown
+    static uint64_t getPeakResidentBytes();
+
+    // Sum of the sizes of the GL buffers alive, needs a current context
+    static uint64_t getGLBufferBytes();
+};
+
+#endif // MEMORYSTATS_HPP
@@ -1,36 +1,354 @@
 
 #include "Mesh.hpp"
+#include "PlyReader.hpp"
 #include <happly.h>
 #include <glad/glad.h>
 #include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <iterator>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <stdexcept>
+
+
+// Unit cube, as 12 triangles facing outwards
+static const float BOX_VERTICES[36 * 3] = {
+    0.0f, 0.0f, 1.0f,
+    1.0f, 0.0f, 1.0f,
+    1.0f, 1.0f, 1.0f,
+    1.0f, 1.0f, 1.0f,
+    0.0f, 1.0f, 1.0f,
+    0.0f, 0.0f, 1.0f,
+
+    0.0f, 0.0f, 0.0f,
+    1.0f, 1.0f, 0.0f,
+    1.0f, 0.0f, 0.0f,
+    0.0f, 1.0f, 0.0f,
+    1.0f, 1.0f, 0.0f,
+    0.0f, 0.0f, 0.0f,
+
+    0.0f, 1.0f, 1.0f,
+    0.0f, 1.0f, 0.0f,
+    0.0f, 0.0f, 0.0f,
+    0.0f, 0.0f, 0.0f,
+    0.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, 1.0f,
+
+    1.0f, 1.0f, 1.0f,
+    1.0f, 0.0f, 0.0f,
+    1.0f, 1.0f, 0.0f,
+    1.0f, 0.0f, 0.0f,
+    1.0f, 1.0f, 1.0f,
+    1.0f, 0.0f, 1.0f,
+
+    0.0f, 0.0f, 0.0f,
+    1.0f, 0.0f, 0.0f,
+    1.0f, 0.0f, 1.0f,
+    1.0f, 0.0f, 1.0f,
+    0.0f, 0.0f, 1.0f,
+    0.0f, 0.0f, 0.0f,
+
+    0.0f, 1.0f, 0.0f,
+    1.0f, 1.0f, 1.0f,
+    1.0f, 1.0f, 0.0f,
+    1.0f, 1.0f, 1.0f,
+    0.0f, 1.0f, 0.0f,
+    0.0f, 1.0f, 1.0f,
+
+};
+
+namespace {
+// Header of the binary cache, followed by the vertices, the faces of all the
+// levels of detail, their ranges and the meshlets
+struct CacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    // Size and modification time of the source file, to detect changes
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    uint32_t numVertices;
+    uint32_t numFaces;
+    uint32_t numLods;
+    uint32_t requestedLods;
+    float minBB[3];
+    float maxBB[3];
+    float objectMatrix[16];
+    uint32_t vertexSize;
+    uint32_t flags;
+    uint32_t numMeshlets;
+    uint32_t padding;
+};
+constexpr uint32_t CACHE_VERSION = 5;
+
+enum CacheFlags : uint32_t {
+    eCacheHasUvs = 1,
+    eCacheOptimized = 2,
+    eCacheMeshlets = 4
+};
+
+bool getSourceStamp(const char* fileName, uint64_t* size, int64_t* time) {
+    std::error_code ec;
+    *size = std::filesystem::file_size(fileName, ec);
+    if(ec) {
+        return false;
+    }
+    auto t = std::filesystem::last_write_time(fileName, ec);
+    if(ec) {
+        return false;
+    }
+    *time = t.time_since_epoch().count();
+    return true;
+}
 
+// Octahedral mapping of a direction to [-1, 1]^2
+glm::vec2 octahedralEncode(glm::vec3 n) {
+    float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if(l1 == 0.0f) {
+        return glm::vec2(0.0f);
+    }
+    n /= l1;
+    if(n.z >= 0.0f) {
+        return glm::vec2(n.x, n.y);
+    }
+    return (1.0f - glm::abs(glm::vec2(n.y, n.x))) *
+            glm::vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+}
+}
 
 Mesh::Mesh()
 {
-    glGenVertexArrays(1, &mVAO);
-    glGenBuffers(1, &mVertexBO);
-    glGenBuffers(1, &mIndexBO);
-    glGenBuffers(1, &mInstanceBO);
+    mOwnArena = std::make_unique<GeometryArena>();
+    mArena = mOwnArena.get();
 
     glGenVertexArrays(1, &mBBVAO);
     glGenBuffers(1, &mBBVBO);
+
+    glGenBuffers(1, &mIndirectBO);
 }
 
 Mesh::~Mesh()
 {
-    glDeleteBuffers(1, &mVertexBO);
-    glDeleteBuffers(1, &mIndexBO);
-    glDeleteBuffers(1, &mInstanceBO);
-    glDeleteVertexArrays(1, &mVAO);
-
     glDeleteBuffers(1, &mBBVBO);
     glDeleteVertexArrays(1, &mBBVAO);
+
+    glDeleteBuffers(1, &mIndirectBO);
 }
 
-void Mesh::loadMesh(const char* fileName) {
- 
+void Mesh::setArena(GeometryArena* arena)
+{
+    mArena = arena;
+    mOwnArena.reset();
+}
+
+void Mesh::loadMesh(const char* fileName, bool useCache) {
+
     mVertices.clear();
     mFaces.clear();
+    mLods.clear();
+    mMeshlets.clear();
+    mCache.close();
+    mUnoptimizedStats = MeshOptimizer::VertexCacheStats();
+
+    mCacheName = std::string(fileName) + ".cache";
+    mLoadedFromCache = useCache && loadCache(mCacheName, fileName);
+    if(!mLoadedFromCache) {
+        loadPLY(fileName);
+        createObjectMatrix();
+        if(mOptimize) {
+            optimize();
+        }
+        if(mUseMeshlets) {
+            buildMeshlets();
+        }
+        buildLods();
+
+        mVertexData = mVertices.data();
+        mFaceData = mFaces.data();
+        mNumVertices = (uint32_t)mVertices.size();
+        mNumFaces = mLods[0].numFaces;
+
+        if(useCache || mResidency == eResidencySpill) {
+            writeCache(mCacheName, fileName);
+        }
+    }
+    mVertexCacheStats = MeshOptimizer::analyzeVertexCache(mFaceData, mNumFaces, mNumVertices);
+
+    uploadToGPU();
+    createBBoxVAO(mBBVAO, mBBVBO, mArena->getInstanceBO(), encodePosition(mMinBB), encodePosition(mMaxBB), false);
+
+    if(mResidency != eResidencyKeep) {
+        releaseGeometry();
+    }
+}
+
+void Mesh::releaseGeometry()
+{
+    // Swap to really give back the memory
+    std::vector<VertexData>().swap(mVertices);
+    std::vector<glm::ivec3>().swap(mFaces);
+    mCache.close();
+    mVertexData = nullptr;
+    mFaceData = nullptr;
+}
+
+bool Mesh::mapCache(const MappedFile& cache, const VertexData** vertices, const glm::ivec3** faces)
+{
+    if(cache.size() < sizeof(CacheHeader)) {
+        return false;
+    }
+    CacheHeader header;
+    std::memcpy(&header, cache.data(), sizeof(CacheHeader));
+    const size_t expectedSize = sizeof(CacheHeader) +
+            size_t(header.numVertices) * sizeof(VertexData) +
+            size_t(header.numFaces) * sizeof(glm::ivec3) +
+            size_t(header.numLods) * sizeof(Lod) +
+            size_t(header.numMeshlets) * sizeof(MeshOptimizer::Meshlet);
+    if(std::memcmp(header.magic, "MSH1", 4) != 0 ||
+        header.version != CACHE_VERSION ||
+        header.vertexSize != sizeof(VertexData) ||
+        cache.size() != expectedSize) {
+        return false;
+    }
+    *vertices = (const VertexData*)(cache.data() + sizeof(CacheHeader));
+    *faces = (const glm::ivec3*)(cache.data() + sizeof(CacheHeader) +
+                                 size_t(header.numVertices) * sizeof(VertexData));
+    return true;
+}
+
+Mesh::GeometryView::GeometryView(const Mesh& mesh)
+{
+    if(mesh.mVertexData != nullptr) {
+        mVertices = mesh.mVertexData;
+        mFaces = mesh.mFaceData;
+    } else if(mesh.mResidency != eResidencySpill || !mFile.open(mesh.mCacheName) ||
+              !mapCache(mFile, &mVertices, &mFaces)) {
+        mFile.close();
+        mVertices = nullptr;
+        mFaces = nullptr;
+        return;
+    }
+    mNumVertices = mesh.mNumVertices;
+    mNumFaces = mesh.mNumFaces;
+}
+
+bool Mesh::loadCache(const std::string& cacheName, const char* fileName)
+{
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    if(!getSourceStamp(fileName, &sourceSize, &sourceTime) ||
+        !mCache.open(cacheName) || mCache.size() < sizeof(CacheHeader)) {
+        mCache.close();
+        return false;
+    }
+
+    CacheHeader header;
+    std::memcpy(&header, mCache.data(), sizeof(CacheHeader));
+    if(!mapCache(mCache, &mVertexData, &mFaceData) ||
+        ((header.flags & eCacheOptimized) != 0) != mOptimize ||
+        ((header.flags & eCacheMeshlets) != 0) != mUseMeshlets ||
+        header.requestedLods != mRequestedLods ||
+        header.numLods == 0 ||
+        header.sourceSize != sourceSize ||
+        header.sourceTime != sourceTime) {
+        mCache.close();
+        mVertexData = nullptr;
+        mFaceData = nullptr;
+        return false;
+    }
+
+    mNumVertices = header.numVertices;
+    mLods.resize(header.numLods);
+    std::memcpy(mLods.data(), mFaceData + header.numFaces, mLods.size() * sizeof(Lod));
+    mMeshlets.resize(header.numMeshlets);
+    std::memcpy(mMeshlets.data(), (const char*)(mFaceData + header.numFaces) + mLods.size() * sizeof(Lod),
+                mMeshlets.size() * sizeof(MeshOptimizer::Meshlet));
+    mNumFaces = mLods[0].numFaces;
+    mMinBB = glm::vec3(header.minBB[0], header.minBB[1], header.minBB[2]);
+    mMaxBB = glm::vec3(header.maxBB[0], header.maxBB[1], header.maxBB[2]);
+    mHasUvs = (header.flags & eCacheHasUvs) != 0;
+    std::memcpy(&mObjectMatrix[0][0], header.objectMatrix, sizeof(header.objectMatrix));
+    mObjectMatrixInverse = glm::inverse(mObjectMatrix);
+
+    return true;
+}
+
+void Mesh::writeCache(const std::string& cacheName, const char* fileName) const
+{
+    CacheHeader header = {};
+    if(!getSourceStamp(fileName, &header.sourceSize, &header.sourceTime)) {
+        return;
+    }
+    std::memcpy(header.magic, "MSH1", 4);
+    header.version = CACHE_VERSION;
+    header.numVertices = mNumVertices;
+    header.numFaces = totalFaces();
+    header.numLods = (uint32_t)mLods.size();
+    header.requestedLods = mRequestedLods;
+    for(uint32_t a = 0; a < 3; ++a) {
+        header.minBB[a] = mMinBB[a];
+        header.maxBB[a] = mMaxBB[a];
+    }
+    std::memcpy(header.objectMatrix, &mObjectMatrix[0][0], sizeof(header.objectMatrix));
+    header.vertexSize = sizeof(VertexData);
+    header.flags = (mHasUvs ? uint32_t(eCacheHasUvs) : 0u) | (mOptimize ? uint32_t(eCacheOptimized) : 0u) |
+                   (mUseMeshlets ? uint32_t(eCacheMeshlets) : 0u);
+    header.numMeshlets = (uint32_t)mMeshlets.size();
+
+    // Write to a temporal file first, so an interrupted write is never loaded
+    const std::string tmpName = cacheName + ".tmp";
+    {
+        std::ofstream stream(tmpName, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+        if(!stream) {
+            return;
+        }
+        stream.write((const char*)&header, sizeof(header));
+        stream.write((const char*)mVertexData, size_t(mNumVertices) * sizeof(VertexData));
+        stream.write((const char*)mFaceData, size_t(totalFaces()) * sizeof(glm::ivec3));
+        stream.write((const char*)mLods.data(), mLods.size() * sizeof(Lod));
+        stream.write((const char*)mMeshlets.data(), mMeshlets.size() * sizeof(MeshOptimizer::Meshlet));
+        if(!stream) {
+            return;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpName, cacheName, ec);
+}
+
+bool Mesh::loadPLYFast(const char* fileName)
+{
+    MappedFile file;
+    PlyReader reader;
+    if(!file.open(fileName) || !reader.parseHeader(file.data(), file.size()) || !reader.isSupported()) {
+        return false;
+    }
+
+    mVertices.resize(reader.numVertices());
+    mFaces.resize(reader.numFaces());
+
+    // Decode straight into the final arrays
+    PlyReader::VertexTarget target;
+    target.stride = sizeof(VertexData);
+    if(!mVertices.empty()) {
+        target.pos = &mVertices[0].pos.x;
+        target.normal = reader.hasNormals() ? &mVertices[0].normal.x : nullptr;
+        target.uv = reader.hasUvs() ? &mVertices[0].uv.x : nullptr;
+    }
+    mHasUvs = reader.hasUvs();
+    reader.read(file.data(), file.size(), target, (uint32_t*)mFaces.data(),
+                std::thread::hardware_concurrency());
+
+    return true;
+}
+
+void Mesh::loadPLY(const char* fileName) {
+
+    if(loadPLYFast(fileName)) {
+        computeBoundingBox();
+        return;
+    }
     
     happly::PLYData plyIn(fileName);
     
@@ -47,6 +365,7 @@ void Mesh::loadMesh(const char* fileName) {
     std::vector<float> ny;
     std::vector<float> nz;
     bool hasUvs = vertEl.hasProperty("s") && vertEl.hasProperty("t");
+    mHasUvs = hasUvs;
     std::vector<float> u;
     std::vector<float> v;
 
@@ -89,104 +408,183 @@ void Mesh::loadMesh(const char* fileName) {
         mFaces.push_back(glm::ivec3(ff[0], ff[1], ff[2]));
     }
 
-    // Compute bounding box
+    computeBoundingBox();
+}
+
+void Mesh::computeBoundingBox()
+{
     mMinBB = glm::vec3( std::numeric_limits<float>::infinity());
     mMaxBB = glm::vec3(-std::numeric_limits<float>::infinity());
     for(const VertexData& v : mVertices) {
         mMinBB = glm::min(mMinBB, v.pos);
         mMaxBB = glm::max(mMaxBB, v.pos);
     }
+}
 
-    // Upload data to gpu
-    glBindVertexArray(mVAO);
-    glBindBuffer(GL_ARRAY_BUFFER, mVertexBO);
-    glBufferData(GL_ARRAY_BUFFER,
-                mVertices.size() * sizeof(VertexData),
-                mVertices.data(),
-                GL_STATIC_DRAW);
+void Mesh::optimize()
+{
+    const uint32_t numVertices = (uint32_t)mVertices.size();
+    mUnoptimizedStats = MeshOptimizer::analyzeVertexCache(mFaces.data(), mFaces.size(), numVertices);
+
+    std::vector<glm::vec3> positions(numVertices);
+    for(uint32_t v = 0; v < numVertices; ++v) {
+        positions[v] = mVertices[v].pos;
+    }
+    MeshOptimizer::optimizeVertexCache(mFaces, numVertices);
+    MeshOptimizer::optimizeOverdraw(mFaces, positions);
 
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, pos));
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, normal));
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, uv));
+    const std::vector<uint32_t> remap = MeshOptimizer::optimizeVertexFetch(mFaces, numVertices);
+    std::vector<VertexData> vertices(numVertices);
+    for(uint32_t v = 0; v < numVertices; ++v) {
+        vertices[remap[v]] = mVertices[v];
+    }
+    mVertices.swap(vertices);
+}
 
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    glEnableVertexAttribArray(2);
+void Mesh::buildMeshlets()
+{
+    const uint32_t numVertices = (uint32_t)mVertices.size();
+    std::vector<glm::vec3> positions(numVertices);
+    for(uint32_t v = 0; v < numVertices; ++v) {
+        positions[v] = mVertices[v].pos;
+    }
+    MeshOptimizer::buildMeshlets(mFaces, positions, mMeshlets);
 
-    glBindBuffer(GL_ARRAY_BUFFER, mInstanceBO);
-    glm::vec2 tmp(0.0f);
-    glBufferData(GL_ARRAY_BUFFER,
-                sizeof(tmp),
-                &tmp.x,
-                GL_DYNAMIC_DRAW);
-    glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), (void*)0);
+    // Cull in model space, the object matrix only has an uniform scale
+    const float modelScale = mObjectMatrix[0][0];
+    for(MeshOptimizer::Meshlet& m : mMeshlets) {
+        m.center = glm::vec3(mObjectMatrix * glm::vec4(m.center, 1.0f));
+        m.radius *= modelScale;
+    }
+}
 
-    glEnableVertexAttribArray(3);
-    glVertexAttribDivisor(3, 1);
+void Mesh::buildLods()
+{
+    mLods.assign(1, {0, (uint32_t)mFaces.size(), 0.0f});
 
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    const uint32_t numVertices = (uint32_t)mVertices.size();
+    std::vector<glm::vec3> positions(numVertices);
+    for(uint32_t v = 0; v < numVertices; ++v) {
+        positions[v] = mVertices[v].pos;
+    }
+    // The object matrix only has an uniform scale
+    const float modelScale = mObjectMatrix[0][0];
+
+    // Each level simplifies the previous one, so their errors add up
+    std::vector<glm::ivec3> previous(mFaces);
+    std::vector<glm::ivec3> simplified;
+    while(mLods.size() < mRequestedLods) {
+        float error = MeshOptimizer::simplify(previous, positions, previous.size() / 2, simplified);
+        // Stop when the simplification gets stuck
+        if(simplified.empty() || simplified.size() > previous.size() * 9 / 10) {
+            break;
+        }
+        if(mOptimize) {
+            MeshOptimizer::optimizeVertexCache(simplified, numVertices);
+        }
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                 mFaces.size() * sizeof(glm::ivec3),
-                 mFaces.data(),
-                 GL_STATIC_DRAW);
+        mLods.push_back({(uint32_t)mFaces.size(), (uint32_t)simplified.size(),
+                         mLods.back().error + error * modelScale});
+        mFaces.insert(mFaces.end(), simplified.begin(), simplified.end());
+        previous.swap(simplified);
+    }
+}
+
+void Mesh::uploadToGPU()
+{
+    // Upload data to gpu
+    std::vector<uint8_t> packed;
+    const void* vertices = mVertexData;
+    if(mCompressedVertices) {
+        packVertices(packed);
+        vertices = packed.data();
+    } else {
+        mPositionOffset = glm::vec3(0.0f);
+        mPositionScale = glm::vec3(1.0f);
+        mVertexSize = sizeof(VertexData);
+    }
+
+    if(mOwnArena) {
+        mArena->clear();
+    }
+    if(!mArena->append(vertices, mNumVertices, mVertexSize,
+                       (const uint32_t*)mFaceData, totalFaces() * 3,
+                       &mBaseVertex, &mFirstIndex)) {
+        throw std::runtime_error("All the meshes of an arena need the same vertex format");
+    }
+
+    // The batches only differ in the buffer of per instance ids, which index the transforms
+    for(uint32_t vao : {mArena->getVAO(), mArena->getBatchVAO()}) {
+        glBindVertexArray(vao);
+        setupVertexAttributes();
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 
     glBindVertexArray(0);
+}
 
-    createObjectMatrix();
-    createBBoxVAO(mBBVAO, mBBVBO, mInstanceBO, mMinBB, mMaxBB, false);
+void Mesh::setupVertexAttributes() const
+{
+    glBindBuffer(GL_ARRAY_BUFFER, mArena->getVertexBO());
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mArena->getIndexBO());
+
+    if(!mCompressedVertices) {
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, pos));
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, normal));
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, uv));
+
+        glEnableVertexAttribArray(0);
+        glEnableVertexAttribArray(1);
+        glEnableVertexAttribArray(2);
+        return;
+    }
 
+    glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, mVertexSize, (void*)offsetof(PackedVertex, pos));
+    glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, mVertexSize, (void*)offsetof(PackedVertex, normal));
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    if(mVertexSize == sizeof(PackedVertex)) {
+        glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, mVertexSize, (void*)offsetof(PackedVertex, uv));
+        glEnableVertexAttribArray(2);
+    } else {
+        glDisableVertexAttribArray(2);
+    }
+}
+
+void Mesh::packVertices(std::vector<uint8_t>& packed)
+{
+    // Quantize inside of the bounding box. Flat axes quantize to 0 with any scale
+    mPositionOffset = mMinBB;
+    mPositionScale = glm::max(mMaxBB - mMinBB, glm::vec3(std::numeric_limits<float>::min()));
+    // Without uvs the vertex ends before them, unless it shares the layout of an arena
+    mVertexSize = mHasUvs || !mOwnArena ? sizeof(PackedVertex) : offsetof(PackedVertex, uv);
+
+    packed.resize(size_t(mNumVertices) * mVertexSize);
+    for(uint32_t i = 0; i < mNumVertices; ++i) {
+        const VertexData& v = mVertexData[i];
+        PackedVertex p;
+        glm::vec3 q = glm::round(glm::clamp(encodePosition(v.pos), 0.0f, 1.0f) * 65535.0f);
+        p.pos[0] = (uint16_t)q.x;
+        p.pos[1] = (uint16_t)q.y;
+        p.pos[2] = (uint16_t)q.z;
+        p.pos[3] = 0;
+        p.normal = glm::packSnorm2x16(octahedralEncode(v.normal));
+        p.uv = glm::packHalf2x16(v.uv);
+        std::memcpy(&packed[size_t(i) * mVertexSize], &p, mVertexSize);
+    }
+}
+
+glm::vec3 Mesh::encodePosition(const glm::vec3 &p) const
+{
+    return (p - mPositionOffset) / mPositionScale;
 }
 
 void Mesh::createBBoxVAO(uint32_t vao, uint32_t vbo, uint32_t vboInstancing, glm::vec3 min, glm::vec3 max, bool initializeVboInstancing)
 {
     glBindVertexArray(vao);
     // vertices
-    float vertices[] = {
-        0.0f, 0.0f, 1.0f,
-        1.0f, 0.0f, 1.0f,
-        1.0f, 1.0f, 1.0f,
-        1.0f, 1.0f, 1.0f,
-        0.0f, 1.0f, 1.0f,
-        0.0f, 0.0f, 1.0f,
-
-        0.0f, 0.0f, 0.0f,
-        1.0f, 1.0f, 0.0f,
-        1.0f, 0.0f, 0.0f,
-        0.0f, 1.0f, 0.0f,
-        1.0f, 1.0f, 0.0f,
-        0.0f, 0.0f, 0.0f,
-
-        0.0f, 1.0f, 1.0f,
-        0.0f, 1.0f, 0.0f,
-        0.0f, 0.0f, 0.0f,
-        0.0f, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f,
-        0.0f, 1.0f, 1.0f,
-
-        1.0f, 1.0f, 1.0f,
-        1.0f, 0.0f, 0.0f,
-        1.0f, 1.0f, 0.0f,
-        1.0f, 0.0f, 0.0f,
-        1.0f, 1.0f, 1.0f,
-        1.0f, 0.0f, 1.0f,
-
-        0.0f, 0.0f, 0.0f,
-        1.0f, 0.0f, 0.0f,
-        1.0f, 0.0f, 1.0f,
-        1.0f, 0.0f, 1.0f,
-        0.0f, 0.0f, 1.0f,
-        0.0f, 0.0f, 0.0f,
-
-        0.0f, 1.0f, 0.0f,
-        1.0f, 1.0f, 1.0f,
-        1.0f, 1.0f, 0.0f,
-        1.0f, 1.0f, 1.0f,
-        0.0f, 1.0f, 0.0f,
-        0.0f, 1.0f, 1.0f,
-
-    };
+    float vertices[36 * 3];
+    std::copy(std::begin(BOX_VERTICES), std::end(BOX_VERTICES), std::begin(vertices));
 
     for(uint32_t i = 0; i < 36; ++i) {
         glm::vec3 v(vertices[i * 3 + 0], vertices[i * 3 + 1], vertices[i * 3 + 2]);
@@ -216,15 +614,15 @@ void Mesh::createBBoxVAO(uint32_t vao, uint32_t vbo, uint32_t vboInstancing, glm
 
     glBindBuffer(GL_ARRAY_BUFFER, vboInstancing);
     if(initializeVboInstancing) {
-        glm::vec2 tmp(0.0f);
+        uint32_t id = NO_INSTANCE;
         glBufferData(GL_ARRAY_BUFFER,
-                     sizeof(tmp),
-                     &tmp.x,
+                     sizeof(id),
+                     &id,
                      GL_STATIC_DRAW
                      );
     }
 
-    glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), (void*)0);
+    glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(uint32_t), (void*)0);
 
     glEnableVertexAttribArray(3);
     glVertexAttribDivisor(3, 1);
@@ -234,22 +632,189 @@ void Mesh::createBBoxVAO(uint32_t vao, uint32_t vbo, uint32_t vboInstancing, glm
 
 void Mesh::draw() const
 {
-    glBindVertexArray(mVAO);
+    if((mLods.size() > 1 || !mMeshlets.empty()) && mHasCamera) {
+        drawInstances(mAllInstances);
+        return;
+    }
+    if(!mInstanceRuns.empty()) {
+        drawIndirectCommands(mInstanceRuns);
+        mDrawnFaces += uint64_t(mNumFaces) * mAllInstances.size();
+        return;
+    }
+
+    glBindVertexArray(mArena->getVAO());
 
-    glDrawElementsInstanced(GL_TRIANGLES, mFaces.size() * 3, GL_UNSIGNED_INT, 0, mNumInstances);
+    glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, mNumFaces * 3, GL_UNSIGNED_INT, faceOffset(0),
+                                                  mNumInstances, mBaseVertex, 0);
+    mDrawnFaces += uint64_t(mNumFaces) * mNumInstances;
 
     glBindVertexArray(0);
 }
 
 void Mesh::drawOnlyInstance(uint32_t instance) const
 {
-    glBindVertexArray(mVAO);
+    const uint32_t selected = selectLod(instance);
+    if(selected == 0 && !mMeshlets.empty() && mHasCamera) {
+        mIndirectCommands.clear();
+        cullMeshlets(instance);
+        drawIndirectCommands(mIndirectCommands);
+        return;
+    }
+
+    glBindVertexArray(mArena->getVAO());
 
-    glDrawElementsInstancedBaseInstance(GL_TRIANGLES, mFaces.size() * 3, GL_UNSIGNED_INT, 0, 1, instance);
+    const Lod& lod = mLods[selected];
+    glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, lod.numFaces * 3, GL_UNSIGNED_INT,
+                                                  faceOffset(lod.firstFace), 1, mBaseVertex, instance);
+    mDrawnFaces += lod.numFaces;
 
     glBindVertexArray(0);
 }
 
+void Mesh::drawInstances(const std::vector<uint32_t> &instances) const
+{
+    if((mLods.size() <= 1 && mMeshlets.empty()) || !mHasCamera) {
+        for(uint32_t i : instances) {
+            drawOnlyInstance(i);
+        }
+        return;
+    }
+
+    mLodBatches.resize(mLods.size());
+    for(std::vector<uint32_t>& batch : mLodBatches) {
+        batch.clear();
+    }
+    for(uint32_t i : instances) {
+        mLodBatches[selectLod(i)].push_back(i);
+    }
+
+    // The instances of the first level only draw their meshlets that pass the culling
+    if(!mMeshlets.empty()) {
+        mIndirectCommands.clear();
+        for(uint32_t i : mLodBatches[0]) {
+            cullMeshlets(i);
+        }
+        drawIndirectCommands(mIndirectCommands);
+        mLodBatches[0].clear();
+    }
+
+    // The ids of each level go one after the other, and each draw starts at its own
+    mBatchInstances.clear();
+    for(const std::vector<uint32_t>& batch : mLodBatches) {
+        mBatchInstances.insert(mBatchInstances.end(), batch.begin(), batch.end());
+    }
+    if(mBatchInstances.empty()) {
+        return;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, mArena->getBatchInstanceBO());
+    glBufferData(GL_ARRAY_BUFFER, mBatchInstances.size() * sizeof(uint32_t), mBatchInstances.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glBindVertexArray(mArena->getBatchVAO());
+    uint32_t baseInstance = 0;
+    for(uint32_t l = 0; l < mLods.size(); ++l) {
+        const uint32_t count = (uint32_t)mLodBatches[l].size();
+        if(count != 0) {
+            glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, mLods[l].numFaces * 3, GL_UNSIGNED_INT,
+                                                          faceOffset(mLods[l].firstFace),
+                                                          count, mBaseVertex, baseInstance);
+            mDrawnFaces += uint64_t(mLods[l].numFaces) * count;
+        }
+        baseInstance += count;
+    }
+    glBindVertexArray(0);
+}
+
+void Mesh::cullMeshlets(uint32_t instance) const
+{
+    const InstanceTransform& transform = mInstanceTransforms[instance];
+    for(const MeshOptimizer::Meshlet& m : mMeshlets) {
+        ++mTestedMeshlets;
+        const glm::vec3 center = transform.apply(m.center);
+        const float radius = transform.scale * m.radius;
+
+        // All the triangles face away from the camera
+        const glm::vec3 d = center - mCameraPosition;
+        bool visible = glm::dot(d, transform.rotate(m.coneAxis)) < m.coneCutoff * glm::length(d) + radius;
+        // Bounding sphere outside of a plane of the frustum
+        for(uint32_t p = 0; p < 6 && visible; ++p) {
+            visible = glm::dot(glm::vec3(mFrustumPlanes[p]), center) + mFrustumPlanes[p].w > -radius;
+        }
+        if(!visible) {
+            ++mCulledMeshlets;
+            continue;
+        }
+
+        // Consecutive meshlets are consecutive ranges of the index buffer
+        const uint32_t firstIndex = mFirstIndex + m.firstFace * 3;
+        DrawElementsIndirectCommand* last = mIndirectCommands.empty() ? nullptr : &mIndirectCommands.back();
+        if(last != nullptr && last->baseInstance == instance &&
+           last->firstIndex + last->count == firstIndex) {
+            last->count += m.numFaces * 3;
+        } else {
+            mIndirectCommands.push_back({m.numFaces * 3, 1, firstIndex, mBaseVertex, instance});
+        }
+        mDrawnFaces += m.numFaces;
+    }
+}
+
+void Mesh::drawIndirectCommands(const std::vector<DrawElementsIndirectCommand>& commands) const
+{
+    if(commands.empty()) {
+        return;
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mIndirectBO);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawElementsIndirectCommand),
+                 commands.data(), GL_STREAM_DRAW);
+
+    // The instance ids come from baseInstance
+    glBindVertexArray(mArena->getVAO());
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)0, (GLsizei)commands.size(), 0);
+    glBindVertexArray(0);
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+void Mesh::setCamera(const glm::vec3 &position, const glm::mat4 &viewProj,
+                     float pixelsPerUnit, float maxPixelError)
+{
+    mHasCamera = true;
+    mCameraPosition = position;
+    mLodPixelsPerUnit = pixelsPerUnit;
+    mLodMaxPixelError = maxPixelError;
+
+    // Planes of the frustum in world space, pointing inwards (Gribb and Hartmann)
+    const glm::mat4 m = glm::transpose(viewProj);
+    for(uint32_t a = 0; a < 3; ++a) {
+        mFrustumPlanes[2 * a] = m[3] + m[a];
+        mFrustumPlanes[2 * a + 1] = m[3] - m[a];
+    }
+    for(glm::vec4& plane : mFrustumPlanes) {
+        plane /= glm::length(glm::vec3(plane));
+    }
+}
+
+uint32_t Mesh::selectLod(uint32_t instance) const
+{
+    if(mLods.size() <= 1 || !mHasCamera || mLodPixelsPerUnit <= 0.0f || instance >= mInstanceTransforms.size()) {
+        return 0;
+    }
+
+    // Distance to the closest point of the box of the instance
+    glm::vec3 min, max;
+    getInstanceBox(instance, &min, &max);
+    const float distance = glm::length(glm::clamp(mCameraPosition, min, max) - mCameraPosition);
+
+    // The errors grow with the level, and with the scale of the instance
+    const float pixelsPerUnit = mLodPixelsPerUnit * mInstanceTransforms[instance].scale;
+    uint32_t lod = 0;
+    while(lod + 1 < mLods.size() &&
+          mLods[lod + 1].error * pixelsPerUnit <= mLodMaxPixelError * distance) {
+        ++lod;
+    }
+    return lod;
+}
+
 void Mesh::drawBBoxOnlyInstance(uint32_t instance) const
 {
     glBindVertexArray(mBBVAO);
@@ -265,19 +830,42 @@ glm::vec3 Mesh::getSize() const
     return scaleFactor * (mMaxBB - mMinBB);
 }
 
-void Mesh::setInstances(const std::vector<glm::vec2> &xzOffsets)
+void Mesh::setInstances(const std::vector<InstanceTransform> &transforms)
 {
-    mNumInstances = (uint32_t) xzOffsets.size();
+    std::vector<uint32_t> instances(transforms.size());
+    for(uint32_t i = 0; i < instances.size(); ++i) {
+        instances[i] = i;
+    }
+    setInstances(transforms, instances);
+}
 
-    glBindVertexArray(mVAO);
-    glBindBuffer(GL_ARRAY_BUFFER, mInstanceBO);
-    glBufferData(GL_ARRAY_BUFFER,
-                sizeof(glm::vec2) * mNumInstances,
-                xzOffsets.data(),
-                GL_DYNAMIC_DRAW);
+void Mesh::setInstances(const std::vector<InstanceTransform> &transforms, const std::vector<uint32_t> &instances)
+{
+    mNumInstances = (uint32_t) transforms.size();
+    mInstanceTransforms = transforms;
+    mAllInstances = instances;
+
+    // Ranges of consecutive instances, so draw still uses their ids in the arena
+    mInstanceRuns.clear();
+    if(mAllInstances.size() != mNumInstances) {
+        for(uint32_t i : mAllInstances) {
+            DrawElementsIndirectCommand* last = mInstanceRuns.empty() ? nullptr : &mInstanceRuns.back();
+            if(last != nullptr && last->baseInstance + last->instanceCount == i) {
+                ++last->instanceCount;
+            } else {
+                mInstanceRuns.push_back({mNumFaces * 3, 1, mFirstIndex, mBaseVertex, i});
+            }
+        }
+    }
 
-    glBindVertexArray(0);
+    if(mOwnArena) {
+        mArena->setInstances(transforms);
+    }
+}
 
+void Mesh::getInstanceBox(uint32_t instance, glm::vec3 *min, glm::vec3 *max) const
+{
+    mInstanceTransforms[instance].transformBox(glm::vec3(0.0f), getSize(), min, max);
 }
 
 void Mesh::createBBoxVAOModelTransform(uint32_t vao,
@@ -287,7 +875,40 @@ void Mesh::createBBoxVAOModelTransform(uint32_t vao,
 {
     min = glm::vec3(mObjectMatrixInverse * glm::vec4(min, 1));
     max = glm::vec3(mObjectMatrixInverse * glm::vec4(max, 1));
-    createBBoxVAO(vao, vbo, vboInstancing, min, max, true);
+    createBBoxVAO(vao, vbo, vboInstancing, encodePosition(min), encodePosition(max), true);
+}
+
+void Mesh::createBoxesVAO(uint32_t vao,
+                          uint32_t vbo,
+                          const std::vector<std::pair<glm::vec3, glm::vec3>>& boxes) const
+{
+    std::vector<glm::vec3> vertices;
+    vertices.reserve(boxes.size() * 36);
+    for(const auto& box : boxes) {
+        for(uint32_t i = 0; i < 36; ++i) {
+            glm::vec3 v(BOX_VERTICES[i * 3 + 0], BOX_VERTICES[i * 3 + 1], BOX_VERTICES[i * 3 + 2]);
+            vertices.push_back(encodePosition(box.first + v * (box.second - box.first)));
+        }
+    }
+
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER,
+                 vertices.size() * sizeof(glm::vec3),
+                 vertices.data(),
+                 GL_STATIC_DRAW);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+
+    // Share the instance ids of the mesh
+    glBindBuffer(GL_ARRAY_BUFFER, mArena->getInstanceBO());
+    glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(uint32_t), (void*)0);
+
+    glEnableVertexAttribArray(3);
+    glVertexAttribDivisor(3, 1);
+
+    glBindVertexArray(0);
 }
 
 void Mesh::createObjectMatrix()
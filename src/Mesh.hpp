@@ -1,27 +1,114 @@
 #pragma once
 
 #include <vector>
+#include <utility>
 #include <cstdint>
+#include <string>
+#include <memory>
 #include <glm/glm.hpp>
 
+#include "GeometryArena.hpp"
+#include "InstanceTransform.hpp"
+#include "MappedFile.hpp"
+#include "MeshOptimizer.hpp"
+
 class Mesh {
 public:
-    
+    // What stays in the CPU of the geometry after uploading it
+    enum Residency {
+        eResidencyKeep,    // the vertices and faces, or the mapping of the cache
+        eResidencySpill,   // nothing, the cache file is mapped again when needed
+        eResidencyRelease  // nothing, only the counts, bounds and meshlets are kept
+    };
+
+    class GeometryView;
+
     Mesh();
     ~Mesh();
 
     Mesh& operator=(const Mesh&o) = delete;
 
-    void loadMesh(const char* fileName);
+    // Load a ply file. If useCache, a binary copy is written next to it the first
+    // time, and is mapped in the next loads instead of parsing the ply
+    void loadMesh(const char* fileName, bool useCache = true);
+
+    // Upload the geometry into an arena shared with other meshes, instead of one of
+    // its own. Has to be set before loadMesh. Compressed vertices keep the slot of
+    // the uvs even without them, so all the meshes of the arena have the same layout
+    void setArena(GeometryArena* arena);
+    // The shaders read the transforms of the instances from the arena, see
+    // GeometryArena::bindTransforms
+    const GeometryArena* getArena() const { return mArena; }
+
+    // True if the last load came from the binary cache
+    bool isLoadedFromCache() const { return mLoadedFromCache; }
+
+    // Has to be set before loadMesh. Spill always writes the cache, even without useCache
+    void setResidency(Residency residency) { mResidency = residency; }
+    Residency getResidency() const { return mResidency; }
+
+    // Upload the vertices with 16 bit positions, octahedral normals and half float
+    // uvs instead of floats. Has to be set before loadMesh
+    void setCompressedVertices(bool compressed) { mCompressedVertices = compressed; }
+    bool hasCompressedVertices() const { return mCompressedVertices; }
+
+    // Reorder the triangles and vertices after parsing the ply, for the vertex cache
+    // and overdraw. Has to be set before loadMesh, the cache stores the result
+    void setOptimize(bool optimize) { mOptimize = optimize; }
+
+    // Generate up to numLods levels of detail, each with about half the triangles of
+    // the previous one. Has to be set before loadMesh, the cache stores them
+    void setNumLods(uint32_t numLods) { mRequestedLods = numLods; }
+    uint32_t numLods() const { return (uint32_t)mLods.size(); }
+    size_t numLodFaces(uint32_t lod) const { return mLods[lod].numFaces; }
+
+    // Camera of the actual frame, to select the level of each instance that is drawn:
+    // the coarsest one whose error projects to at most maxPixelError pixels.
+    // pixelsPerUnit is the size in pixels of a unit at distance 1 from the camera.
+    // Also used to cull the meshlets
+    void setCamera(const glm::vec3& position, const glm::mat4& viewProj,
+                   float pixelsPerUnit, float maxPixelError);
+    uint32_t selectLod(uint32_t instance) const;
+
+    // Split the first level of detail in meshlets, and only draw the ones of each
+    // instance that are in the frustum and face the camera. Has to be set before
+    // loadMesh, the cache stores them
+    void setMeshlets(bool meshlets) { mUseMeshlets = meshlets; }
+    size_t numMeshlets() const { return mMeshlets.size(); }
+    // Meshlets tested and culled since the mesh was loaded
+    uint64_t getTestedMeshlets() const { return mTestedMeshlets; }
+    uint64_t getCulledMeshlets() const { return mCulledMeshlets; }
+
+    // Vertex cache efficiency of the index buffer
+    const MeshOptimizer::VertexCacheStats& getVertexCacheStats() const { return mVertexCacheStats; }
+    // The same before optimizing, all 0 if the mesh was not optimized when loading it
+    const MeshOptimizer::VertexCacheStats& getUnoptimizedVertexCacheStats() const { return mUnoptimizedStats; }
+
+    // The shaders get the position in mesh space as offset + scale * attribute
+    const glm::vec3& getPositionOffset() const { return mPositionOffset; }
+    const glm::vec3& getPositionScale() const { return mPositionScale; }
+
+    // Bytes of each vertex in the vertex buffer
+    uint32_t getVertexSize() const { return mVertexSize; }
 
     // Draw all instances associated to this mesh
     void draw() const;
 
+    // Draw a list of instances, with a single draw per level of detail
+    void drawInstances(const std::vector<uint32_t>& instances) const;
+
+    // Triangles sent to draw since the mesh was loaded
+    uint64_t getDrawnFaces() const { return mDrawnFaces; }
+
     void drawOnlyInstance(uint32_t instance) const;
     void drawBBoxOnlyInstance(uint32_t instance) const;
 
-    size_t numVertices() const { return mVertices.size(); }
-    size_t numFaces() const { return mFaces.size(); }
+    size_t numVertices() const { return mNumVertices; }
+    size_t numFaces() const { return mNumFaces; }
+
+    // Bounding box of the mesh, without the model transform
+    const glm::vec3& getMinBB() const { return mMinBB; }
+    const glm::vec3& getMaxBB() const { return mMaxBB; }
 
     // The object will havev this size, and it will always be with first vertex of its BBox
     // in (0,0,0)
@@ -29,14 +116,30 @@ public:
 
     const glm::mat4& getModelMatrix() const { return mObjectMatrix; }
 
-    void setInstances(const std::vector<glm::vec2>& xzOffsets);
+    void setInstances(const std::vector<InstanceTransform>& transforms);
+    // Only draw the given instances in draw. The transforms go to the arena only if
+    // it is not shared, otherwise the owner of the arena uploads them
+    void setInstances(const std::vector<InstanceTransform>& transforms, const std::vector<uint32_t>& instances);
+
+    // World space box of an instance, with the box of the mesh from 0 to getSize
+    void getInstanceBox(uint32_t instance, glm::vec3* min, glm::vec3* max) const;
+
+    // Instance id of the boxes of createBBoxVAOModelTransform, without transform
+    static constexpr uint32_t NO_INSTANCE = UINT32_MAX;
 
     // Fill a vbo in a vao with a bounding box, such that is able to be rendered
-    // with the transform of this mesh
+    // with the transform of this mesh. The box is given in world space, and
+    // vboInstancing gets NO_INSTANCE
     void createBBoxVAOModelTransform(uint32_t vao,
                                      uint32_t vbo,
                                      uint32_t vboInstancing,
                                      glm::vec3 min, glm::vec3 max) const;
+
+    // Fill a vbo in a vao with a set of boxes given in mesh space, that are
+    // rendered with the instances of this mesh
+    void createBoxesVAO(uint32_t vao,
+                        uint32_t vbo,
+                        const std::vector<std::pair<glm::vec3, glm::vec3>>& boxes) const;
     
 private:
     struct VertexData
@@ -45,9 +148,83 @@ private:
         glm::vec3 normal = glm::vec3(0);
         glm::vec2 uv = glm::vec2(0);
     };
+
+    // Vertex in the gpu when compressed. uv is only uploaded if the mesh has them
+    struct PackedVertex
+    {
+        uint16_t pos[4];  // unorm inside of the bounding box, last one is padding
+        uint32_t normal;  // snorm octahedral encoding
+        uint32_t uv;      // 2 half floats
+    };
     
+    // Range of the index buffer of a level of detail
+    struct Lod
+    {
+        uint32_t firstFace;
+        uint32_t numFaces;
+        float error; // in model space
+    };
+
     std::vector<VertexData> mVertices;
+    // The faces of all the levels of detail, one after the other
     std::vector<glm::ivec3> mFaces;
+
+    // Geometry in the CPU, pointing to the vectors or to the mapped cache
+    // Null once released, see Residency
+    MappedFile mCache;
+    std::string mCacheName;
+    bool mLoadedFromCache = false;
+    Residency mResidency = eResidencyKeep;
+    const VertexData* mVertexData = nullptr;
+    const glm::ivec3* mFaceData = nullptr;
+    uint32_t mNumVertices = 0;
+    uint32_t mNumFaces = 0; // of the first level of detail
+    bool mHasUvs = false;
+
+    uint32_t mRequestedLods = 1;
+    std::vector<Lod> mLods;
+    bool mHasCamera = false;
+    glm::vec3 mCameraPosition = glm::vec3(0);
+    glm::vec4 mFrustumPlanes[6];
+    float mLodPixelsPerUnit = 0.0f; // 0 always selects the first level
+    float mLodMaxPixelError = 1.0f;
+    std::vector<InstanceTransform> mInstanceTransforms;
+    std::vector<uint32_t> mAllInstances;
+
+    // Instances of drawInstances, grouped by level
+    mutable std::vector<std::vector<uint32_t>> mLodBatches;
+    mutable std::vector<uint32_t> mBatchInstances;
+
+    // As GL expects them in the indirect buffer
+    struct DrawElementsIndirectCommand
+    {
+        uint32_t count;
+        uint32_t instanceCount;
+        uint32_t firstIndex;
+        uint32_t baseVertex;
+        uint32_t baseInstance;
+    };
+
+    // Meshlets of the first level of detail, in model space
+    bool mUseMeshlets = false;
+    std::vector<MeshOptimizer::Meshlet> mMeshlets;
+    uint32_t mIndirectBO;
+    mutable std::vector<DrawElementsIndirectCommand> mIndirectCommands;
+    // Draw of the instances of draw, by ranges of consecutive instances. Empty if
+    // they are all the instances
+    std::vector<DrawElementsIndirectCommand> mInstanceRuns;
+    mutable uint64_t mTestedMeshlets = 0;
+    mutable uint64_t mCulledMeshlets = 0;
+
+    mutable uint64_t mDrawnFaces = 0;
+
+    bool mCompressedVertices = false;
+    bool mOptimize = false;
+    MeshOptimizer::VertexCacheStats mUnoptimizedStats;
+    MeshOptimizer::VertexCacheStats mVertexCacheStats;
+    glm::vec3 mPositionOffset = glm::vec3(0);
+    glm::vec3 mPositionScale = glm::vec3(1);
+    uint32_t mVertexSize = sizeof(VertexData);
     
     glm::vec3 mMinBB, mMaxBB;
 
@@ -55,10 +232,11 @@ private:
     glm::mat4 mObjectMatrixInverse;
 
 
-    uint32_t mVAO;
-    uint32_t mVertexBO;
-    uint32_t mIndexBO;
-    uint32_t mInstanceBO;
+    // Where the geometry is in the gpu
+    GeometryArena* mArena = nullptr;
+    std::unique_ptr<GeometryArena> mOwnArena;
+    uint32_t mBaseVertex = 0;
+    uint32_t mFirstIndex = 0;
 
     uint32_t mBBVAO;
     uint32_t mBBVBO;
@@ -66,6 +244,34 @@ private:
     uint32_t mNumInstances = 1;
 
 
+    void loadPLY(const char* fileName);
+    // Memory mapped reader for the common binary and ascii layouts, false if the file needs happly
+    bool loadPLYFast(const char* fileName);
+    void computeBoundingBox();
+    bool loadCache(const std::string& cacheName, const char* fileName);
+    void writeCache(const std::string& cacheName, const char* fileName) const;
+    // Pointers to the vertices and faces of a cache, false if it is not valid
+    static bool mapCache(const MappedFile& cache, const VertexData** vertices, const glm::ivec3** faces);
+    void releaseGeometry();
+    void uploadToGPU();
+    void optimize();
+    // Quantize the vertices, see setCompressedVertices
+    void packVertices(std::vector<uint8_t>& packed);
+    // Vertex format of the vertex buffer, in the bound vao
+    void setupVertexAttributes() const;
+    void buildLods();
+    void buildMeshlets();
+    // Add the draws of the meshlets of an instance that pass the culling
+    void cullMeshlets(uint32_t instance) const;
+    void drawIndirectCommands(const std::vector<DrawElementsIndirectCommand>& commands) const;
+    // Offset in the index buffer of a face of this mesh
+    const void* faceOffset(uint32_t face) const {
+        return (const void*)((size_t(mFirstIndex) + size_t(face) * 3) * sizeof(uint32_t));
+    }
+    uint32_t totalFaces() const { return mLods.back().firstFace + mLods.back().numFaces; }
+    // From mesh space to the space of the position attribute
+    glm::vec3 encodePosition(const glm::vec3& p) const;
+
     // Scale to put the object in a cube of basis at most 1x1
     void createObjectMatrix();
 
@@ -76,3 +282,29 @@ private:
                               bool initializeVboInstancing);
     
 };
+
+// Read access to the vertices and faces of the first level of detail, while the
+// view lives. Points to the resident copies, or maps the cache again if they were
+// spilled. Not valid if they were released
+class Mesh::GeometryView
+{
+public:
+    explicit GeometryView(const Mesh& mesh);
+
+    GeometryView(const GeometryView&o) = delete;
+    GeometryView& operator=(const GeometryView&o) = delete;
+
+    bool isValid() const { return mVertices != nullptr; }
+
+    uint32_t numVertices() const { return mNumVertices; }
+    uint32_t numFaces() const { return mNumFaces; }
+    const glm::vec3& getVertexPosition(uint32_t i) const { return mVertices[i].pos; }
+    const glm::ivec3& getFace(uint32_t i) const { return mFaces[i]; }
+
+private:
+    MappedFile mFile;
+    const VertexData* mVertices = nullptr;
+    const glm::ivec3* mFaces = nullptr;
+    uint32_t mNumVertices = 0;
+    uint32_t mNumFaces = 0;
+};
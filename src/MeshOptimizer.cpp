@@ -0,0 +1,649 @@
+#include "MeshOptimizer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <numeric>
+#include <queue>
+#include <unordered_map>
+
+namespace {
+
+// FIFO cache of vertex indices, as the one of the gpu
+class FifoCache
+{
+public:
+    FifoCache(uint32_t numVertices, uint32_t cacheSize) :
+        mTimestamps(numVertices, 0), mCacheSize(cacheSize), mTime(cacheSize + 1) {}
+
+    // Returns true if the vertex had to be transformed
+    bool access(uint32_t v) {
+        if(mTime - mTimestamps[v] > mCacheSize) {
+            mTimestamps[v] = mTime++;
+            return true;
+        }
+        return false;
+    }
+
+    // Make all the vertices miss, as a cache just emptied
+    void flush() { mTime += mCacheSize + 1; }
+
+private:
+    std::vector<uint32_t> mTimestamps;
+    uint32_t mCacheSize;
+    uint32_t mTime;
+};
+
+// Sum of the squared distances to a set of planes, weighted by their area
+struct Quadric
+{
+    double a00 = 0, a01 = 0, a02 = 0, a03 = 0;
+    double a11 = 0, a12 = 0, a13 = 0;
+    double a22 = 0, a23 = 0;
+    double a33 = 0;
+    double weight = 0;
+
+    void addPlane(double nx, double ny, double nz, double d, double w) {
+        a00 += w * nx * nx; a01 += w * nx * ny; a02 += w * nx * nz; a03 += w * nx * d;
+        a11 += w * ny * ny; a12 += w * ny * nz; a13 += w * ny * d;
+        a22 += w * nz * nz; a23 += w * nz * d;
+        a33 += w * d * d;
+        weight += w;
+    }
+
+    void add(const Quadric& q) {
+        a00 += q.a00; a01 += q.a01; a02 += q.a02; a03 += q.a03;
+        a11 += q.a11; a12 += q.a12; a13 += q.a13;
+        a22 += q.a22; a23 += q.a23;
+        a33 += q.a33;
+        weight += q.weight;
+    }
+
+    // Mean squared distance of p to the planes of both quadrics
+    static double error(const Quadric& a, const Quadric& b, const glm::vec3& p) {
+        const double x = p.x, y = p.y, z = p.z;
+        double r = (a.a00 + b.a00) * x * x + 2.0 * (a.a01 + b.a01) * x * y + 2.0 * (a.a02 + b.a02) * x * z +
+                2.0 * (a.a03 + b.a03) * x + (a.a11 + b.a11) * y * y + 2.0 * (a.a12 + b.a12) * y * z +
+                2.0 * (a.a13 + b.a13) * y + (a.a22 + b.a22) * z * z + 2.0 * (a.a23 + b.a23) * z +
+                (a.a33 + b.a33);
+        double w = a.weight + b.weight;
+        return w > 0.0 ? std::max(0.0, r / w) : 0.0;
+    }
+};
+
+// Triangles adjacent to each vertex, as the ranges [offsets[v], offsets[v + 1]) of adjacency
+void buildAdjacency(const std::vector<glm::ivec3>& faces,
+                    uint32_t numVertices,
+                    std::vector<uint32_t>& offsets,
+                    std::vector<uint32_t>& adjacency) {
+    offsets.assign(numVertices + 1, 0);
+    for(const glm::ivec3& f : faces) {
+        for(uint32_t c = 0; c < 3; ++c) {
+            offsets[f[c] + 1]++;
+        }
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    adjacency.resize(offsets.back());
+    std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for(uint32_t t = 0; t < faces.size(); ++t) {
+        for(uint32_t c = 0; c < 3; ++c) {
+            adjacency[fill[faces[t][c]]++] = t;
+        }
+    }
+}
+
+struct Collapse
+{
+    double cost;
+    uint32_t from;
+    uint32_t to;
+    uint32_t fromVersion;
+    uint32_t toVersion;
+
+    bool operator>(const Collapse& o) const { return cost > o.cost; }
+};
+
+}
+
+MeshOptimizer::VertexCacheStats MeshOptimizer::analyzeVertexCache(const glm::ivec3 *faces,
+                                                                  size_t numFaces,
+                                                                  uint32_t numVertices,
+                                                                  uint32_t cacheSize)
+{
+    VertexCacheStats stats;
+    if(numFaces == 0 || numVertices == 0) {
+        return stats;
+    }
+
+    FifoCache cache(numVertices, cacheSize);
+    size_t misses = 0;
+    for(size_t f = 0; f < numFaces; ++f) {
+        for(uint32_t c = 0; c < 3; ++c) {
+            misses += cache.access(faces[f][c]);
+        }
+    }
+
+    stats.acmr = float(misses) / numFaces;
+    stats.atvr = float(misses) / numVertices;
+    return stats;
+}
+
+void MeshOptimizer::optimizeVertexCache(std::vector<glm::ivec3> &faces,
+                                        uint32_t numVertices,
+                                        uint32_t cacheSize)
+{
+    if(faces.empty()) {
+        return;
+    }
+
+    std::vector<uint32_t> adjacencyOffsets, adjacency;
+    buildAdjacency(faces, numVertices, adjacencyOffsets, adjacency);
+
+    // Number of triangles not yet emitted that use each vertex
+    std::vector<uint32_t> live(numVertices);
+    for(uint32_t v = 0; v < numVertices; ++v) {
+        live[v] = adjacencyOffsets[v + 1] - adjacencyOffsets[v];
+    }
+
+    std::vector<uint32_t> cacheTime(numVertices, 0);
+    std::vector<bool> emitted(faces.size(), false);
+    std::vector<uint32_t> deadEnd;
+    std::vector<uint32_t> candidates;
+    std::vector<glm::ivec3> result;
+    result.reserve(faces.size());
+
+    uint32_t time = cacheSize + 1;
+    uint32_t cursor = 0;
+    int64_t fanning = faces[0][0];
+
+    while(fanning >= 0) {
+        candidates.clear();
+
+        // Emit all the remaining triangles around the fanning vertex
+        for(uint32_t a = adjacencyOffsets[fanning]; a < adjacencyOffsets[fanning + 1]; ++a) {
+            const uint32_t t = adjacency[a];
+            if(emitted[t]) {
+                continue;
+            }
+            emitted[t] = true;
+            result.push_back(faces[t]);
+            for(uint32_t c = 0; c < 3; ++c) {
+                const uint32_t v = faces[t][c];
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if(time - cacheTime[v] > cacheSize) {
+                    cacheTime[v] = time++;
+                }
+            }
+        }
+
+        // Next fanning vertex: the oldest one of the candidates that would still be
+        // in the cache after emitting its triangles
+        fanning = -1;
+        int64_t bestPriority = -1;
+        for(uint32_t v : candidates) {
+            if(live[v] == 0) {
+                continue;
+            }
+            int64_t priority = 0;
+            if(time - cacheTime[v] + 2 * live[v] <= cacheSize) {
+                priority = time - cacheTime[v];
+            }
+            if(priority > bestPriority) {
+                bestPriority = priority;
+                fanning = v;
+            }
+        }
+
+        // Dead end: go back to a recently used vertex, or to the next one in input order
+        while(fanning < 0 && !deadEnd.empty()) {
+            uint32_t v = deadEnd.back();
+            deadEnd.pop_back();
+            if(live[v] > 0) {
+                fanning = v;
+            }
+        }
+        while(fanning < 0 && cursor < numVertices) {
+            if(live[cursor] > 0) {
+                fanning = cursor;
+            }
+            ++cursor;
+        }
+    }
+
+    faces.swap(result);
+}
+
+void MeshOptimizer::optimizeOverdraw(std::vector<glm::ivec3> &faces,
+                                     const std::vector<glm::vec3> &positions,
+                                     float threshold,
+                                     uint32_t cacheSize)
+{
+    if(faces.empty()) {
+        return;
+    }
+
+    // Hard boundaries at each triangle that misses the cache in all its vertices
+    const uint32_t numVertices = (uint32_t)positions.size();
+    std::vector<uint32_t> hardStart;
+    {
+        FifoCache cache(numVertices, cacheSize);
+        for(uint32_t t = 0; t < faces.size(); ++t) {
+            uint32_t misses = 0;
+            for(uint32_t c = 0; c < 3; ++c) {
+                misses += cache.access(faces[t][c]);
+            }
+            if(t == 0 || misses == 3) {
+                hardStart.push_back(t);
+            }
+        }
+        hardStart.push_back((uint32_t)faces.size());
+    }
+
+    // Soft boundaries inside each of them, as soon as the part since the last one,
+    // drawn with a cold cache, gets down to threshold times the ACMR of the whole
+    // cluster drawn cold. A last part that doesn't is merged with the one before
+    std::vector<uint32_t> clusterStart;
+    FifoCache cache(numVertices, cacheSize);
+    for(uint32_t h = 0; h + 1 < hardStart.size(); ++h) {
+        const uint32_t begin = hardStart[h], end = hardStart[h + 1];
+        cache.flush();
+        uint32_t clusterMisses = 0;
+        for(uint32_t t = begin; t < end; ++t) {
+            for(uint32_t c = 0; c < 3; ++c) {
+                clusterMisses += cache.access(faces[t][c]);
+            }
+        }
+        const float maxAcmr = threshold * float(clusterMisses) / float(end - begin);
+
+        const size_t first = clusterStart.size();
+        clusterStart.push_back(begin);
+        cache.flush();
+        uint32_t misses = 0;
+        for(uint32_t t = begin; t < end; ++t) {
+            for(uint32_t c = 0; c < 3; ++c) {
+                misses += cache.access(faces[t][c]);
+            }
+            if(float(misses) <= maxAcmr * float(t + 1 - clusterStart.back())) {
+                if(t + 1 < end) {
+                    clusterStart.push_back(t + 1);
+                }
+                cache.flush();
+                misses = 0;
+            }
+        }
+        if(misses != 0 && clusterStart.size() - first > 1) {
+            clusterStart.pop_back();
+        }
+    }
+    clusterStart.push_back((uint32_t)faces.size());
+    const uint32_t numClusters = (uint32_t)clusterStart.size() - 1;
+
+    // Area weighted centroid and normal of each cluster
+    std::vector<glm::vec3> centroids(numClusters, glm::vec3(0.0f));
+    std::vector<glm::vec3> normals(numClusters, glm::vec3(0.0f));
+    std::vector<float> areas(numClusters, 0.0f);
+    glm::vec3 meshCentroid(0.0f);
+    float meshArea = 0.0f;
+    for(uint32_t c = 0; c < numClusters; ++c) {
+        for(uint32_t t = clusterStart[c]; t < clusterStart[c + 1]; ++t) {
+            const glm::vec3& p0 = positions[faces[t][0]];
+            const glm::vec3& p1 = positions[faces[t][1]];
+            const glm::vec3& p2 = positions[faces[t][2]];
+            glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+            float area = glm::length(n);
+            centroids[c] += area * (p0 + p1 + p2) / 3.0f;
+            normals[c] += n;
+            areas[c] += area;
+        }
+        meshCentroid += centroids[c];
+        meshArea += areas[c];
+        if(areas[c] > 0.0f) {
+            centroids[c] /= areas[c];
+        }
+    }
+    if(meshArea > 0.0f) {
+        meshCentroid /= meshArea;
+    }
+
+    // Clusters that face away from the center are drawn first
+    std::vector<float> sortKey(numClusters, 0.0f);
+    for(uint32_t c = 0; c < numClusters; ++c) {
+        float length = glm::length(normals[c]);
+        if(length > 0.0f) {
+            sortKey[c] = glm::dot(centroids[c] - meshCentroid, normals[c] / length);
+        }
+    }
+    std::vector<uint32_t> order(numClusters);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return sortKey[a] > sortKey[b];
+    });
+
+    std::vector<glm::ivec3> result;
+    result.reserve(faces.size());
+    for(uint32_t c : order) {
+        result.insert(result.end(), faces.begin() + clusterStart[c], faces.begin() + clusterStart[c + 1]);
+    }
+    faces.swap(result);
+}
+
+float MeshOptimizer::simplify(const std::vector<glm::ivec3> &faces,
+                              const std::vector<glm::vec3> &positions,
+                              size_t targetFaces,
+                              std::vector<glm::ivec3> &result)
+{
+    const uint32_t numVertices = (uint32_t)positions.size();
+    std::vector<glm::ivec3> tris(faces);
+    std::vector<bool> removed(tris.size(), false);
+    size_t liveFaces = tris.size();
+
+    std::vector<Quadric> quadrics(numVertices);
+    std::vector<std::vector<uint32_t>> adjacency(numVertices);
+    for(uint32_t t = 0; t < tris.size(); ++t) {
+        const glm::vec3& p0 = positions[tris[t][0]];
+        glm::vec3 n = glm::cross(positions[tris[t][1]] - p0, positions[tris[t][2]] - p0);
+        float length = glm::length(n);
+        for(uint32_t c = 0; c < 3; ++c) {
+            adjacency[tris[t][c]].push_back(t);
+            if(length > 0.0f) {
+                glm::vec3 u = n / length;
+                quadrics[tris[t][c]].addPlane(u.x, u.y, u.z, -glm::dot(u, p0), 0.5 * length);
+            }
+        }
+    }
+
+    // Vertices of edges with other than 2 triangles are kept, to not open holes
+    std::vector<bool> locked(numVertices, false);
+    {
+        std::unordered_map<uint64_t, uint32_t> edgeCount;
+        edgeCount.reserve(tris.size() * 3 / 2);
+        for(const glm::ivec3& f : tris) {
+            for(uint32_t c = 0; c < 3; ++c) {
+                uint64_t a = (uint32_t)f[c], b = (uint32_t)f[(c + 1) % 3];
+                edgeCount[std::min(a, b) << 32 | std::max(a, b)]++;
+            }
+        }
+        for(const auto& edge : edgeCount) {
+            if(edge.second != 2) {
+                locked[edge.first >> 32] = true;
+                locked[edge.first & 0xffffffff] = true;
+            }
+        }
+    }
+
+    std::vector<uint32_t> version(numVertices, 0);
+    std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> queue;
+    auto pushEdge = [&](uint32_t a, uint32_t b) {
+        // Collapse in the cheaper direction that moves an unlocked vertex
+        double costAB = locked[a] ? INFINITY : Quadric::error(quadrics[a], quadrics[b], positions[b]);
+        double costBA = locked[b] ? INFINITY : Quadric::error(quadrics[a], quadrics[b], positions[a]);
+        if(costAB <= costBA && !locked[a]) {
+            queue.push({costAB, a, b, version[a], version[b]});
+        } else if(!locked[b]) {
+            queue.push({costBA, b, a, version[b], version[a]});
+        }
+    };
+    for(const glm::ivec3& f : tris) {
+        for(uint32_t c = 0; c < 3; ++c) {
+            if(f[c] < f[(c + 1) % 3]) {
+                pushEdge(f[c], f[(c + 1) % 3]);
+            }
+        }
+    }
+
+    auto neighbors = [&](uint32_t v, std::vector<uint32_t>& out) {
+        out.clear();
+        for(uint32_t t : adjacency[v]) {
+            if(removed[t]) {
+                continue;
+            }
+            for(uint32_t c = 0; c < 3; ++c) {
+                if((uint32_t)tris[t][c] != v) {
+                    out.push_back(tris[t][c]);
+                }
+            }
+        }
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+    };
+
+    double maxError = 0.0;
+    std::vector<uint32_t> neighborsFrom, neighborsTo, common;
+    while(liveFaces > targetFaces && !queue.empty()) {
+        const Collapse collapse = queue.top();
+        queue.pop();
+        const uint32_t u = collapse.from, v = collapse.to;
+        if(collapse.fromVersion != version[u] || collapse.toVersion != version[v]) {
+            continue; // stale
+        }
+
+        // Link condition, to keep the mesh manifold
+        neighbors(u, neighborsFrom);
+        neighbors(v, neighborsTo);
+        common.clear();
+        std::set_intersection(neighborsFrom.begin(), neighborsFrom.end(),
+                              neighborsTo.begin(), neighborsTo.end(),
+                              std::back_inserter(common));
+        if(common.size() != 2) {
+            continue;
+        }
+
+        // Triangles that remain must not flip
+        bool flips = false;
+        for(uint32_t t : adjacency[u]) {
+            const glm::ivec3& f = tris[t];
+            if(removed[t] || f[0] == (int)v || f[1] == (int)v || f[2] == (int)v) {
+                continue;
+            }
+            glm::vec3 p[3], q[3];
+            for(uint32_t c = 0; c < 3; ++c) {
+                p[c] = positions[f[c]];
+                q[c] = (uint32_t)f[c] == u ? positions[v] : p[c];
+            }
+            glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+            glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+            if(glm::dot(before, after) <= 0.0f) {
+                flips = true;
+                break;
+            }
+        }
+        if(flips) {
+            continue;
+        }
+
+        for(uint32_t t : adjacency[u]) {
+            if(removed[t]) {
+                continue;
+            }
+            glm::ivec3& f = tris[t];
+            if(f[0] == (int)v || f[1] == (int)v || f[2] == (int)v) {
+                removed[t] = true;
+                --liveFaces;
+                continue;
+            }
+            for(uint32_t c = 0; c < 3; ++c) {
+                if((uint32_t)f[c] == u) {
+                    f[c] = v;
+                }
+            }
+            adjacency[v].push_back(t);
+        }
+        adjacency[u].clear();
+        adjacency[v].erase(std::remove_if(adjacency[v].begin(), adjacency[v].end(),
+                                          [&](uint32_t t) { return removed[t]; }),
+                           adjacency[v].end());
+        quadrics[v].add(quadrics[u]);
+        ++version[u];
+        ++version[v];
+        maxError = std::max(maxError, collapse.cost);
+
+        neighbors(v, neighborsTo);
+        for(uint32_t w : neighborsTo) {
+            pushEdge(v, w);
+        }
+    }
+
+    result.clear();
+    result.reserve(liveFaces);
+    for(uint32_t t = 0; t < tris.size(); ++t) {
+        if(!removed[t]) {
+            result.push_back(tris[t]);
+        }
+    }
+    return (float)std::sqrt(maxError);
+}
+
+void MeshOptimizer::buildMeshlets(std::vector<glm::ivec3> &faces,
+                                  const std::vector<glm::vec3> &positions,
+                                  std::vector<Meshlet> &meshlets,
+                                  uint32_t maxVertices,
+                                  uint32_t maxTriangles)
+{
+    meshlets.clear();
+    if(faces.empty()) {
+        return;
+    }
+
+    const uint32_t numVertices = (uint32_t)positions.size();
+    std::vector<uint32_t> adjacencyOffsets, adjacency;
+    buildAdjacency(faces, numVertices, adjacencyOffsets, adjacency);
+
+    std::vector<bool> used(faces.size(), false);
+    // Last meshlet that uses each vertex
+    std::vector<uint32_t> vertexMeshlet(numVertices, ~0u);
+    std::vector<uint32_t> candidates;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::ivec3> result;
+    result.reserve(faces.size());
+
+    uint32_t cursor = 0;
+    while(result.size() < faces.size()) {
+        while(used[cursor]) {
+            ++cursor;
+        }
+
+        const uint32_t id = (uint32_t)meshlets.size();
+        Meshlet meshlet;
+        meshlet.firstFace = (uint32_t)result.size();
+        uint32_t numMeshletVertices = 0;
+        candidates.clear();
+
+        auto addTriangle = [&](uint32_t t) {
+            used[t] = true;
+            result.push_back(faces[t]);
+            for(uint32_t c = 0; c < 3; ++c) {
+                const uint32_t v = faces[t][c];
+                if(vertexMeshlet[v] == id) {
+                    continue;
+                }
+                vertexMeshlet[v] = id;
+                ++numMeshletVertices;
+                for(uint32_t a = adjacencyOffsets[v]; a < adjacencyOffsets[v + 1]; ++a) {
+                    if(!used[adjacency[a]]) {
+                        candidates.push_back(adjacency[a]);
+                    }
+                }
+            }
+        };
+        addTriangle(cursor);
+
+        // Grow with the neighbor that adds less vertices
+        while(result.size() - meshlet.firstFace < maxTriangles) {
+            candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                            [&](uint32_t t) { return used[t]; }),
+                             candidates.end());
+            int64_t best = -1;
+            uint32_t bestNewVertices = 4;
+            for(uint32_t t : candidates) {
+                uint32_t newVertices = 0;
+                for(uint32_t c = 0; c < 3; ++c) {
+                    newVertices += vertexMeshlet[faces[t][c]] != id;
+                }
+                if(numMeshletVertices + newVertices <= maxVertices && newVertices < bestNewVertices) {
+                    best = t;
+                    bestNewVertices = newVertices;
+                    if(newVertices == 0) {
+                        break;
+                    }
+                }
+            }
+            if(best < 0) {
+                break;
+            }
+            addTriangle((uint32_t)best);
+        }
+        meshlet.numFaces = (uint32_t)result.size() - meshlet.firstFace;
+
+        // Bounding sphere around the center of the box of the vertices
+        glm::vec3 min(std::numeric_limits<float>::infinity());
+        glm::vec3 max(-std::numeric_limits<float>::infinity());
+        glm::vec3 normalSum(0.0f);
+        for(uint32_t t = meshlet.firstFace; t < result.size(); ++t) {
+            for(uint32_t c = 0; c < 3; ++c) {
+                min = glm::min(min, positions[result[t][c]]);
+                max = glm::max(max, positions[result[t][c]]);
+            }
+        }
+        meshlet.center = 0.5f * (min + max);
+        meshlet.radius = 0.0f;
+        normals.clear();
+        for(uint32_t t = meshlet.firstFace; t < result.size(); ++t) {
+            const glm::vec3& p0 = positions[result[t][0]];
+            for(uint32_t c = 0; c < 3; ++c) {
+                meshlet.radius = std::max(meshlet.radius, glm::length(positions[result[t][c]] - meshlet.center));
+            }
+            glm::vec3 n = glm::cross(positions[result[t][1]] - p0, positions[result[t][2]] - p0);
+            float length = glm::length(n);
+            if(length > 0.0f) {
+                normals.push_back(n / length);
+                normalSum += n / length;
+            }
+        }
+
+        // Cone around the mean normal. Wide cones are never culled
+        meshlet.coneAxis = glm::vec3(0.0f, 0.0f, 1.0f);
+        meshlet.coneCutoff = 2.0f;
+        float sumLength = glm::length(normalSum);
+        if(sumLength > 0.0f) {
+            meshlet.coneAxis = normalSum / sumLength;
+            float minDot = 1.0f;
+            for(const glm::vec3& n : normals) {
+                minDot = std::min(minDot, glm::dot(n, meshlet.coneAxis));
+            }
+            if(minDot > 0.1f) {
+                meshlet.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+            }
+        }
+
+        meshlets.push_back(meshlet);
+    }
+
+    faces.swap(result);
+}
+
+std::vector<uint32_t> MeshOptimizer::optimizeVertexFetch(std::vector<glm::ivec3> &faces,
+                                                         uint32_t numVertices)
+{
+    const uint32_t unused = ~0u;
+    std::vector<uint32_t> remap(numVertices, unused);
+    uint32_t next = 0;
+    for(glm::ivec3& f : faces) {
+        for(uint32_t c = 0; c < 3; ++c) {
+            uint32_t& newIndex = remap[f[c]];
+            if(newIndex == unused) {
+                newIndex = next++;
+            }
+            f[c] = newIndex;
+        }
+    }
+    for(uint32_t& newIndex : remap) {
+        if(newIndex == unused) {
+            newIndex = next++;
+        }
+    }
+    return remap;
+}
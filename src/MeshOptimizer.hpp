@@ -0,0 +1,79 @@
+#ifndef MESHOPTIMIZER_HPP
+#define MESHOPTIMIZER_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <glm/glm.hpp>
+
+// Reordering of the triangles and vertices of an indexed mesh, to make better
+// use of the post-transform vertex cache and to reduce overdraw
+class MeshOptimizer
+{
+public:
+    struct VertexCacheStats
+    {
+        float acmr = 0.0f; // vertices transformed per triangle
+        float atvr = 0.0f; // vertices transformed per vertex of the mesh
+    };
+
+    // Range of faces, with a bounding sphere and a cone that contains their normals.
+    // The meshlet faces away from a camera at c if, with d = center - c,
+    // dot(d, coneAxis) >= coneCutoff * length(d) + radius
+    struct Meshlet
+    {
+        uint32_t firstFace;
+        uint32_t numFaces;
+        glm::vec3 center;
+        float radius;
+        glm::vec3 coneAxis;
+        float coneCutoff; // sine of the angle of the cone, above 1 if it can not be culled
+    };
+
+    // Simulate a FIFO vertex cache of cacheSize entries drawing the triangles in order
+    static VertexCacheStats analyzeVertexCache(const glm::ivec3* faces,
+                                               size_t numFaces,
+                                               uint32_t numVertices,
+                                               uint32_t cacheSize = 16);
+
+    // Tipsify (Sander et al. 2007). Fans around vertices while they are still
+    // expected to be in a cache of cacheSize entries
+    static void optimizeVertexCache(std::vector<glm::ivec3>& faces,
+                                    uint32_t numVertices,
+                                    uint32_t cacheSize = 16);
+
+    // Split the triangles in clusters, and draw first the clusters that face outwards,
+    // so they tend to occlude the rest (Sander et al. 2007). The clusters start where
+    // the cache is cold, but can still hit vertices of the one before, so reordering
+    // them raises the ACMR. They are split further only into parts whose ACMR with a
+    // cold cache is at most threshold times the one of the cluster, which bounds it
+    static void optimizeOverdraw(std::vector<glm::ivec3>& faces,
+                                 const std::vector<glm::vec3>& positions,
+                                 float threshold = 1.05f,
+                                 uint32_t cacheSize = 16);
+
+    // Quadric error edge collapse (Garland and Heckbert 1997) until at most targetFaces
+    // remain. Edges collapse onto one of their vertices, so the result indexes the
+    // same positions. Border vertices are kept. Returns the error of the result, as
+    // a distance in the units of the positions
+    static float simplify(const std::vector<glm::ivec3>& faces,
+                          const std::vector<glm::vec3>& positions,
+                          size_t targetFaces,
+                          std::vector<glm::ivec3>& result);
+
+    // Split the triangles in meshlets of at most maxVertices vertices and maxTriangles
+    // triangles, grown over shared vertices, and reorder the faces so that each
+    // meshlet is a range of them
+    static void buildMeshlets(std::vector<glm::ivec3>& faces,
+                              const std::vector<glm::vec3>& positions,
+                              std::vector<Meshlet>& meshlets,
+                              uint32_t maxVertices = 64,
+                              uint32_t maxTriangles = 124);
+
+    // Renumber the vertices in the order they are first used, and return the new
+    // index of each old vertex. Unused vertices go to the end
+    static std::vector<uint32_t> optimizeVertexFetch(std::vector<glm::ivec3>& faces,
+                                                     uint32_t numVertices);
+};
+
+#endif // MESHOPTIMIZER_HPP
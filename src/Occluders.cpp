@@ -0,0 +1,280 @@
+#include "Occluders.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <glad/glad.h>
+
+namespace {
+enum VoxelState : uint8_t {
+    eUnknown = 0,
+    eSurface = 1,
+    eOutside = 2,
+    eUsed = 3
+};
+}
+
+Occluders::~Occluders()
+{
+    clear();
+}
+
+void Occluders::clear()
+{
+    for(MeshOccluder& occluder : mOccluders) {
+        glDeleteBuffers(1, &occluder.vbo);
+        glDeleteVertexArrays(1, &occluder.vao);
+    }
+    mOccluders.clear();
+}
+
+void Occluders::build(const Scene *scene, uint32_t resolution, uint32_t maxBoxes)
+{
+    assert(scene != nullptr && resolution > 0);
+    clear();
+    mScene = scene;
+    mOccluders.resize(scene->numMeshes());
+    for(uint32_t m = 0; m < mOccluders.size(); ++m) {
+        glGenVertexArrays(1, &mOccluders[m].vao);
+        glGenBuffers(1, &mOccluders[m].vbo);
+        buildMesh(scene->getMesh(m), resolution, maxBoxes, mOccluders[m]);
+    }
+}
+
+size_t Occluders::numBoxes() const
+{
+    size_t boxes = 0;
+    for(const MeshOccluder& occluder : mOccluders) {
+        boxes += occluder.boxes.size();
+    }
+    return boxes;
+}
+
+float Occluders::getCoverage() const
+{
+    float coverage = 0.0f;
+    for(const MeshOccluder& occluder : mOccluders) {
+        coverage += occluder.coverage;
+    }
+    return mOccluders.empty() ? 0.0f : coverage / float(mOccluders.size());
+}
+
+void Occluders::buildMesh(const Mesh *mesh, uint32_t resolution, uint32_t maxBoxes, MeshOccluder& occluder)
+{
+    const glm::vec3 minBB = mesh->getMinBB();
+    const glm::vec3 extent = mesh->getMaxBB() - minBB;
+    const float h = std::max(extent.x, std::max(extent.y, extent.z)) / float(resolution);
+
+    // Voxel grid with a layer of padding, so that the outside is connected
+    glm::ivec3 n;
+    for(uint32_t a = 0; a < 3; ++a) {
+        n[a] = std::max(1, (int32_t)std::ceil(extent[a] / h)) + 2;
+    }
+    auto idx = [&n](int32_t x, int32_t y, int32_t z) {
+        return (size_t(z) * n.y + y) * n.x + x;
+    };
+    std::vector<uint8_t> voxels(size_t(n.x) * n.y * n.z, eUnknown);
+
+    // Mark every voxel touched by the bounding box of a triangle. This marks more
+    // voxels than the exact intersection, which only makes the interior smaller
+    const Mesh::GeometryView geometry(*mesh);
+    if(!geometry.isValid()) {
+        throw std::runtime_error("The occluders need the geometry of the mesh, but it was released");
+    }
+    const float eps = 1e-4f * h;
+    for(uint32_t f = 0; f < geometry.numFaces(); ++f) {
+        const glm::ivec3& face = geometry.getFace(f);
+        const glm::vec3& v0 = geometry.getVertexPosition(face.x);
+        const glm::vec3& v1 = geometry.getVertexPosition(face.y);
+        const glm::vec3& v2 = geometry.getVertexPosition(face.z);
+        glm::vec3 tMin = glm::min(v0, glm::min(v1, v2)) - minBB - eps;
+        glm::vec3 tMax = glm::max(v0, glm::max(v1, v2)) - minBB + eps;
+
+        glm::ivec3 lo, hi;
+        for(uint32_t a = 0; a < 3; ++a) {
+            lo[a] = glm::clamp((int32_t)std::floor(tMin[a] / h) + 1, 1, n[a] - 2);
+            hi[a] = glm::clamp((int32_t)std::floor(tMax[a] / h) + 1, 1, n[a] - 2);
+        }
+        for(int32_t z = lo.z; z <= hi.z; ++z) {
+            for(int32_t y = lo.y; y <= hi.y; ++y) {
+                for(int32_t x = lo.x; x <= hi.x; ++x) {
+                    voxels[idx(x, y, z)] = eSurface;
+                }
+            }
+        }
+    }
+
+    // Flood fill the outside from a corner of the padding
+    std::queue<glm::ivec3> toVisit;
+    voxels[idx(0, 0, 0)] = eOutside;
+    toVisit.push(glm::ivec3(0));
+    const glm::ivec3 neighbours[6] = {
+        {1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}
+    };
+    while(!toVisit.empty()) {
+        glm::ivec3 v = toVisit.front();
+        toVisit.pop();
+        for(const glm::ivec3& d : neighbours) {
+            glm::ivec3 u = v + d;
+            if(u.x < 0 || u.y < 0 || u.z < 0 ||
+                u.x >= n.x || u.y >= n.y || u.z >= n.z) {
+                continue;
+            }
+            uint8_t& state = voxels[idx(u.x, u.y, u.z)];
+            if(state == eUnknown) {
+                state = eOutside;
+                toVisit.push(u);
+            }
+        }
+    }
+
+    // The remaining unknown voxels are interior. Grow boxes greedily, first in x,
+    // then in z and finally in y
+    auto isFree = [&](int32_t x, int32_t y, int32_t z) {
+        return voxels[idx(x, y, z)] == eUnknown;
+    };
+    std::vector<std::pair<uint32_t, std::pair<glm::ivec3, glm::ivec3>>> grown;
+    for(int32_t z = 1; z < n.z - 1; ++z) {
+        for(int32_t y = 1; y < n.y - 1; ++y) {
+            for(int32_t x = 1; x < n.x - 1; ++x) {
+                if(!isFree(x, y, z)) {
+                    continue;
+                }
+                glm::ivec3 hi(x, y, z);
+                while(isFree(hi.x + 1, y, z)) {
+                    ++hi.x;
+                }
+                bool grow = true;
+                while(grow) {
+                    for(int32_t i = x; i <= hi.x && grow; ++i) {
+                        grow = isFree(i, y, hi.z + 1);
+                    }
+                    hi.z += grow ? 1 : 0;
+                }
+                grow = true;
+                while(grow) {
+                    for(int32_t k = z; k <= hi.z && grow; ++k) {
+                        for(int32_t i = x; i <= hi.x && grow; ++i) {
+                            grow = isFree(i, hi.y + 1, k);
+                        }
+                    }
+                    hi.y += grow ? 1 : 0;
+                }
+
+                for(int32_t k = z; k <= hi.z; ++k) {
+                    for(int32_t j = y; j <= hi.y; ++j) {
+                        for(int32_t i = x; i <= hi.x; ++i) {
+                            voxels[idx(i, j, k)] = eUsed;
+                        }
+                    }
+                }
+                glm::ivec3 size = hi - glm::ivec3(x, y, z) + 1;
+                grown.push_back({uint32_t(size.x * size.y * size.z),
+                                 {glm::ivec3(x, y, z), hi}});
+            }
+        }
+    }
+
+    std::sort(grown.begin(), grown.end(),
+              [](const auto& a, const auto& b) { return a.first > b.first; });
+    if(grown.size() > maxBoxes) {
+        grown.resize(maxBoxes);
+    }
+
+    const glm::mat4& M = mesh->getModelMatrix();
+    uint32_t usedVoxels = 0;
+    for(const auto& g : grown) {
+        glm::vec3 bMin = minBB + glm::vec3(g.second.first - 1) * h;
+        glm::vec3 bMax = minBB + glm::vec3(g.second.second) * h;
+        occluder.boxes.push_back({bMin, bMax});
+        occluder.boxesModel.push_back({glm::vec3(M * glm::vec4(bMin, 1.0f)),
+                                       glm::vec3(M * glm::vec4(bMax, 1.0f))});
+        usedVoxels += g.first;
+    }
+    occluder.coverage = float(usedVoxels) * h * h * h / (extent.x * extent.y * extent.z);
+
+    mesh->createBoxesVAO(occluder.vao, occluder.vbo, occluder.boxes);
+}
+
+float Occluders::projectedArea(const MeshOccluder& occluder, const glm::mat4 &modelViewProj)
+{
+    float area = 0.0f;
+    for(const auto& box : occluder.boxesModel) {
+        glm::vec2 ndcMin( std::numeric_limits<float>::infinity());
+        glm::vec2 ndcMax(-std::numeric_limits<float>::infinity());
+        uint32_t behind = 0;
+        for(uint32_t i = 0; i < 8; ++i) {
+            glm::vec3 interp(i & 0b1, (i & 0b10) >> 1, (i & 0b100) >> 2);
+            glm::vec4 corner = modelViewProj * glm::vec4(box.first * (1.0f - interp) + box.second * interp, 1.0f);
+            if(corner.z < -corner.w) {
+                ++behind;
+                continue;
+            }
+            glm::vec2 ndc = glm::vec2(corner.x, corner.y) / corner.w;
+            ndcMin = glm::min(ndcMin, ndc);
+            ndcMax = glm::max(ndcMax, ndc);
+        }
+        if(behind == 8) {
+            // Behind the near plane, it hides nothing
+            continue;
+        }
+        if(behind != 0) {
+            // The box crosses the near plane: it covers the whole screen
+            area += 4.0f;
+            continue;
+        }
+        ndcMin = glm::clamp(ndcMin, -1.0f, 1.0f);
+        ndcMax = glm::clamp(ndcMax, -1.0f, 1.0f);
+        glm::vec2 d = ndcMax - ndcMin;
+        area += d.x * d.y;
+    }
+    return area;
+}
+
+void Occluders::select(const std::vector<uint32_t> *candidates,
+                       const glm::mat4 &viewProj,
+                       uint32_t k,
+                       std::vector<uint32_t> &selected)
+{
+    selected.clear();
+    mAreas.clear();
+
+    auto consider = [&](uint32_t i) {
+        float area = projectedArea(mOccluders[mScene->getMeshId(i)],
+                                   viewProj * mScene->getTransform(i).toMatrix());
+        if(area > 0.0f) {
+            mAreas.push_back({area, i});
+        }
+    };
+
+    if(candidates != nullptr) {
+        for(uint32_t i : *candidates) {
+            consider(i);
+        }
+    } else {
+        for(uint32_t i = 0; i < mScene->numInstances(); ++i) {
+            consider(i);
+        }
+    }
+
+    k = std::min(k, (uint32_t)mAreas.size());
+    std::partial_sort(mAreas.begin(), mAreas.begin() + k, mAreas.end(),
+                      [](const auto& a, const auto& b) { return a.first > b.first; });
+    for(uint32_t i = 0; i < k; ++i) {
+        selected.push_back(mAreas[i].second);
+    }
+}
+
+void Occluders::drawOnlyInstance(uint32_t instance) const
+{
+    const uint32_t id = mScene->getMeshId(instance);
+    mScene->bindMesh(id);
+    glBindVertexArray(mOccluders[id].vao);
+
+    glDrawArraysInstancedBaseInstance(GL_TRIANGLES, 0, 36 * mOccluders[id].boxes.size(), 1, instance);
+
+    glBindVertexArray(0);
+}
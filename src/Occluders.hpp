@@ -0,0 +1,68 @@
+#ifndef OCCLUDERS_HPP
+#define OCCLUDERS_HPP
+
+#include "Scene.hpp"
+
+#include <vector>
+#include <utility>
+#include <glm/glm.hpp>
+
+// Simplified occluder of each mesh of a scene: a small set of boxes that are fully
+// inside of it, so that anything they hide is also hidden by the full mesh
+class Occluders
+{
+public:
+    Occluders() = default;
+    ~Occluders();
+
+    Occluders(const Occluders&o) = delete;
+    Occluders& operator=(const Occluders&o) = delete;
+
+    // Voxelize each mesh with resolution voxels along its longest axis, and keep
+    // the maxBoxes biggest boxes that can be made with interior voxels
+    void build(const Scene* scene, uint32_t resolution = 32, uint32_t maxBoxes = 8);
+
+    // Select the k instances whose occluder covers more area on the screen.
+    // If candidates is not null, only those instances are considered
+    void select(const std::vector<uint32_t>* candidates,
+                const glm::mat4& viewProj,
+                uint32_t k,
+                std::vector<uint32_t>& selected);
+
+    // Draw the occluder boxes of a single instance, with the ones of its mesh
+    void drawOnlyInstance(uint32_t instance) const;
+
+    // Of all the meshes
+    size_t numBoxes() const;
+
+    // Fraction of the volume of the bounding box of the meshes covered by their
+    // occluders, on average
+    float getCoverage() const;
+
+private:
+    struct MeshOccluder
+    {
+        // Boxes in mesh space, sorted by decreasing volume
+        std::vector<std::pair<glm::vec3, glm::vec3>> boxes;
+        // Boxes with the model transform applied, used to compute the screen area
+        std::vector<std::pair<glm::vec3, glm::vec3>> boxesModel;
+
+        float coverage = 0.0f;
+
+        uint32_t vao = 0;
+        uint32_t vbo = 0;
+    };
+
+    const Scene* mScene = nullptr;
+    std::vector<MeshOccluder> mOccluders;
+
+    // Scratch buffer for the selection, kept to not allocate each frame
+    std::vector<std::pair<float, uint32_t>> mAreas;
+
+    void buildMesh(const Mesh* mesh, uint32_t resolution, uint32_t maxBoxes, MeshOccluder& occluder);
+    void clear();
+    // Sum of the screen areas of the boxes, with the transform of an instance
+    static float projectedArea(const MeshOccluder& occluder, const glm::mat4& modelViewProj);
+};
+
+#endif // OCCLUDERS_HPP
@@ -0,0 +1,224 @@
+#include "PVS.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <glad/glad.h>
+#include <glm/gtc/matrix_transform.hpp>
+
+bool PVS::bake(const std::string &fileName,
+               const Scene *scene,
+               uint32_t numInstances,
+               uint32_t idProgram,
+               const glm::vec3 &boundsMin,
+               const glm::vec3 &boundsMax,
+               const glm::ivec3 &cells,
+               uint32_t samplesPerCell,
+               uint32_t faceResolution)
+{
+    assert(scene != nullptr && samplesPerCell > 0);
+    const uint32_t numWords = (numInstances + 63) / 64;
+    const uint32_t numCells = cells.x * cells.y * cells.z;
+    std::vector<uint64_t> bits(size_t(numCells) * numWords, 0);
+
+    // Render the ids of the instances in an offscreen framebuffer
+    uint32_t fbo, colorRB, depthRB;
+    glGenFramebuffers(1, &fbo);
+    glGenRenderbuffers(1, &colorRB);
+    glGenRenderbuffers(1, &depthRB);
+    glBindRenderbuffer(GL_RENDERBUFFER, colorRB);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_R32UI, faceResolution, faceResolution);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthRB);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, faceResolution, faceResolution);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorRB);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRB);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+    int32_t viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glViewport(0, 0, faceResolution, faceResolution);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+
+    glUseProgram(idProgram);
+    scene->invalidateBinding();
+    const glm::mat4 proj = glm::perspective(glm::radians(90.f), 1.0f, 0.01f, 100.0f);
+    glUniformMatrix4fv(2, 1, GL_FALSE, &proj[0][0]);
+
+    const glm::vec3 dirs[6] = {
+        {1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}
+    };
+    const glm::vec3 ups[6] = {
+        {0, 1, 0}, {0, 1, 0}, {0, 0, 1}, {0, 0, 1}, {0, 1, 0}, {0, 1, 0}
+    };
+
+    const glm::ivec3 lattice = cells * int32_t(samplesPerCell) + 1;
+    const glm::vec3 step = (boundsMax - boundsMin) / glm::vec3(cells * int32_t(samplesPerCell));
+    const int32_t S = samplesPerCell;
+
+    std::vector<uint32_t> ids(size_t(faceResolution) * faceResolution);
+    std::vector<uint64_t> seen(numWords);
+    const uint32_t clearId = 0;
+    const float clearDepth = 1.0f;
+
+    for(int32_t lz = 0; lz < lattice.z && complete; ++lz) {
+        std::cout << "Baking PVS: " << lz + 1 << "/" << lattice.z << std::endl;
+        for(int32_t ly = 0; ly < lattice.y; ++ly) {
+            for(int32_t lx = 0; lx < lattice.x; ++lx) {
+                const glm::ivec3 l(lx, ly, lz);
+                const glm::vec3 pos = boundsMin + glm::vec3(l) * step;
+
+                std::fill(seen.begin(), seen.end(), 0);
+                for(uint32_t f = 0; f < 6; ++f) {
+                    glm::mat4 view = glm::lookAt(pos, pos + dirs[f], ups[f]);
+                    glUniformMatrix4fv(1, 1, GL_FALSE, &view[0][0]);
+                    glClearBufferuiv(GL_COLOR, 0, &clearId);
+                    glClearBufferfv(GL_DEPTH, 0, &clearDepth);
+                    scene->draw();
+                    glReadPixels(0, 0, faceResolution, faceResolution, GL_RED_INTEGER, GL_UNSIGNED_INT, ids.data());
+                    for(uint32_t id : ids) {
+                        if(id != 0 && id <= numInstances) {
+                            seen[(id - 1) / 64] |= uint64_t(1) << ((id - 1) % 64);
+                        }
+                    }
+                }
+
+                // A point of the lattice is shared by all the cells around it
+                glm::ivec3 cLo, cHi;
+                for(uint32_t a = 0; a < 3; ++a) {
+                    cLo[a] = std::max(0, (l[a] + S - 1) / S - 1);
+                    cHi[a] = std::min(cells[a] - 1, l[a] / S);
+                }
+                for(int32_t cz = cLo.z; cz <= cHi.z; ++cz) {
+                    for(int32_t cy = cLo.y; cy <= cHi.y; ++cy) {
+                        for(int32_t cx = cLo.x; cx <= cHi.x; ++cx) {
+                            uint64_t* cell = bits.data() + size_t((cz * cells.y + cy) * cells.x + cx) * numWords;
+                            for(uint32_t w = 0; w < numWords; ++w) {
+                                cell[w] |= seen[w];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    glDeleteRenderbuffers(1, &colorRB);
+    glDeleteRenderbuffers(1, &depthRB);
+    glDeleteFramebuffers(1, &fbo);
+
+    if(!complete) {
+        std::cerr << "Can't create the framebuffer to bake the PVS" << std::endl;
+        return false;
+    }
+
+    // Dilate the sets one cell in every direction, from a copy to not spread them further
+    const std::vector<uint64_t> sampled = bits;
+    for(int32_t cz = 0; cz < cells.z; ++cz) {
+        for(int32_t cy = 0; cy < cells.y; ++cy) {
+            for(int32_t cx = 0; cx < cells.x; ++cx) {
+                uint64_t* cell = bits.data() + size_t((cz * cells.y + cy) * cells.x + cx) * numWords;
+                for(int32_t nz = std::max(0, cz - 1); nz <= std::min(cells.z - 1, cz + 1); ++nz) {
+                    for(int32_t ny = std::max(0, cy - 1); ny <= std::min(cells.y - 1, cy + 1); ++ny) {
+                        for(int32_t nx = std::max(0, cx - 1); nx <= std::min(cells.x - 1, cx + 1); ++nx) {
+                            const uint64_t* n = sampled.data() + size_t((nz * cells.y + ny) * cells.x + nx) * numWords;
+                            for(uint32_t w = 0; w < numWords; ++w) {
+                                cell[w] |= n[w];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    Header header = {};
+    std::memcpy(header.magic, "PVS1", 4);
+    header.version = VERSION;
+    header.numInstances = numInstances;
+    header.numWords = numWords;
+    header.layoutKey = layoutKey(scene, numInstances);
+    for(uint32_t a = 0; a < 3; ++a) {
+        header.cells[a] = cells[a];
+        header.boundsMin[a] = boundsMin[a];
+        header.boundsMax[a] = boundsMax[a];
+    }
+
+    std::ofstream stream(fileName, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+    if(!stream) {
+        std::cerr << "Can't write " << fileName << std::endl;
+        return false;
+    }
+    stream.write((const char*)&header, sizeof(header));
+    stream.write((const char*)bits.data(), bits.size() * sizeof(uint64_t));
+    return bool(stream);
+}
+
+bool PVS::load(const std::string &fileName, const Scene *scene, uint32_t numInstances)
+{
+    if(!mFile.open(fileName) || mFile.size() < sizeof(Header)) {
+        return false;
+    }
+
+    Header header;
+    std::memcpy(&header, mFile.data(), sizeof(Header));
+    if(std::memcmp(header.magic, "PVS1", 4) != 0 || header.version != VERSION ||
+        header.numInstances != numInstances || header.layoutKey != layoutKey(scene, numInstances)) {
+        mFile.close();
+        return false;
+    }
+
+    mNumWords = header.numWords;
+    for(uint32_t a = 0; a < 3; ++a) {
+        mCells[a] = header.cells[a];
+        mBoundsMin[a] = header.boundsMin[a];
+        mBoundsMax[a] = header.boundsMax[a];
+    }
+    if(mFile.size() != sizeof(Header) + size_t(numCells()) * mNumWords * sizeof(uint64_t)) {
+        mFile.close();
+        return false;
+    }
+
+    mBits = (const uint64_t*)(mFile.data() + sizeof(Header));
+    return true;
+}
+
+uint64_t PVS::layoutKey(const Scene *scene, uint32_t numInstances)
+{
+    uint64_t key = 14695981039346656037ull;
+    auto hash = [&](const glm::vec3& v) {
+        uint8_t bytes[sizeof(glm::vec3)];
+        std::memcpy(bytes, &v, sizeof(bytes));
+        for(uint8_t b : bytes) {
+            key = (key ^ b) * 1099511628211ull;
+        }
+    };
+    for(uint32_t i = 0; i < numInstances; ++i) {
+        hash(scene->getInstanceMin(i));
+        hash(scene->getInstanceMax(i));
+    }
+    return key;
+}
+
+const uint64_t *PVS::getCell(const glm::vec3 &position) const
+{
+    if(mBits == nullptr) {
+        return nullptr;
+    }
+
+    glm::ivec3 c;
+    for(uint32_t a = 0; a < 3; ++a) {
+        if(position[a] < mBoundsMin[a] || position[a] > mBoundsMax[a]) {
+            return nullptr;
+        }
+        float t = (position[a] - mBoundsMin[a]) / (mBoundsMax[a] - mBoundsMin[a]);
+        c[a] = std::min((int32_t)(t * mCells[a]), mCells[a] - 1);
+    }
+    return mBits + size_t((c.z * mCells.y + c.y) * mCells.x + c.x) * mNumWords;
+}
@@ -0,0 +1,77 @@
+#ifndef PVS_HPP
+#define PVS_HPP
+
+#include "Scene.hpp"
+#include "MappedFile.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Potentially visible sets of a static scene. The region where the camera can be
+// is split in a grid of view cells, and each cell stores a bitset with the
+// instances that can be seen from it
+class PVS
+{
+public:
+    // Pixels of a 90° face as dense as the center of the runtime view, 512 / tan(22.5°)
+    static constexpr uint32_t DEFAULT_FACE_RESOLUTION = 1240;
+
+    PVS() = default;
+
+    // Render the instances of the scene from a lattice of points in each cell, in the
+    // 6 directions, and store which are seen in the file. samplesPerCell is the number of
+    // subdivisions of each cell per axis, and faceResolution the size of each render.
+    // Each cell also gets the sets of its neighbours, for what is only seen between the
+    // samples, so an instance is only missing if it is hidden or smaller than a pixel
+    // from all the samples of the cell and of its neighbours
+    static bool bake(const std::string& fileName,
+                     const Scene* scene,
+                     uint32_t numInstances,
+                     uint32_t idProgram,
+                     const glm::vec3& boundsMin,
+                     const glm::vec3& boundsMax,
+                     const glm::ivec3& cells,
+                     uint32_t samplesPerCell = 2,
+                     uint32_t faceResolution = DEFAULT_FACE_RESOLUTION);
+
+    // Map a baked file. Fails if it was baked for other instances, or for the same
+    // number of them placed in another layout
+    bool load(const std::string& fileName, const Scene* scene, uint32_t numInstances);
+
+    // Bitset of the cell that contains the position, nullptr if outside of all cells
+    const uint64_t* getCell(const glm::vec3& position) const;
+
+    uint32_t numWords() const { return mNumWords; }
+    uint32_t numCells() const { return mCells.x * mCells.y * mCells.z; }
+
+private:
+    struct Header
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t numInstances;
+        uint32_t numWords;
+        // Hash of the boxes of the instances the file was baked for
+        uint64_t layoutKey;
+        int32_t cells[3];
+        float boundsMin[3];
+        float boundsMax[3];
+        // Keep the bitsets aligned to 64 bits
+        uint32_t padding[1];
+    };
+    static constexpr uint32_t VERSION = 3;
+
+    // FNV-1a of the bounding boxes of the instances, which change with the meshes and the grid
+    static uint64_t layoutKey(const Scene* scene, uint32_t numInstances);
+
+    MappedFile mFile;
+    const uint64_t* mBits = nullptr;
+    uint32_t mNumWords = 0;
+    glm::ivec3 mCells = glm::ivec3(0);
+    glm::vec3 mBoundsMin = glm::vec3(0);
+    glm::vec3 mBoundsMax = glm::vec3(0);
+};
+
+#endif // PVS_HPP
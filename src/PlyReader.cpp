@@ -0,0 +1,530 @@
+#include "PlyReader.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+bool isHostLittleEndian() {
+    const uint16_t one = 1;
+    uint8_t first;
+    std::memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline const char* skipBlanks(const char* p, const char* end) {
+    while(p < end && isBlank(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+// Parse the next token of the line into value, false if there is none or it is not a number
+template<typename T>
+inline bool parseToken(const char*& p, const char* end, T& value) {
+    p = skipBlanks(p, end);
+    // from_chars does not accept the leading + that some exporters write
+    if(p < end && *p == '+') {
+        ++p;
+    }
+    std::from_chars_result result = std::from_chars(p, end, value);
+    if(result.ec != std::errc() || (result.ptr < end && !isBlank(*result.ptr))) {
+        return false;
+    }
+    p = result.ptr;
+    return true;
+}
+
+// Split [0, n) in chunks of at least minChunk elements, processed in parallel
+template<typename F>
+void parallelFor(size_t n, uint32_t numThreads, F f, size_t minChunk = 1 << 16) {
+    size_t chunks = std::max<size_t>(1, std::min<size_t>(numThreads, (n + minChunk - 1) / minChunk));
+    if(chunks == 1) {
+        f(size_t(0), n);
+        return;
+    }
+
+    size_t chunkSize = (n + chunks - 1) / chunks;
+    std::vector<std::thread> threads;
+    threads.reserve(chunks);
+    for(size_t c = 0; c < chunks; ++c) {
+        size_t begin = c * chunkSize;
+        size_t end = std::min(n, begin + chunkSize);
+        threads.emplace_back(f, begin, end);
+    }
+    for(std::thread& t : threads) {
+        t.join();
+    }
+}
+
+template<typename T>
+inline T loadUnaligned(const uint8_t* p) {
+    T v;
+    std::memcpy(&v, p, sizeof(T));
+    return v;
+}
+
+inline double loadScalar(const uint8_t* p, PlyReader::Type type) {
+    switch (type) {
+    case PlyReader::eInt8:    return loadUnaligned<int8_t>(p);
+    case PlyReader::eUInt8:   return loadUnaligned<uint8_t>(p);
+    case PlyReader::eInt16:   return loadUnaligned<int16_t>(p);
+    case PlyReader::eUInt16:  return loadUnaligned<uint16_t>(p);
+    case PlyReader::eInt32:   return loadUnaligned<int32_t>(p);
+    case PlyReader::eUInt32:  return loadUnaligned<uint32_t>(p);
+    case PlyReader::eFloat32: return loadUnaligned<float>(p);
+    case PlyReader::eFloat64: return loadUnaligned<double>(p);
+    default:
+        return 0.0;
+    }
+}
+
+inline float loadFloat(const uint8_t* p, PlyReader::Type type) {
+    if(type == PlyReader::eFloat32) {
+        return loadUnaligned<float>(p);
+    }
+    return (float)loadScalar(p, type);
+}
+
+}
+
+uint32_t PlyReader::typeSize(Type type)
+{
+    switch (type) {
+    case eInt8:
+    case eUInt8:
+        return 1;
+    case eInt16:
+    case eUInt16:
+        return 2;
+    case eInt32:
+    case eUInt32:
+    case eFloat32:
+        return 4;
+    case eFloat64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+PlyReader::Type PlyReader::parseType(const std::string &name)
+{
+    if(name == "char"   || name == "int8")    return eInt8;
+    if(name == "uchar"  || name == "uint8")   return eUInt8;
+    if(name == "short"  || name == "int16")   return eInt16;
+    if(name == "ushort" || name == "uint16")  return eUInt16;
+    if(name == "int"    || name == "int32")   return eInt32;
+    if(name == "uint"   || name == "uint32")  return eUInt32;
+    if(name == "float"  || name == "float32") return eFloat32;
+    if(name == "double" || name == "float64") return eFloat64;
+    return eInvalid;
+}
+
+bool PlyReader::parseHeader(const uint8_t *data, size_t size)
+{
+    mElements.clear();
+    mDataOffset = 0;
+
+    const char* text = (const char*)data;
+    const char* endHeader = "end_header";
+    size_t pos = 0;
+    bool first = true;
+    while(pos < size) {
+        size_t lineEnd = pos;
+        while(lineEnd < size && text[lineEnd] != '\n') {
+            ++lineEnd;
+        }
+        std::string line(text + pos, lineEnd - pos);
+        if(!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        pos = lineEnd + 1;
+
+        std::istringstream tokens(line);
+        std::string keyword;
+        tokens >> keyword;
+
+        if(first) {
+            if(keyword != "ply") {
+                return false;
+            }
+            first = false;
+        } else if(keyword == "format") {
+            std::string format;
+            tokens >> format;
+            if(format == "ascii") {
+                mFormat = eAscii;
+            } else if(format == "binary_little_endian") {
+                mFormat = eBinaryLittleEndian;
+            } else if(format == "binary_big_endian") {
+                mFormat = eBinaryBigEndian;
+            } else {
+                return false;
+            }
+        } else if(keyword == "element") {
+            Element element;
+            tokens >> element.name >> element.count;
+            if(tokens.fail()) {
+                return false;
+            }
+            mElements.push_back(element);
+        } else if(keyword == "property") {
+            if(mElements.empty()) {
+                return false;
+            }
+            Property property;
+            std::string type;
+            tokens >> type;
+            if(type == "list") {
+                std::string countType;
+                tokens >> countType >> type;
+                property.isList = true;
+                property.countType = parseType(countType);
+            }
+            property.type = parseType(type);
+            tokens >> property.name;
+            if(tokens.fail() || property.type == eInvalid ||
+                (property.isList && property.countType == eInvalid)) {
+                return false;
+            }
+            mElements.back().properties.push_back(property);
+        } else if(keyword == endHeader) {
+            mDataOffset = pos;
+            break;
+        }
+        // comment and obj_info lines are ignored
+    }
+
+    if(mDataOffset == 0) {
+        return false;
+    }
+
+    // Offsets of the properties, for the elements without lists
+    for(Element& element : mElements) {
+        uint32_t offset = 0;
+        bool fixed = true;
+        for(Property& property : element.properties) {
+            property.offset = offset;
+            offset += typeSize(property.type);
+            fixed &= !property.isList;
+        }
+        element.stride = fixed ? offset : 0;
+    }
+
+    return true;
+}
+
+int32_t PlyReader::findElement(const std::string &name) const
+{
+    for(uint32_t i = 0; i < mElements.size(); ++i) {
+        if(mElements[i].name == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int32_t PlyReader::findProperty(const Element &element, const std::string &name)
+{
+    for(uint32_t i = 0; i < element.properties.size(); ++i) {
+        if(element.properties[i].name == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool PlyReader::isSupported() const
+{
+    int32_t vertexIdx = findElement("vertex");
+    int32_t faceIdx = findElement("face");
+    if(vertexIdx < 0 || faceIdx < 0 || vertexIdx > faceIdx) {
+        return false;
+    }
+
+    const Element& vertex = mElements[vertexIdx];
+    if(vertex.stride == 0 ||
+        findProperty(vertex, "x") < 0 || findProperty(vertex, "y") < 0 || findProperty(vertex, "z") < 0) {
+        return false;
+    }
+
+    const Element& face = mElements[faceIdx];
+    if(face.properties.size() != 1 || !face.properties[0].isList ||
+        (face.properties[0].name != "vertex_indices" && face.properties[0].name != "vertex_index")) {
+        return false;
+    }
+    const Property& list = face.properties[0];
+
+    if(mFormat == eAscii) {
+        // Each element is a line, only the indices need to be integers
+        return list.type != eFloat32 && list.type != eFloat64;
+    }
+
+    if(mFormat != eBinaryLittleEndian || !isHostLittleEndian()) {
+        return false;
+    }
+
+    // Everything before the faces must have a known size
+    for(int32_t i = 0; i < faceIdx; ++i) {
+        if(mElements[i].stride == 0) {
+            return false;
+        }
+    }
+
+    return (list.type == eInt32 || list.type == eUInt32) &&
+            (list.countType == eUInt8 || list.countType == eInt8);
+}
+
+size_t PlyReader::numVertices() const
+{
+    int32_t idx = findElement("vertex");
+    return idx < 0 ? 0 : mElements[idx].count;
+}
+
+size_t PlyReader::numFaces() const
+{
+    int32_t idx = findElement("face");
+    return idx < 0 ? 0 : mElements[idx].count;
+}
+
+bool PlyReader::hasNormals() const
+{
+    int32_t idx = findElement("vertex");
+    return idx >= 0 &&
+            findProperty(mElements[idx], "nx") >= 0 &&
+            findProperty(mElements[idx], "ny") >= 0 &&
+            findProperty(mElements[idx], "nz") >= 0;
+}
+
+bool PlyReader::hasUvs() const
+{
+    int32_t idx = findElement("vertex");
+    return idx >= 0 &&
+            findProperty(mElements[idx], "s") >= 0 &&
+            findProperty(mElements[idx], "t") >= 0;
+}
+
+void PlyReader::read(const uint8_t *data, size_t size,
+                     const VertexTarget &vertices, uint32_t *indices,
+                     uint32_t numThreads) const
+{
+    if(!isSupported()) {
+        throw std::runtime_error("Unsupported ply layout for the fast reader");
+    }
+    if(mFormat == eAscii) {
+        readAscii(data, size, vertices, indices, std::max(1u, numThreads));
+    } else {
+        readBinary(data, size, vertices, indices, std::max(1u, numThreads));
+    }
+}
+
+void PlyReader::readBinary(const uint8_t *data, size_t size,
+                           const VertexTarget &vertices, uint32_t *indices,
+                           uint32_t numThreads) const
+{
+    const int32_t vertexIdx = findElement("vertex");
+    const int32_t faceIdx = findElement("face");
+
+    size_t vertexOffset = mDataOffset;
+    for(int32_t i = 0; i < vertexIdx; ++i) {
+        vertexOffset += mElements[i].count * mElements[i].stride;
+    }
+    const Element& vertex = mElements[vertexIdx];
+    size_t faceOffset = vertexOffset;
+    for(int32_t i = vertexIdx; i < faceIdx; ++i) {
+        faceOffset += mElements[i].count * mElements[i].stride;
+    }
+    const Element& face = mElements[faceIdx];
+
+    // All the faces are triangles, so they have a fixed size too
+    const Property& list = face.properties[0];
+    const size_t faceStride = typeSize(list.countType) + 3 * typeSize(list.type);
+    if(faceOffset > size || face.count * faceStride > size - faceOffset) {
+        throw std::runtime_error("Ply file shorter than declared in its header");
+    }
+
+    // Source properties of each target component, -1 if missing
+    const char* names[8] = {"x", "y", "z", "nx", "ny", "nz", "s", "t"};
+    float* targets[8] = {
+        vertices.pos, vertices.pos ? vertices.pos + 1 : nullptr, vertices.pos ? vertices.pos + 2 : nullptr,
+        vertices.normal, vertices.normal ? vertices.normal + 1 : nullptr, vertices.normal ? vertices.normal + 2 : nullptr,
+        vertices.uv, vertices.uv ? vertices.uv + 1 : nullptr
+    };
+    int32_t sources[8];
+    for(uint32_t c = 0; c < 8; ++c) {
+        sources[c] = findProperty(vertex, names[c]);
+    }
+
+    const uint8_t* vertexData = data + vertexOffset;
+    parallelFor(vertex.count, numThreads, [&](size_t begin, size_t end) {
+        for(uint32_t c = 0; c < 8; ++c) {
+            if(targets[c] == nullptr || sources[c] < 0) {
+                continue;
+            }
+            const Property& property = vertex.properties[sources[c]];
+            const uint8_t* src = vertexData + begin * vertex.stride + property.offset;
+            uint8_t* dst = (uint8_t*)targets[c] + begin * vertices.stride;
+            for(size_t i = begin; i < end; ++i) {
+                *(float*)dst = loadFloat(src, property.type);
+                src += vertex.stride;
+                dst += vertices.stride;
+            }
+        }
+    });
+
+    const uint8_t* faceData = data + faceOffset;
+    const uint32_t countSize = typeSize(list.countType);
+    std::atomic<bool> onlyTriangles(true);
+    parallelFor(face.count, numThreads, [&](size_t begin, size_t end) {
+        const uint8_t* src = faceData + begin * faceStride;
+        uint32_t* dst = indices + 3 * begin;
+        for(size_t i = begin; i < end; ++i) {
+            if(src[0] != 3) {
+                onlyTriangles = false;
+                return;
+            }
+            std::memcpy(dst, src + countSize, 3 * sizeof(uint32_t));
+            src += faceStride;
+            dst += 3;
+        }
+    });
+
+    if(!onlyTriangles) {
+        throw std::runtime_error("Loading face with a number of vertices different than 3");
+    }
+}
+
+void PlyReader::readAscii(const uint8_t *data, size_t size,
+                          const VertexTarget &vertices, uint32_t *indices,
+                          uint32_t numThreads) const
+{
+    const int32_t vertexIdx = findElement("vertex");
+    const int32_t faceIdx = findElement("face");
+    const Element& vertex = mElements[vertexIdx];
+    const Element& face = mElements[faceIdx];
+
+    // Every element is a line, find the first line of the vertices and of the faces
+    size_t vertexLine = 0;
+    for(int32_t i = 0; i < vertexIdx; ++i) {
+        vertexLine += mElements[i].count;
+    }
+    size_t faceLine = vertexLine;
+    for(int32_t i = vertexIdx; i < faceIdx; ++i) {
+        faceLine += mElements[i].count;
+    }
+    const size_t endLine = faceLine + face.count;
+
+    // Target component of each vertex property, nullptr to skip it
+    std::vector<float*> targets(vertex.properties.size(), nullptr);
+    const char* names[8] = {"x", "y", "z", "nx", "ny", "nz", "s", "t"};
+    float* components[8] = {
+        vertices.pos, vertices.pos ? vertices.pos + 1 : nullptr, vertices.pos ? vertices.pos + 2 : nullptr,
+        vertices.normal, vertices.normal ? vertices.normal + 1 : nullptr, vertices.normal ? vertices.normal + 2 : nullptr,
+        vertices.uv, vertices.uv ? vertices.uv + 1 : nullptr
+    };
+    for(uint32_t c = 0; c < 8; ++c) {
+        int32_t idx = findProperty(vertex, names[c]);
+        if(idx >= 0) {
+            targets[idx] = components[c];
+        }
+    }
+
+    // Split the body in chunks that start at the beginning of a line
+    const char* begin = (const char*)data + std::min(mDataOffset, size);
+    const char* end = (const char*)data + size;
+    const size_t minChunk = 1 << 20;
+    const size_t numChunks = std::max<size_t>(1, std::min<size_t>(numThreads, (end - begin) / minChunk));
+    std::vector<const char*> chunkBegin(numChunks + 1, end);
+    chunkBegin[0] = begin;
+    for(size_t c = 1; c < numChunks; ++c) {
+        const char* p = std::max(chunkBegin[c - 1], begin + (end - begin) * c / numChunks);
+        p = (const char*)std::memchr(p, '\n', end - p);
+        chunkBegin[c] = p ? p + 1 : end;
+    }
+
+    // Count the lines of each chunk, to know the index of its first line
+    std::vector<size_t> chunkLine(numChunks + 1, 0);
+    parallelFor(numChunks, numThreads, [&](size_t first, size_t last) {
+        for(size_t c = first; c < last; ++c) {
+            size_t lines = 0;
+            const char* p = chunkBegin[c];
+            while(p < chunkBegin[c + 1]) {
+                const char* next = (const char*)std::memchr(p, '\n', chunkBegin[c + 1] - p);
+                ++lines;
+                p = next ? next + 1 : chunkBegin[c + 1];
+            }
+            chunkLine[c + 1] = lines;
+        }
+    }, 1);
+    for(size_t c = 0; c < numChunks; ++c) {
+        chunkLine[c + 1] += chunkLine[c];
+    }
+    if(chunkLine[numChunks] < endLine) {
+        throw std::runtime_error("Ply file shorter than declared in its header");
+    }
+
+    // Each chunk writes its vertices and faces at their final position
+    std::atomic<bool> onlyTriangles(true);
+    std::atomic<bool> wellFormed(true);
+    parallelFor(numChunks, numThreads, [&](size_t first, size_t last) {
+        for(size_t c = first; c < last; ++c) {
+            size_t line = chunkLine[c];
+            const char* p = chunkBegin[c];
+            while(p < chunkBegin[c + 1] && line < endLine) {
+                const char* next = (const char*)std::memchr(p, '\n', chunkBegin[c + 1] - p);
+                const char* lineEnd = next ? next : chunkBegin[c + 1];
+
+                if(line >= vertexLine && line < vertexLine + vertex.count) {
+                    const size_t i = line - vertexLine;
+                    for(size_t prop = 0; prop < targets.size(); ++prop) {
+                        float value;
+                        if(!parseToken(p, lineEnd, value)) {
+                            wellFormed = false;
+                            return;
+                        }
+                        if(targets[prop] != nullptr) {
+                            *(float*)((uint8_t*)targets[prop] + i * vertices.stride) = value;
+                        }
+                    }
+                } else if(line >= faceLine) {
+                    const size_t i = line - faceLine;
+                    uint32_t count;
+                    if(!parseToken(p, lineEnd, count)) {
+                        wellFormed = false;
+                        return;
+                    }
+                    if(count != 3) {
+                        onlyTriangles = false;
+                        return;
+                    }
+                    for(uint32_t k = 0; k < 3; ++k) {
+                        if(!parseToken(p, lineEnd, indices[3 * i + k])) {
+                            wellFormed = false;
+                            return;
+                        }
+                    }
+                }
+
+                ++line;
+                p = lineEnd + 1;
+            }
+        }
+    }, 1);
+
+    if(!onlyTriangles) {
+        throw std::runtime_error("Loading face with a number of vertices different than 3");
+    }
+    if(!wellFormed) {
+        throw std::runtime_error("Malformed ascii ply data");
+    }
+}
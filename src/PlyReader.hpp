@@ -0,0 +1,96 @@
+#ifndef PLYREADER_HPP
+#define PLYREADER_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Fast path to read the common ply layouts (a vertex element with scalar
+// properties and a face element with only a list of triangle indices) directly
+// into the buffers of the caller, from binary little endian or ascii files.
+// Other files should be read with happly
+class PlyReader
+{
+public:
+    enum Format {
+        eAscii = 0,
+        eBinaryLittleEndian = 1,
+        eBinaryBigEndian = 2
+    };
+
+    enum Type {
+        eInt8 = 0,
+        eUInt8,
+        eInt16,
+        eUInt16,
+        eInt32,
+        eUInt32,
+        eFloat32,
+        eFloat64,
+        eInvalid
+    };
+
+    struct Property
+    {
+        std::string name;
+        Type type = eInvalid;
+        bool isList = false;
+        Type countType = eInvalid; // type of the size of the list
+        uint32_t offset = 0;      // in bytes inside of the element, only without lists
+    };
+
+    struct Element
+    {
+        std::string name;
+        size_t count = 0;
+        std::vector<Property> properties;
+        uint32_t stride = 0; // in bytes, 0 if it has lists
+    };
+
+    // Where to write each vertex attribute. Components are consecutive floats, and
+    // vertices are stride bytes apart. nullptr skips the attribute
+    struct VertexTarget
+    {
+        float* pos = nullptr;
+        float* normal = nullptr;
+        float* uv = nullptr;
+        size_t stride = 0;
+    };
+
+    // Parse the header of a file in memory. Returns false if it is not a valid ply
+    bool parseHeader(const uint8_t* data, size_t size);
+
+    // True if the file can be read with read()
+    bool isSupported() const;
+
+    size_t numVertices() const;
+    size_t numFaces() const;
+    bool hasNormals() const;
+    bool hasUvs() const;
+
+    // Decode the vertices and the triangle indices, splitting the work in up to
+    // numThreads threads. Throws if a face is not a triangle
+    void read(const uint8_t* data, size_t size,
+              const VertexTarget& vertices, uint32_t* indices,
+              uint32_t numThreads) const;
+
+private:
+    Format mFormat = eAscii;
+    std::vector<Element> mElements;
+    size_t mDataOffset = 0;
+
+    int32_t findElement(const std::string& name) const;
+    static int32_t findProperty(const Element& element, const std::string& name);
+    static uint32_t typeSize(Type type);
+    static Type parseType(const std::string& name);
+
+    void readBinary(const uint8_t* data, size_t size,
+                    const VertexTarget& vertices, uint32_t* indices,
+                    uint32_t numThreads) const;
+    void readAscii(const uint8_t* data, size_t size,
+                   const VertexTarget& vertices, uint32_t* indices,
+                   uint32_t numThreads) const;
+};
+
+#endif // PLYREADER_HPP
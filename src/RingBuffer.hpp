@@ -0,0 +1,59 @@
+#ifndef RINGBUFFER_HPP
+#define RINGBUFFER_HPP
+
+#include <vector>
+#include <cstddef>
+#include <cassert>
+
+// Queue of a bounded number of elements, allocated once, for the queues that are
+// filled and emptied again every frame without touching the heap
+template<typename T>
+class RingBuffer
+{
+public:
+    RingBuffer() = default;
+
+    // Empties the queue
+    void setCapacity(size_t capacity)
+    {
+        mElements.resize(capacity);
+        mHead = 0;
+        mSize = 0;
+    }
+
+    bool empty() const { return mSize == 0; }
+    size_t size() const { return mSize; }
+
+    void push(const T& value)
+    {
+        assert(mSize < mElements.size());
+        size_t tail = mHead + mSize;
+        if(tail >= mElements.size()) {
+            tail -= mElements.size();
+        }
+        mElements[tail] = value;
+        ++mSize;
+    }
+
+    const T& front() const
+    {
+        assert(mSize != 0);
+        return mElements[mHead];
+    }
+
+    void pop()
+    {
+        assert(mSize != 0);
+        if(++mHead == mElements.size()) {
+            mHead = 0;
+        }
+        --mSize;
+    }
+
+private:
+    std::vector<T> mElements;
+    size_t mHead = 0;
+    size_t mSize = 0;
+};
+
+#endif // RINGBUFFER_HPP
@@ -0,0 +1,141 @@
+#include "Scene.hpp"
+
+#include <cassert>
+#include <glad/glad.h>
+
+Scene::Scene(bool shareArena)
+{
+    if(shareArena) {
+        mArena = std::make_unique<GeometryArena>();
+    }
+}
+
+Mesh* Scene::addMesh()
+{
+    mMeshes.push_back(std::make_unique<Mesh>());
+    if(mArena) {
+        mMeshes.back()->setArena(mArena.get());
+    }
+    return mMeshes.back().get();
+}
+
+void Scene::setInstances(const std::vector<InstanceTransform> &transforms, const std::vector<uint32_t> &meshIds)
+{
+    assert(transforms.size() == meshIds.size());
+    mMeshIds = meshIds;
+    mTransforms = transforms;
+
+    std::vector<std::vector<uint32_t>> instances(mMeshes.size());
+    for(uint32_t i = 0; i < meshIds.size(); ++i) {
+        assert(meshIds[i] < mMeshes.size());
+        instances[meshIds[i]].push_back(i);
+    }
+
+    for(uint32_t m = 0; m < mMeshes.size(); ++m) {
+        mMeshes[m]->setInstances(transforms, instances[m]);
+    }
+    if(mArena) {
+        mArena->setInstances(transforms);
+    }
+
+    mInstanceMin.resize(transforms.size());
+    mInstanceMax.resize(transforms.size());
+    mSize = glm::vec3(0);
+    for(uint32_t i = 0; i < transforms.size(); ++i) {
+        mMeshes[meshIds[i]]->getInstanceBox(i, &mInstanceMin[i], &mInstanceMax[i]);
+        mSize = glm::max(mSize, mInstanceMax[i] - mInstanceMin[i]);
+    }
+    invalidateBinding();
+}
+
+void Scene::setCamera(const glm::vec3 &position, const glm::mat4 &viewProj,
+                      float pixelsPerUnit, float maxPixelError)
+{
+    for(const std::unique_ptr<Mesh>& mesh : mMeshes) {
+        mesh->setCamera(position, viewProj, pixelsPerUnit, maxPixelError);
+    }
+}
+
+void Scene::bindMesh(uint32_t id) const
+{
+    if(id == mBoundMesh) {
+        return;
+    }
+    mBoundMesh = id;
+
+    const Mesh& mesh = *mMeshes[id];
+    glUniformMatrix4fv(0, 1, GL_FALSE, &mesh.getModelMatrix()[0][0]);
+    glUniform3fv(3, 1, &mesh.getPositionOffset()[0]);
+    glUniform3fv(4, 1, &mesh.getPositionScale()[0]);
+    mesh.getArena()->bindTransforms();
+}
+
+void Scene::draw() const
+{
+    for(uint32_t m = 0; m < mMeshes.size(); ++m) {
+        bindMesh(m);
+        mMeshes[m]->draw();
+    }
+}
+
+void Scene::drawInstances(const std::vector<uint32_t> &instances) const
+{
+    if(mMeshes.size() == 1) {
+        bindMesh(0);
+        mMeshes[0]->drawInstances(instances);
+        return;
+    }
+
+    mMeshBatches.resize(mMeshes.size());
+    for(std::vector<uint32_t>& batch : mMeshBatches) {
+        batch.clear();
+    }
+    for(uint32_t i : instances) {
+        mMeshBatches[mMeshIds[i]].push_back(i);
+    }
+    for(uint32_t m = 0; m < mMeshes.size(); ++m) {
+        if(!mMeshBatches[m].empty()) {
+            bindMesh(m);
+            mMeshes[m]->drawInstances(mMeshBatches[m]);
+        }
+    }
+}
+
+void Scene::drawOnlyInstance(uint32_t instance) const
+{
+    bindMesh(mMeshIds[instance]);
+    mMeshes[mMeshIds[instance]]->drawOnlyInstance(instance);
+}
+
+void Scene::drawBBoxOnlyInstance(uint32_t instance) const
+{
+    bindMesh(mMeshIds[instance]);
+    mMeshes[mMeshIds[instance]]->drawBBoxOnlyInstance(instance);
+}
+
+uint64_t Scene::getDrawnFaces() const
+{
+    uint64_t faces = 0;
+    for(const std::unique_ptr<Mesh>& mesh : mMeshes) {
+        faces += mesh->getDrawnFaces();
+    }
+    return faces;
+}
+
+uint64_t Scene::getTestedMeshlets() const
+{
+    uint64_t meshlets = 0;
+    for(const std::unique_ptr<Mesh>& mesh : mMeshes) {
+        meshlets += mesh->getTestedMeshlets();
+    }
+    return meshlets;
+}
+
+uint64_t Scene::getCulledMeshlets() const
+{
+    uint64_t meshlets = 0;
+    for(const std::unique_ptr<Mesh>& mesh : mMeshes) {
+        meshlets += mesh->getCulledMeshlets();
+    }
+    return meshlets;
+}
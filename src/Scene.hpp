@@ -0,0 +1,77 @@
+#ifndef SCENE_HPP
+#define SCENE_HPP
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+#include "GeometryArena.hpp"
+#include "InstanceTransform.hpp"
+#include "Mesh.hpp"
+
+// Several meshes and the instances of all of them, each one referencing a mesh.
+// The meshes share a geometry arena, so the vao is the same for all the draws, and
+// only the uniforms of the mesh change between them
+class Scene
+{
+public:
+    // Without shareArena each mesh keeps buffers of its own
+    explicit Scene(bool shareArena = true);
+
+    Scene& operator=(const Scene&o) = delete;
+
+    // New empty mesh, to be configured and loaded by the caller
+    Mesh* addMesh();
+    size_t numMeshes() const { return mMeshes.size(); }
+    Mesh* getMesh(uint32_t id) const { return mMeshes[id].get(); }
+
+    // Transforms of all the instances and the mesh of each one
+    void setInstances(const std::vector<InstanceTransform>& transforms, const std::vector<uint32_t>& meshIds);
+    size_t numInstances() const { return mMeshIds.size(); }
+    uint32_t getMeshId(uint32_t instance) const { return mMeshIds[instance]; }
+    const InstanceTransform& getTransform(uint32_t instance) const { return mTransforms[instance]; }
+
+    // World space box of an instance, for culling
+    const glm::vec3& getInstanceMin(uint32_t instance) const { return mInstanceMin[instance]; }
+    const glm::vec3& getInstanceMax(uint32_t instance) const { return mInstanceMax[instance]; }
+    // Size of the box containing any instance
+    const glm::vec3& getSize() const { return mSize; }
+
+    // See Mesh::setCamera
+    void setCamera(const glm::vec3& position, const glm::mat4& viewProj,
+                   float pixelsPerUnit, float maxPixelError);
+
+    // Set the model matrix and the position decode of a mesh in the uniforms of the
+    // current program, and bind the transforms of its arena. The last mesh bound is
+    // remembered, so after changing the program call invalidateBinding
+    void bindMesh(uint32_t id) const;
+    void invalidateBinding() const { mBoundMesh = UINT32_MAX; }
+
+    // Same as in Mesh, routing each instance to its mesh
+    void draw() const;
+    void drawInstances(const std::vector<uint32_t>& instances) const;
+    void drawOnlyInstance(uint32_t instance) const;
+    void drawBBoxOnlyInstance(uint32_t instance) const;
+
+    // Sums of all the meshes
+    uint64_t getDrawnFaces() const;
+    uint64_t getTestedMeshlets() const;
+    uint64_t getCulledMeshlets() const;
+
+private:
+    std::unique_ptr<GeometryArena> mArena;
+    std::vector<std::unique_ptr<Mesh>> mMeshes;
+
+    std::vector<uint32_t> mMeshIds;
+    std::vector<InstanceTransform> mTransforms;
+    std::vector<glm::vec3> mInstanceMin;
+    std::vector<glm::vec3> mInstanceMax;
+    glm::vec3 mSize = glm::vec3(0);
+
+    mutable uint32_t mBoundMesh = UINT32_MAX;
+    // Instances of drawInstances, grouped by mesh
+    mutable std::vector<std::vector<uint32_t>> mMeshBatches;
+};
+
+#endif // SCENE_HPP
@@ -0,0 +1,47 @@
+#ifndef SPSCQUEUE_HPP
+#define SPSCQUEUE_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// Lock-free queue of at most N elements, for one thread pushing and another one
+// popping. Each side only writes its own counter, so they never wait for each other
+template<typename T, size_t N>
+class SpscQueue
+{
+public:
+    // False if the queue is full. Only from the producer thread
+    bool push(const T& value)
+    {
+        const uint64_t tail = mTail.load(std::memory_order_relaxed);
+        if(tail - mHead.load(std::memory_order_acquire) == N) {
+            return false;
+        }
+        mElements[tail % N] = value;
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // False if the queue is empty. Only from the consumer thread
+    bool pop(T* value)
+    {
+        const uint64_t head = mHead.load(std::memory_order_relaxed);
+        if(head == mTail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        *value = mElements[head % N];
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::array<T, N> mElements;
+    // Elements pushed and popped since the start. Apart, so the two threads do
+    // not write to the same cache line
+    alignas(64) std::atomic<uint64_t> mTail{0};
+    alignas(64) std::atomic<uint64_t> mHead{0};
+};
+
+#endif // SPSCQUEUE_HPP
@@ -0,0 +1,210 @@
+#include "Trace.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <glad/glad.h>
+
+namespace {
+
+struct Event
+{
+    const char* name;
+    uint64_t start; // ns
+    uint64_t end;
+};
+
+// Events of one thread. Only that thread writes, and the file is written once
+// the threads are done
+struct ThreadBuffer
+{
+    std::string name;
+    std::vector<Event> events;
+    uint64_t dropped = 0;
+};
+
+// Per thread, enough for a long run with a query per instance
+constexpr size_t EVENTS_PER_THREAD = 1 << 21;
+
+std::chrono::steady_clock::time_point g_start;
+
+// Only locked when a thread records its first event
+std::mutex g_threadsMutex;
+std::vector<std::unique_ptr<ThreadBuffer>> g_threads;
+thread_local ThreadBuffer* t_buffer = nullptr;
+
+// GPU ranges in order of their begin, waiting for their queries
+struct GpuRange
+{
+    const char* name;
+    uint32_t queries[2];
+};
+std::vector<GpuRange> g_gpuPending;
+std::vector<uint32_t> g_gpuOpen; // of g_gpuPending
+std::vector<uint32_t> g_freeQueries;
+ThreadBuffer g_gpuBuffer;
+// GPU time of the start of the trace
+int64_t g_gpuStart = 0;
+
+ThreadBuffer* threadBuffer()
+{
+    if(t_buffer == nullptr) {
+        std::lock_guard<std::mutex> lock(g_threadsMutex);
+        g_threads.push_back(std::make_unique<ThreadBuffer>());
+        t_buffer = g_threads.back().get();
+        t_buffer->name = "thread " + std::to_string(g_threads.size() - 1);
+        t_buffer->events.reserve(EVENTS_PER_THREAD);
+    }
+    return t_buffer;
+}
+
+void push(ThreadBuffer* buffer, const char* name, uint64_t start, uint64_t end)
+{
+    // Full, growing it would stall the thread being measured
+    if(buffer->events.size() == buffer->events.capacity()) {
+        ++buffer->dropped;
+        return;
+    }
+    buffer->events.push_back({name, start, end});
+}
+
+uint32_t newQuery()
+{
+    if(g_freeQueries.empty()) {
+        uint32_t query;
+        glGenQueries(1, &query);
+        return query;
+    }
+    uint32_t query = g_freeQueries.back();
+    g_freeQueries.pop_back();
+    return query;
+}
+
+} // namespace
+
+bool Trace::sEnabled = false;
+
+void Trace::enable()
+{
+    g_start = std::chrono::steady_clock::now();
+    // Both clocks start at the same time, the GPU one as seen by the CPU
+    glGetInteger64v(GL_TIMESTAMP, &g_gpuStart);
+    g_gpuBuffer.name = "GPU";
+    g_gpuBuffer.events.reserve(EVENTS_PER_THREAD);
+    g_gpuPending.reserve(1024);
+    g_gpuOpen.reserve(16);
+    g_freeQueries.reserve(2048);
+    threadBuffer()->name = "main";
+    sEnabled = true;
+}
+
+void Trace::setThreadName(const char *name)
+{
+    if(sEnabled) {
+        threadBuffer()->name = name;
+    }
+}
+
+uint64_t Trace::now()
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - g_start).count());
+}
+
+void Trace::addEvent(const char *name, uint64_t start, uint64_t end)
+{
+    push(threadBuffer(), name, start, end);
+}
+
+void Trace::beginGpu(const char *name)
+{
+    if(!sEnabled) {
+        return;
+    }
+    GpuRange range;
+    range.name = name;
+    range.queries[0] = newQuery();
+    range.queries[1] = 0;
+    glQueryCounter(range.queries[0], GL_TIMESTAMP);
+    g_gpuOpen.push_back(uint32_t(g_gpuPending.size()));
+    g_gpuPending.push_back(range);
+}
+
+void Trace::endGpu()
+{
+    if(!sEnabled || g_gpuOpen.empty()) {
+        return;
+    }
+    GpuRange& range = g_gpuPending[g_gpuOpen.back()];
+    g_gpuOpen.pop_back();
+    range.queries[1] = newQuery();
+    glQueryCounter(range.queries[1], GL_TIMESTAMP);
+}
+
+void Trace::collectGpu(bool wait)
+{
+    if(!sEnabled) {
+        return;
+    }
+    // The queries finish in order, so it stops at the first one not available
+    size_t done = 0;
+    for(; done < g_gpuPending.size(); ++done) {
+        const GpuRange& range = g_gpuPending[done];
+        if(range.queries[1] == 0) {
+            break;
+        }
+        if(!wait) {
+            uint32_t available;
+            glGetQueryObjectuiv(range.queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+            if(available == 0) {
+                break;
+            }
+        }
+        uint64_t timestamps[2];
+        for(uint32_t q = 0; q < 2; ++q) {
+            glGetQueryObjectui64v(range.queries[q], GL_QUERY_RESULT, &timestamps[q]);
+            g_freeQueries.push_back(range.queries[q]);
+        }
+        push(&g_gpuBuffer, range.name, timestamps[0] - uint64_t(g_gpuStart), timestamps[1] - uint64_t(g_gpuStart));
+    }
+    g_gpuPending.erase(g_gpuPending.begin(), g_gpuPending.begin() + done);
+    for(uint32_t& open : g_gpuOpen) {
+        open -= uint32_t(done);
+    }
+}
+
+bool Trace::write(const std::string &fileName)
+{
+    std::ofstream file(fileName);
+    if(!file) {
+        return false;
+    }
+
+    // Times in us, with the ns
+    file << std::fixed << std::setprecision(3);
+    file << "{\"traceEvents\":[\n";
+    bool first = true;
+    auto writeThread = [&](const ThreadBuffer& buffer, uint32_t tid) {
+        file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid <<
+                ",\"args\":{\"name\":\"" << buffer.name << "\"}}";
+        first = false;
+        for(const Event& e : buffer.events) {
+            file << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid <<
+                    ",\"ts\":" << 1e-3 * double(e.start) << ",\"dur\":" << 1e-3 * double(e.end - e.start) << "}";
+        }
+    };
+    uint64_t dropped = g_gpuBuffer.dropped;
+    {
+        std::lock_guard<std::mutex> lock(g_threadsMutex);
+        for(uint32_t t = 0; t < g_threads.size(); ++t) {
+            writeThread(*g_threads[t], t);
+            dropped += g_threads[t]->dropped;
+        }
+    }
+    writeThread(g_gpuBuffer, uint32_t(g_threads.size()));
+    file << "\n],\"otherData\":{\"droppedEvents\":" << dropped << "}}\n";
+    return bool(file);
+}
@@ -0,0 +1,59 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <cstdint>
+#include <string>
+
+// Timeline of CPU scopes of all the threads and of GPU ranges, written as a Chrome
+// trace (chrome://tracing, ui.perfetto.dev). Each thread records into its own
+// preallocated buffer, so recording takes no lock. Nothing is recorded until it
+// is enabled
+class Trace
+{
+public:
+    static void enable();
+    static bool isEnabled() { return sEnabled; }
+
+    // Shown for the calling thread instead of its number
+    static void setThreadName(const char* name);
+
+    // ns since enable
+    static uint64_t now();
+    // Scope of the calling thread. The name has to outlive the trace
+    static void addEvent(const char* name, uint64_t start, uint64_t end);
+
+    // Range of GPU commands measured with timestamp queries, can be nested.
+    // Only from the thread of the GL context
+    static void beginGpu(const char* name);
+    static void endGpu();
+    // Turn the GPU ranges already finished into events, once per frame. With
+    // wait, all of them, before destroying the context
+    static void collectGpu(bool wait = false);
+
+    static bool write(const std::string& fileName);
+
+private:
+    static bool sEnabled;
+};
+
+// Event from its construction to its destruction
+class TraceScope
+{
+public:
+    explicit TraceScope(const char* name) : mName(name), mStart(Trace::isEnabled() ? Trace::now() : 0) {}
+    ~TraceScope()
+    {
+        if(Trace::isEnabled()) {
+            Trace::addEvent(mName, mStart, Trace::now());
+        }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* mName;
+    uint64_t mStart;
+};
+
+#endif // TRACE_HPP
@@ -5,21 +5,22 @@
 #include <algorithm>
 #include <glad/glad.h>
 
-#include "testAABBoxInFrustum.h"
+#include "HiZ.hpp"
+#include "DepthReprojection.hpp"
+#include "Trace.hpp"
 
 void ChcPP::buildBVH()
 {
-    assert(mMesh != nullptr && mPositions != nullptr);
+    assert(mScene != nullptr);
 
-    uint32_t resolution = std::sqrt(mPositions->size());
+    uint32_t resolution = std::sqrt(mScene->numInstances());
     uint32_t yRes = resolution;
     uint32_t xRes = resolution;
     std::vector<std::unique_ptr<BVH_Node>> nodes;
-    nodes.reserve(mPositions->size());
-    const glm::vec3 size = mMesh->getSize();
-    for(uint32_t i = 0; i < mPositions->size(); ++i){
-        glm::vec3 min((*mPositions)[i].x, 0, (*mPositions)[i].y);
-        AABBox box(min, min + size);
+    nodes.reserve(mScene->numInstances());
+    mNumNodes = mScene->numInstances();
+    for(uint32_t i = 0; i < mScene->numInstances(); ++i){
+        AABBox box(mScene->getInstanceMin(i), mScene->getInstanceMax(i));
         nodes.emplace_back( std::make_unique<BVH_Node>() );
         nodes.back()->initLeaf(i, box);
     }
@@ -39,7 +40,8 @@ void ChcPP::buildBVH()
                         newNode->initInterior(mergingX,
                                              std::move(nodes[i * yRes + j]),
                                              std::move(nodes[(1 + i) * yRes + j]));
-                        newNode->createBBoxVAO(mMesh);
+                        newNode->createBBoxVAO(mScene->getMesh(0));
+                        ++mNumNodes;
                     }
                 } else {
                     if(j + 1 == yRes) {
@@ -48,7 +50,8 @@ void ChcPP::buildBVH()
                         newNode->initInterior(mergingX,
                                              std::move(nodes[i * yRes + j]),
                                              std::move(nodes[i * yRes + j + 1]));
-                        newNode->createBBoxVAO(mMesh);
+                        newNode->createBBoxVAO(mScene->getMesh(0));
+                        ++mNumNodes;
                     }
                 }
                 nodesNext.push_back(std::move(newNode));
@@ -68,6 +71,13 @@ void ChcPP::buildBVH()
 
     // Assign root
     mRoot = std::move(nodes.front());
+
+    v_queue.setCapacity(mNumNodes);
+    i_queue.setCapacity(mNumNodes);
+    queryQueue.setCapacity(mNumNodes);
+    distanceQueue.reserve(mNumNodes);
+    mRenderQueue.reserve(mScene->numInstances());
+    mRendered.reserve(mScene->numInstances());
 }
 
 void drawBoxesAtDepthIntern(uint32_t actualD, uint32_t maxD, const BVH_Node* node) {
@@ -87,13 +97,20 @@ void drawBoxesAtDepthIntern(uint32_t actualD, uint32_t maxD, const BVH_Node* nod
 
 void ChcPP::drawBoxesAtDepth(uint32_t depth)
 {
+    mScene->bindMesh(0);
     drawBoxesAtDepthIntern(0, depth, mRoot.get());
 }
 
 void ChcPP::executeCHCPP(const glm::vec3 &cameraPosition, const glm::mat4 &cameraMatrix)
 {
+    TraceScope scope("CHC++");
+    applyPendingQueries();
     flipVisibilityNodes(mRoot.get());
-    // we asume that all the queues are already empty
+    mRendered.clear();
+    mSkippedQueries = 0;
+    mFrustum = Frustum(cameraMatrix);
+    mRoot->setFrustumMask(Frustum::ALL_PLANES);
+    // All the queues are empty since applyPendingQueries
     pushToDistanceQueue(cameraPosition, mRoot.get());
 
     while(!distanceQueue.empty() || !queryQueue.empty()) {
@@ -110,12 +127,17 @@ void ChcPP::executeCHCPP(const glm::vec3 &cameraPosition, const glm::mat4 &camer
         } // end while !queryQueue.empty()
 
         if(!distanceQueue.empty()) {
-            BVH_Node* node = distanceQueue.top().first;
-            distanceQueue.pop();
-            if(testAABBoxInFrustum(node->getBBox().min(), node->getBBox().max(), cameraMatrix)) {
+            BVH_Node* node = popDistanceQueue();
+            if(node->testFrustum(mFrustum)) {
                 // if not was visible...
                 if(!node->wasVisible()) {
-                    queryPreviouslyInvisibleNode(node);
+                    if(mReprojection != nullptr &&
+                        !mReprojection->testBox(node->getBBox().min(), node->getBBox().max())) {
+                        // Still hidden, no need to query it
+                        ++mSkippedQueries;
+                    } else {
+                        queryPreviouslyInvisibleNode(node);
+                    }
                 } else {
                     if(node->isLeaf()) { //TODO: query reasonable
                         v_queue.push(node);
@@ -135,28 +157,99 @@ void ChcPP::executeCHCPP(const glm::vec3 &cameraPosition, const glm::mat4 &camer
         issueQuery(v_queue.front());
         v_queue.pop();
     }
+    // The queries of the previously visible leaves stay in queryQueue, to be read
+    // at the start of the next frame without waiting for them
 
     // Ensure that the state is render at the end
     setupStateRender();
     flushRenderList();
 }
 
+void ChcPP::executeHiZ(const glm::vec3 &cameraPosition, const glm::mat4 &cameraMatrix,
+                       HiZ &hiz, uint32_t width, uint32_t height)
+{
+    flipVisibilityNodes(mRoot.get());
+    mRendered.clear();
+
+    mFrustum = Frustum(cameraMatrix);
+    mRoot->setFrustumMask(Frustum::ALL_PLANES);
+    setupStateRender();
+    renderPreviouslyVisible(mRoot.get());
+    flushRenderList();
+
+    hiz.build(width, height, cameraMatrix);
+
+    mRoot->setFrustumMask(Frustum::ALL_PLANES);
+    pushToDistanceQueue(cameraPosition, mRoot.get());
+    while(!distanceQueue.empty()) {
+        BVH_Node* node = popDistanceQueue();
+        if(!node->testFrustum(mFrustum) ||
+            !hiz.testBox(node->getBBox().min(), node->getBBox().max())) {
+            continue;
+        }
+
+        if(node->isLeaf()) {
+            if(!node->wasVisible()) {
+                mRenderQueue.push_back(node->getPrimitive());
+            }
+            pullUpVisibility(node);
+        } else {
+            pushChildren(cameraPosition, node);
+        }
+    }
+
+    flushRenderList();
+}
+
+void ChcPP::renderPreviouslyVisible(BVH_Node *node)
+{
+    if(!node->wasVisible() || !node->testFrustum(mFrustum)) {
+        return;
+    }
+
+    if(node->isLeaf()) {
+        mRenderQueue.push_back(node->getPrimitive());
+    } else {
+        node->getChild0()->setFrustumMask(node->getFrustumMask());
+        node->getChild1()->setFrustumMask(node->getFrustumMask());
+        renderPreviouslyVisible(node->getChild0());
+        renderPreviouslyVisible(node->getChild1());
+    }
+}
+
 void ChcPP::traverseNode(const glm::vec3 &cameraPosition, BVH_Node *node)
 {
+    TraceScope scope("traverse");
     if(node->isLeaf()){
         mRenderQueue.push_back(node->getPrimitive());
     } else {
-        pushToDistanceQueue(cameraPosition, node->getChild0());
-        pushToDistanceQueue(cameraPosition, node->getChild1());
+        pushChildren(cameraPosition, node);
         node->setVisible(false);
     }
 }
 
+void ChcPP::pushChildren(const glm::vec3 &cameraPosition, BVH_Node *node)
+{
+    node->getChild0()->setFrustumMask(node->getFrustumMask());
+    node->getChild1()->setFrustumMask(node->getFrustumMask());
+    pushToDistanceQueue(cameraPosition, node->getChild0());
+    pushToDistanceQueue(cameraPosition, node->getChild1());
+}
+
 void ChcPP::pushToDistanceQueue(const glm::vec3 &cameraPosition, BVH_Node *node)
 {
     glm::vec3 centerToCamera = cameraPosition - node->getBBox().center();
     float_t d = glm::dot(centerToCamera, centerToCamera);
-    distanceQueue.push({node, d});
+    distanceQueue.push_back({node, d});
+    std::push_heap(distanceQueue.begin(), distanceQueue.end(), Comparator());
+}
+
+BVH_Node *ChcPP::popDistanceQueue()
+{
+    std::pop_heap(distanceQueue.begin(), distanceQueue.end(), Comparator());
+    BVH_Node* node = distanceQueue.back().first;
+    distanceQueue.pop_back();
+    return node;
 }
 
 void ChcPP::pullUpVisibility(BVH_Node *node)
@@ -167,6 +260,25 @@ void ChcPP::pullUpVisibility(BVH_Node *node)
     }
 }
 
+void ChcPP::applyPendingQueries()
+{
+    // Only leaves rendered last frame are left. They are not traversed again, their
+    // results just set the visibility, and one not finished yet stays visible
+    while(!queryQueue.empty()) {
+        BVH_Node* node = queryQueue.front();
+        queryQueue.pop();
+        uint32_t samplePassed = 1;
+        if(isQueryFinished(node)) {
+            glGetQueryObjectuiv(node->getQuery(), GL_QUERY_RESULT, &samplePassed);
+        }
+        if(samplePassed) {
+            pullUpVisibility(node);
+        } else {
+            node->setVisible(false);
+        }
+    }
+}
+
 void ChcPP::queryIndividualNodes(BVH_Node *node)
 {
     if(node->isLeaf()) {
@@ -179,12 +291,15 @@ void ChcPP::queryIndividualNodes(BVH_Node *node)
 
 void ChcPP::issueQuery(BVH_Node *node)
 {
+    TraceScope scope("issueQuery");
     setupStateQuery();
 
     glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, node->getQuery());
     if(node->isLeaf()){
-        mMesh->drawBBoxOnlyInstance(node->getPrimitive());
+        mScene->drawBBoxOnlyInstance(node->getPrimitive());
     } else {
+        // The boxes of the inner nodes are encoded for the first mesh
+        mScene->bindMesh(0);
         node->draw();
     }
     glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
@@ -230,11 +345,13 @@ void ChcPP::flipVisibilityNodes(BVH_Node *node)
 
 void ChcPP::flushRenderList()
 {
+    TraceScope scope("flushRenderList");
     if(!mRenderQueue.empty()) {
         setupStateRender();
         for(uint32_t i : mRenderQueue) {
-            mMesh->drawOnlyInstance(i);
+            mScene->drawOnlyInstance(i);
         }
+        mRendered.insert(mRendered.end(), mRenderQueue.begin(), mRenderQueue.end());
         mRenderQueue.clear();
     }
 }
@@ -263,7 +380,10 @@ void ChcPP::handleReturnedQuery(const glm::vec3 &cameraPosition, BVH_Node *node)
 {
     uint32_t query = node->getQuery();
     uint32_t samplePassed;
-    glGetQueryObjectuiv(query, GL_QUERY_RESULT, &samplePassed);
+    {
+        TraceScope waitScope("waitQuery");
+        glGetQueryObjectuiv(query, GL_QUERY_RESULT, &samplePassed);
+    }
 
     if(samplePassed) {
         // if node.size() > 1
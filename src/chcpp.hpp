@@ -1,24 +1,30 @@
 #ifndef CHCPP_HPP
 #define CHCPP_HPP
 
-#include "Mesh.hpp"
+#include "Scene.hpp"
+#include "Frustum.hpp"
+#include "RingBuffer.hpp"
 
-#include <queue>
-#include <stack>
 #include <glm/glm.hpp>
 #include <array>
 #include <memory>
 
 class AABBox;
 class BVH_Node;
+class HiZ;
+class DepthReprojection;
 
 class ChcPP
 {
 public:
     ChcPP() = default;
 
-    void setMesh(const Mesh* mesh) { mMesh = mesh; }
-    void setPositions(const std::vector<glm::vec2>* positions) { mPositions = positions; }
+    // The leaves are the instances of the scene, each with its world space box.
+    // The instances are expected in the order of a square grid, x major
+    void setScene(const Scene* scene) { mScene = scene; }
+
+    // Previously invisible nodes hidden by the reprojected depth are not queried
+    void setReprojection(DepthReprojection* reprojection) { mReprojection = reprojection; }
 
     // Build the tree
     void buildBVH();
@@ -29,15 +35,32 @@ public:
     // Run a single step of CHC++, and render
     void executeCHCPP(const glm::vec3& cameraPosition, const glm::mat4& cameraMatrix);
 
+    // Render the same BVH testing the nodes against a Hi-Z pyramid instead of
+    // with queries. The leaves visible last frame are rendered first, and the
+    // pyramid is built from them
+    void executeHiZ(const glm::vec3& cameraPosition, const glm::mat4& cameraMatrix,
+                    HiZ& hiz, uint32_t width, uint32_t height);
+
+    // Instances rendered in the last call to executeCHCPP or executeHiZ
+    const std::vector<uint32_t>& getRendered() const { return mRendered; }
+
+    // Queries avoided by the reprojected depth in the last call to executeCHCPP
+    uint32_t getSkippedQueries() const { return mSkippedQueries; }
+
 private:
 
-    const Mesh *mMesh = nullptr;
-    const std::vector<glm::vec2>* mPositions = nullptr;
+    const Scene *mScene = nullptr;
+    Frustum mFrustum;
+    DepthReprojection* mReprojection = nullptr;
+    uint32_t mSkippedQueries = 0;
 
     std::unique_ptr<BVH_Node> mRoot = nullptr;
 
-    std::queue<BVH_Node*> v_queue;
-    std::queue<BVH_Node*> i_queue;
+    // Each node enters each queue at most once per frame, so they are sized for
+    // all the nodes in buildBVH, and the frames don't allocate
+    uint32_t mNumNodes = 0;
+    RingBuffer<BVH_Node*> v_queue;
+    RingBuffer<BVH_Node*> i_queue;
     struct Comparator{
         bool operator() (const std::pair<BVH_Node*, float_t>& a,
                          const std::pair<BVH_Node*, float_t>& b){
@@ -45,25 +68,31 @@ private:
         }
     };
 
-    std::priority_queue<std::pair<BVH_Node*, float_t>,
-                        std::vector<std::pair<BVH_Node*, float_t>>,
-                        Comparator> distanceQueue;
-    std::queue<BVH_Node*> queryQueue;
+    // Heap of the nodes nearest first, kept in a vector to keep its capacity
+    std::vector<std::pair<BVH_Node*, float_t>> distanceQueue;
+    RingBuffer<BVH_Node*> queryQueue;
 
     std::vector<uint32_t> mRenderQueue;
+    std::vector<uint32_t> mRendered;
 
     bool mRenderStatusDrawEnabled = true;
 
     void traverseNode(const glm::vec3 &cameraPosition, BVH_Node* node);
     void pushToDistanceQueue(const glm::vec3 &cameraPosition, BVH_Node* node);
+    BVH_Node* popDistanceQueue();
+    // Both children, which only test the planes of the frustum the node straddles
+    void pushChildren(const glm::vec3 &cameraPosition, BVH_Node* node);
     static void pullUpVisibility(BVH_Node* node);
     void handleReturnedQuery(const glm::vec3 &cameraPosition, BVH_Node* node);
+    // Visibility from the queries left by the last frame, before flipping it
+    void applyPendingQueries();
     void queryIndividualNodes(BVH_Node* node);
     void issueQuery(BVH_Node* node);
     bool isQueryFinished(BVH_Node* node);
     void issueMultiQueries();
     void queryPreviouslyInvisibleNode(BVH_Node* node);
     void flipVisibilityNodes(BVH_Node* node);
+    void renderPreviouslyVisible(BVH_Node* node);
 
     void flushRenderList();
     void setupStateRender();
@@ -109,6 +138,14 @@ public:
 
     void propagateVisible() { mWasVisible = mIsVisible; mIsVisible = false; }
 
+    // Test against the planes of the frustum the parent straddles, which are
+    // replaced by the ones this node straddles, for its children
+    bool testFrustum(const Frustum& frustum) {
+        return frustum.testBox(mBox.min(), mBox.max(), &mFrustumMask, &mLastPlane) != Frustum::eOutside;
+    }
+    uint8_t getFrustumMask() const { return mFrustumMask; }
+    void setFrustumMask(uint8_t mask) { mFrustumMask = mask; }
+
     void draw() const;
     uint32_t getPrimitive() const { return mPrimitives.front(); }
     uint32_t getQuery() const { return mQuery; }
@@ -122,6 +159,9 @@ private:
     bool mIsVisible = false;
     bool mWasVisible = false;
 
+    uint8_t mFrustumMask = Frustum::ALL_PLANES;
+    uint8_t mLastPlane = 0;
+
     uint32_t mVAO, mVBO, mVBOI;
     uint32_t mQuery;
 };
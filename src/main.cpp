@@ -4,40 +4,76 @@
 #include <string>
 #include <filesystem>
 #include <fstream>
+#include <sstream>
+#include <cmath>
+#include <random>
+#include <thread>
 
 #define GLM_FORCE_RADIANS
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
 #include "Mesh.hpp"
+#include "Scene.hpp"
+#include "InstanceTransform.hpp"
 #include "Args.hpp"
 #include "testAABBoxInFrustum.h"
 #include "chcpp.hpp"
+#include "Occluders.hpp"
+#include "HiZ.hpp"
+#include "DepthReprojection.hpp"
+#include "PVS.hpp"
+#include "JobSystem.hpp"
+#include "SpscQueue.hpp"
+#include "FrustumBVH.hpp"
+#include "DepthSorter.hpp"
+#include "MemoryStats.hpp"
+#include "Trace.hpp"
+#include "FrameReport.hpp"
+#include "FrameWriter.hpp"
 
 
 constexpr const char* MESH_TO_LOAD = "./models/Armadillo.ply";
 
 constexpr const char* SHADER_FRAGMENT = "./shaders/norm.frag";
 constexpr const char* SHADER_VERTEX =   "./shaders/norm.vert";
+constexpr const char* SHADER_HIZ_BUILD = "./shaders/hiz.comp";
+constexpr const char* SHADER_HIZ_TEST =  "./shaders/hiz_test.comp";
+constexpr const char* SHADER_ID_FRAGMENT = "./shaders/id.frag";
+constexpr const char* SHADER_ID_VERTEX =   "./shaders/id.vert";
 
 
 GLFWwindow* g_window; // Window
 
 uint32_t g_normProgram; // GLSL program to shade
 
-// Positions and render lists for the different algorithms
-std::vector<glm::vec2> g_gridPositions;
+// Transforms and render lists for the different algorithms
+std::vector<InstanceTransform> g_instanceTransforms;
 std::vector<uint32_t> g_frustumCullingPos;
 std::vector<uint8_t> g_occlusionCullingRendered;
+std::vector<uint32_t> g_occlusionRenderedList;
+std::vector<uint8_t> g_occlusionQueryIssued;
 
 uint32_t g_gridResoulution; // Resolution of the grid in each dimension
+bool g_irregularGrid = false; // Random rotation, scale and jitter of each instance
 
-// Pre-allocated buffer to store the time and delta time
-std::vector<std::pair<double, double>> g_FramerateBuffer;
+// Time and delta time of each frame, streamed to the out file while running
 std::string g_outFileName;
-
-// Global mesh, with single instance
-Mesh* g_mesh;
+FrameWriter* g_frameWriter = nullptr;
+double g_lastFrameTime = 1.0 / 60.0;
+// Statistics of the frame times written to prefix.json and prefix.csv (optional)
+std::string g_reportPrefix;
+// Seconds at the start left out of the statistics
+double g_warmupTime = 1.0;
+// Two -out files to compare instead of rendering
+std::vector<std::string> g_compareFiles;
+// Chrome trace of the CPU and GPU work of each frame (optional)
+std::string g_traceFileName;
+
+// Meshes of the scene, and the mesh of each position of the grid
+Scene* g_scene;
+std::vector<std::string> g_meshFiles = {MESH_TO_LOAD};
+std::vector<uint32_t> g_meshIds;
 
 // Execution and control timers
 double g_startTime = 0.0;
@@ -55,12 +91,157 @@ std::vector<uint32_t> g_queryObjects;
 std::vector<double_t> g_occlusionLastVisible;
 const double_t DELTA_TIME_VISIBLE = 0.8;
 
+// Depth prepass before the occlusion queries
+enum Prepass {
+    ePrepassNone = 0,
+    ePrepassOccluders = 1, // Simplified occluders of the biggest instances on screen
+    ePrepassLastVisible = 2 // Full mesh of the biggest instances rendered last frame
+};
+Prepass g_prepass = Prepass::ePrepassNone;
+uint32_t g_numOccluders = 16;
+Occluders* g_occluders = nullptr;
+std::vector<uint32_t> g_prepassSelected;
+uint32_t g_prepassTimeQueries[2];
+
+// Statistics to compare the algorithms
+uint64_t g_numFrames = 0;
+uint64_t g_numRenderedInstances = 0;
+uint64_t g_prepassGpuTime = 0; // ns
+uint64_t g_prepassGpuTimeFrames = 0;
+double g_prepassCpuTime = 0.0;
+
+// Heap allocations of each phase, counted when built with TRACK_ALLOCATIONS
+enum AllocationPhase {
+    ePhaseLoad = 0,   // arguments, window and meshes
+    ePhaseSetup = 1,  // structures of the culling algorithms
+    ePhaseFrames = 2, // main loop
+    eNumPhases = 3
+};
+MemoryStats::Allocations g_phaseAllocations[eNumPhases];
+MemoryStats::Allocations g_phaseStart;
+uint64_t g_maxFrameAllocations = 0;
+uint64_t g_framesAllocating = 0;
+// With -checkallocations, CHC++ must not allocate after these frames, as it
+// keeps its queues allocated
+bool g_checkAllocations = false;
+constexpr uint64_t CHC_WARMUP_FRAMES = 10;
+uint64_t g_chcAllocatingFrames = 0;
+
+// Hi-Z culling
+HiZ* g_hiz = nullptr;
+bool g_hizCompute = true; // build the pyramid with compute, otherwise in the CPU
+uint32_t g_hizBuildProgram = 0;
+uint32_t g_hizTestProgram = 0;
+std::vector<uint8_t> g_hizVisible;
+std::vector<glm::vec4> g_hizBoxes;
+std::vector<uint32_t> g_hizResults;
+std::vector<uint32_t> g_hizDrawList;
+
+// Depth of two frames ago reprojected, to avoid queries of hidden instances
+DepthReprojection* g_reprojection = nullptr;
+bool g_useReprojection = false;
+uint64_t g_skippedQueries = 0;
+double g_reprojectionCpuTime = 0.0;
+
+// Potentially visible sets
+PVS g_pvs;
+std::string g_pvsFileName = "pvs.bin";
+bool g_bakePVS = false;
+uint32_t g_pvsCells = 8; // cells in x and z, and half in y
+uint32_t g_pvsSamples = 2; // samples per cell and axis
+uint32_t g_pvsResolution = PVS::DEFAULT_FACE_RESOLUTION; // of each render when baking
+
+bool g_useMeshCache = true;
+// Upload quantized vertices instead of floats
+bool g_compressVertices = false;
+// Reorder the mesh for the vertex cache and overdraw when loading it
+bool g_optimizeMesh = false;
+// Levels of detail of the mesh, and error in pixels allowed when selecting them
+uint32_t g_numLods = 1;
+float g_lodPixelError = 1.0f;
+// Split the mesh in meshlets, culled per instance against the frustum and by their normals
+bool g_useMeshlets = false;
+// What stays in the CPU of the mesh once uploaded
+Mesh::Residency g_meshResidency = Mesh::eResidencyKeep;
+
+// Threads of the frustum culling, including the main one
+uint32_t g_numThreads = 1;
+JobSystem* g_jobs = nullptr;
+// Visible instances of each chunk of the frustum culling, kept to not allocate each frame
+constexpr uint32_t FRUSTUM_CHUNK_SIZE = 1024;
+std::vector<std::vector<uint32_t>> g_frustumChunks;
+std::vector<uint32_t> g_frustumChunkOffsets;
+double g_frustumCullingCpuTime = 0.0;
+uint64_t g_frustumCullingCalls = 0;
+// Time the frustum culling with 1 to all the cores before running
+bool g_cullingScaling = false;
+// Cull with a hierarchy of the instances instead of testing all of them
+bool g_useFrustumBVH = false;
+FrustumBVH* g_frustumBVH = nullptr;
+// Draw the instances of modes 1 and 6 nearest first, so the depth test rejects more fragments
+bool g_sortFrontToBack = false;
+DepthSorter g_depthSorter;
+double g_sortCpuTime = 0.0;
+// Samples passing the depth test in modes 1 and 6, to compare the overdraw of both orders
+uint32_t g_samplesQueries[2];
+uint64_t g_samplesPassed = 0;
+uint64_t g_samplesPassedFrames = 0;
+
+// Pipeline statistics of each frame, to tell if a mode is bound by the submission,
+// the vertices or the fragments. Read two frames late, and written with the framerate
+constexpr uint32_t NUM_PIPELINE_STATS = 6;
+const GLenum PIPELINE_STAT_TARGETS[NUM_PIPELINE_STATS] = {
+    GL_VERTICES_SUBMITTED, GL_PRIMITIVES_SUBMITTED, GL_VERTEX_SHADER_INVOCATIONS,
+    GL_CLIPPING_INPUT_PRIMITIVES, GL_CLIPPING_OUTPUT_PRIMITIVES, GL_FRAGMENT_SHADER_INVOCATIONS
+};
+const char* PIPELINE_STAT_NAMES[NUM_PIPELINE_STATS] = {
+    "vertices submitted", "primitives submitted", "vertex shader invocations",
+    "clipping input primitives", "clipping output primitives", "fragment shader invocations"
+};
+static_assert(NUM_PIPELINE_STATS <= FrameWriter::MAX_STATS, "The frame writer needs more statistics");
+bool g_pipelineStatistics = false;
+uint32_t g_pipelineStatQueries[2][NUM_PIPELINE_STATS];
+uint64_t g_pipelineStatsSum[NUM_PIPELINE_STATS] = {};
+uint64_t g_pipelineStatsFrames = 0;
+// Frames waiting for their statistics to be written
+FrameWriter::Frame g_pendingFrames[2];
+
+// Camera of the route at a given time
+struct Camera
+{
+    glm::vec3 position;
+    glm::mat4 view;
+    glm::mat4 proj;
+    glm::mat4 viewProj;
+    float pixelsPerUnit; // at distance 1
+};
+
+// Culling of the next frame in its own thread, while this one renders the actual
+// frame. The two frames in flight go back and forth through lock-free queues
+struct CulledFrame
+{
+    double time;
+    int32_t width, height;
+    Camera camera;
+    std::vector<uint32_t> visible;
+};
+bool g_pipelineCulling = false;
+CulledFrame g_culledFrames[2];
+SpscQueue<uint32_t, 2> g_cullRequests; // frames to cull, or STOP_CULLING
+SpscQueue<uint32_t, 2> g_cullResults;  // frames culled
+constexpr uint32_t STOP_CULLING = UINT32_MAX;
+std::thread g_cullThread;
+double g_cullWaitTime = 0.0; // of the render thread for the culling one
+
 
 enum Mode {
     eUnoptimized = 0,
     eFrustumCulling = 1,
     eOcclusionCulling = 2,
-    eCHC = 3
+    eCHC = 3,
+    eHiZ = 4,
+    eCHCHiZ = 5,
+    ePVS = 6
 };
 
 // Actual algorithm
@@ -269,75 +450,229 @@ uint32_t loadProgram(const std::string& vertexShaderPath,
     return prog;
 }
 
+uint32_t loadComputeProgram(const std::string& computeShaderPath){
+
+    uint32_t comp = loadShader(computeShaderPath, GL_COMPUTE_SHADER);
+    if(comp == 0) {
+        return 0;
+    }
+
+    uint32_t prog = glCreateProgram();
+    glAttachShader(prog, comp);
+
+    glLinkProgram(prog);
+    int32_t success;
+    glGetProgramiv(prog, GL_LINK_STATUS, &success);
+    assert(success);
+
+    glDeleteShader(comp);
+
+    return prog;
+}
+
 // Generate the 2D grid with all the models
 void genGrid(uint32_t gridRes) {
     g_gridResoulution = gridRes;
 
-    g_gridPositions.clear();
-    g_gridPositions.reserve(g_gridResoulution * g_gridResoulution);
+    // Fixed seed, so a baked PVS matches the next runs
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    g_instanceTransforms.clear();
+    g_instanceTransforms.reserve(g_gridResoulution * g_gridResoulution);
+    g_meshIds.clear();
+    g_meshIds.reserve(g_gridResoulution * g_gridResoulution);
     for(uint32_t i = 0; i < g_gridResoulution; ++i) {
         for(uint32_t j = 0; j < g_gridResoulution; ++j) {
-            g_gridPositions.push_back(glm::vec2(i, j));
+            InstanceTransform t(glm::vec3(i, 0, j));
+            if(g_irregularGrid) {
+                // Any heading and a small tilt, around the center of the base of the
+                // mesh, which is at most 1x1 in xz
+                const float tilt = glm::radians(15.0f) * unit(rng);
+                const float tiltAxis = glm::radians(360.0f) * unit(rng);
+                t.rotation = InstanceTransform::compose(
+                    InstanceTransform::axisAngle(glm::vec3(std::cos(tiltAxis), 0, std::sin(tiltAxis)), tilt),
+                    InstanceTransform::axisAngle(glm::vec3(0, 1, 0), glm::radians(360.0f) * unit(rng)));
+                t.scale = 0.5f + 0.5f * unit(rng);
+                const glm::vec3 pivot(0.5f, 0.0f, 0.5f);
+                const glm::vec3 jitter(unit(rng) - 0.5f, 0.0f, unit(rng) - 0.5f);
+                t.position += pivot + 0.5f * (1.0f - t.scale) * jitter - t.scale * t.rotate(pivot);
+            }
+            g_instanceTransforms.push_back(t);
+            // Neighbours have different meshes
+            g_meshIds.push_back((i + j) % g_meshFiles.size());
         }
     }
 }
 
-// Update the camera position, and matrices, according to the actual time
-void updateCamera() {
+// Camera position, and matrices, at a time of the route. Without GL, so the
+// culling thread can use it
+Camera evalCamera(double time, int32_t width, int32_t height) {
+    Camera camera;
 
-    double u = (g_actualTime - g_startTime) / (g_endTime - g_startTime);
+    double u = (time - g_startTime) / (g_endTime - g_startTime);
 
 
     glm::vec3 center = glm::vec3(g_gridResoulution / 2.0,
-                                 g_mesh->getSize().y / 2.f,
+                                 g_scene->getSize().y / 2.f,
                                  g_gridResoulution / 2.0);
 
-    g_cameraPosition = evalBSpline(dirPoints, u) * glm::vec3(g_gridResoulution, g_mesh->getSize().y , g_gridResoulution);
+    camera.position = evalBSpline(dirPoints, u) * glm::vec3(g_gridResoulution, g_scene->getSize().y , g_gridResoulution);
 
-    g_currentViewMatrix = glm::lookAt(g_cameraPosition,
-                                 center,
-                                 glm::vec3(0,1,0));
+    camera.view = glm::lookAt(camera.position,
+                              center,
+                              glm::vec3(0,1,0));
 
-    int32_t width, height;
-    glfwGetWindowSize(g_window, &width, &height);
+    camera.proj = glm::perspective(glm::radians(45.f), float(width)/float(height) , 0.01f, 100.0f);
+
+    camera.viewProj = camera.proj * camera.view;
+
+    camera.pixelsPerUnit = float(height) / (2.0f * std::tan(glm::radians(45.f) / 2.0f));
+    return camera;
+}
 
-    g_currentProjMatrix = glm::perspective(glm::radians(45.f), float(width)/float(height) , 0.01f, 100.0f);
+// Make a camera the actual one
+void setCamera(const Camera& camera) {
+    g_cameraPosition = camera.position;
+    g_currentViewMatrix = camera.view;
+    g_currentProjMatrix = camera.proj;
+    g_currentViewProjMatrix = camera.viewProj;
 
-    g_currentViewProjMatrix = g_currentProjMatrix * g_currentViewMatrix;
+    g_scene->setCamera(g_cameraPosition, g_currentViewProjMatrix, camera.pixelsPerUnit, g_lodPixelError);
 
     glUniformMatrix4fv(1, 1, GL_FALSE, &g_currentViewMatrix[0][0]);
     glUniformMatrix4fv(2, 1, GL_FALSE, &g_currentProjMatrix[0][0]);
 }
 
-// Update the render list for the frustum culling
-void updateFrustumCulling() {
-    g_frustumCullingPos.clear();
-    g_frustumCullingPos.reserve(g_gridPositions.size());
+// Update the camera position, and matrices, according to the actual time
+void updateCamera() {
+    TraceScope scope("updateCamera");
+    int32_t width, height;
+    glfwGetWindowSize(g_window, &width, &height);
+    setCamera(evalCamera(g_actualTime, width, height));
+}
 
-    glm::vec3 size = g_mesh->getSize();
-    uint32_t i = 0;
-    for(const glm::vec2& p : g_gridPositions) {
+// Instances with the box in the frustum of viewProj
+void frustumCull(const glm::mat4& viewProj, std::vector<uint32_t>& visible) {
+    TraceScope scope("frustumCull");
+    double cpuStart = glfwGetTime();
 
-        glm::vec3 p3(p.x, 0, p.y);
+    if(g_frustumBVH != nullptr) {
+        g_frustumBVH->cull(viewProj, visible);
+        g_frustumCullingCpuTime += glfwGetTime() - cpuStart;
+        ++g_frustumCullingCalls;
+        return;
+    }
 
-        glm::mat4 MVP = glm::translate(g_currentViewProjMatrix, p3);
+    // Each chunk keeps its visible instances in its own list
+    const uint32_t numInstances = (uint32_t)g_instanceTransforms.size();
+    const uint32_t numChunks = (numInstances + FRUSTUM_CHUNK_SIZE - 1) / FRUSTUM_CHUNK_SIZE;
+    g_frustumChunks.resize(numChunks);
+    g_jobs->parallelFor(numInstances, FRUSTUM_CHUNK_SIZE, [&viewProj](uint32_t begin, uint32_t end, uint32_t) {
+        std::vector<uint32_t>& chunk = g_frustumChunks[begin / FRUSTUM_CHUNK_SIZE];
+        chunk.clear();
+        for(uint32_t i = begin; i < end; ++i) {
+            if(testAABBoxInFrustum(g_scene->getInstanceMin(i), g_scene->getInstanceMax(i), viewProj)) {
+                chunk.push_back(i);
+            }
+        }
+    });
+
+    // The prefix sum of the counts is where each chunk goes, so they are copied
+    // in parallel and the list keeps the order of the instances
+    g_frustumChunkOffsets.resize(numChunks);
+    uint32_t numVisible = 0;
+    for(uint32_t c = 0; c < numChunks; ++c) {
+        g_frustumChunkOffsets[c] = numVisible;
+        numVisible += (uint32_t)g_frustumChunks[c].size();
+    }
+    visible.resize(numVisible);
+    g_jobs->parallelFor(numInstances, FRUSTUM_CHUNK_SIZE, [&visible](uint32_t begin, uint32_t, uint32_t) {
+        const uint32_t c = begin / FRUSTUM_CHUNK_SIZE;
+        std::copy(g_frustumChunks[c].begin(), g_frustumChunks[c].end(),
+                  visible.begin() + g_frustumChunkOffsets[c]);
+    });
+
+    g_frustumCullingCpuTime += glfwGetTime() - cpuStart;
+    ++g_frustumCullingCalls;
+}
 
-        if(testAABBoxInFrustum(glm::vec3(0), size, MVP)) {
-            g_frustumCullingPos.push_back(i);
+// Update the render list for the frustum culling
+void updateFrustumCulling() {
+    frustumCull(g_currentViewProjMatrix, g_frustumCullingPos);
+}
+
+// Time the frustum culling of the first view with 1 thread, and doubling up to the
+// cores, and then with the hierarchy
+void printCullingScaling() {
+    const uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+    const uint32_t repetitions = 200;
+    JobSystem* jobs = g_jobs;
+    FrustumBVH* bvh = g_frustumBVH;
+    g_frustumBVH = nullptr;
+
+    // Before the route starts
+    g_startTime = 0.0;
+    g_actualTime = 0.0;
+    updateCamera();
+    std::cout << "Frustum culling of " << g_instanceTransforms.size() << " instances:" << std::endl;
+    double singleMs = 0.0;
+    for(uint32_t threads = 1; ; threads = std::min(cores, threads * 2)) {
+        JobSystem scalingJobs(threads);
+        g_jobs = &scalingJobs;
+        updateFrustumCulling();
+
+        double start = glfwGetTime();
+        for(uint32_t r = 0; r < repetitions; ++r) {
+            updateFrustumCulling();
         }
-        ++i;
+        double ms = 1e3 * (glfwGetTime() - start) / repetitions;
+        if(threads == 1) {
+            singleMs = ms;
+        }
+        std::cout << "\t" << threads << " threads: " << ms << " ms, speedup " << singleMs / ms << std::endl;
+        if(threads == cores) {
+            break;
+        }
+    }
+    const size_t flatVisible = g_frustumCullingPos.size();
+
+    FrustumBVH scalingBVH;
+    double start = glfwGetTime();
+    scalingBVH.build(g_scene);
+    double buildMs = 1e3 * (glfwGetTime() - start);
+    g_frustumBVH = &scalingBVH;
+    updateFrustumCulling();
+    start = glfwGetTime();
+    for(uint32_t r = 0; r < repetitions; ++r) {
+        updateFrustumCulling();
     }
+    double ms = 1e3 * (glfwGetTime() - start) / repetitions;
+    std::cout << "\tBVH of " << scalingBVH.numNodes() << " nodes, built in " << buildMs << " ms: " <<
+                 ms << " ms, speedup " << singleMs / ms << ", " << scalingBVH.getTestedBoxes() <<
+                 " boxes tested, " << g_frustumCullingPos.size() << " visible (" << flatVisible << " flat)" << std::endl;
+
+    g_frustumBVH = bvh;
+    g_jobs = jobs;
+    g_frustumCullingCpuTime = 0.0;
+    g_frustumCullingCalls = 0;
 }
 
 // Launch and render using occlusion queries
 void launchOcclusionQueries() {
+    TraceScope scope("launchOcclusionQueries");
+    g_occlusionRenderedList.clear();
     // draw new visible
     uint32_t samplePassed;
-    for (uint32_t i = 0; i < g_gridPositions.size(); ++i) {
+    for (uint32_t i = 0; i < g_instanceTransforms.size(); ++i) {
         if (g_occlusionCullingRendered[i] == false) {
+            if (!g_occlusionQueryIssued[i]) {
+                continue;
+            }
             glGetQueryObjectuiv(g_queryObjects[i], GL_QUERY_RESULT, &samplePassed);
             if (samplePassed) {
-                g_mesh->drawOnlyInstance(i);
+                g_scene->drawOnlyInstance(i);
+                g_occlusionRenderedList.push_back(i);
                 g_occlusionLastVisible[i] = g_actualTime;
                 g_occlusionCullingRendered[i] = true;
             }
@@ -346,7 +681,8 @@ void launchOcclusionQueries() {
             }
         }
         else {
-            g_mesh->drawOnlyInstance(i);
+            g_scene->drawOnlyInstance(i);
+            g_occlusionRenderedList.push_back(i);
         }
     }
 
@@ -355,11 +691,20 @@ void launchOcclusionQueries() {
     glDepthMask(GL_FALSE);
     glDisable(GL_CULL_FACE);
     // query all invisible
-    for (uint32_t i = 0; i < g_gridPositions.size(); ++i) {
+    for (uint32_t i = 0; i < g_instanceTransforms.size(); ++i) {
         if (g_occlusionCullingRendered[i] == false || 
             (g_actualTime - g_occlusionLastVisible[i]) <= DELTA_TIME_VISIBLE) {
+            if (g_reprojection != nullptr && !g_occlusionCullingRendered[i]) {
+                if (!g_reprojection->testBox(g_scene->getInstanceMin(i), g_scene->getInstanceMax(i))) {
+                    // Still hidden, no need to query it
+                    g_occlusionQueryIssued[i] = false;
+                    ++g_skippedQueries;
+                    continue;
+                }
+            }
+            g_occlusionQueryIssued[i] = true;
             glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, g_queryObjects[i]);
-            g_mesh->drawBBoxOnlyInstance(i);
+            g_scene->drawBBoxOnlyInstance(i);
             glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
             g_occlusionCullingRendered[i] = false;
         }
@@ -370,17 +715,449 @@ void launchOcclusionQueries() {
     glEnable(GL_CULL_FACE);
 }
 
-int mainLoop() {
-    g_mesh = new Mesh();
+// Frustum culling of the instances in the PVS of the cell of the camera
+void pvsCull(const glm::vec3& position, const glm::mat4& viewProj, std::vector<uint32_t>& visible) {
+    TraceScope scope("pvsCull");
+    const uint64_t* cell = g_pvs.getCell(position);
+    if(cell == nullptr) {
+        // Outside of the baked region
+        frustumCull(viewProj, visible);
+        return;
+    }
+
+    visible.clear();
+    for(uint32_t w = 0; w < g_pvs.numWords(); ++w) {
+        uint64_t bits = cell[w];
+        for(uint32_t bit = 0; bits != 0; ++bit, bits >>= 1) {
+            if((bits & 1) == 0) {
+                continue;
+            }
+
+            uint32_t i = w * 64 + bit;
+            if(testAABBoxInFrustum(g_scene->getInstanceMin(i), g_scene->getInstanceMax(i), viewProj)) {
+                visible.push_back(i);
+            }
+        }
+    }
+}
+
+// Nearest first along the view direction, if enabled
+void sortFrontToBack(const glm::vec3& position, const glm::mat4& view, std::vector<uint32_t>& visible) {
+    if(!g_sortFrontToBack) {
+        return;
+    }
+    TraceScope scope("sortFrontToBack");
+    double cpuStart = glfwGetTime();
+    // The camera looks along -z, the third row of the view matrix
+    const glm::vec3 viewDirection = -glm::vec3(view[0][2], view[1][2], view[2][2]);
+    g_depthSorter.sort(*g_scene, position, viewDirection, visible);
+    g_sortCpuTime += glfwGetTime() - cpuStart;
+}
+
+void updatePVSCulling() {
+    pvsCull(g_cameraPosition, g_currentViewProjMatrix, g_frustumCullingPos);
+}
+
+void cullThreadLoop() {
+    Trace::setThreadName("culling");
+    while(true) {
+        uint32_t slot;
+        while(!g_cullRequests.pop(&slot)) {
+            std::this_thread::yield();
+        }
+        if(slot == STOP_CULLING) {
+            return;
+        }
+
+        CulledFrame& frame = g_culledFrames[slot];
+        frame.camera = evalCamera(frame.time, frame.width, frame.height);
+        if(g_mode == Mode::ePVS) {
+            pvsCull(frame.camera.position, frame.camera.viewProj, frame.visible);
+        } else {
+            frustumCull(frame.camera.viewProj, frame.visible);
+        }
+        sortFrontToBack(frame.camera.position, frame.camera.view, frame.visible);
+        // Never full, there are only two frames
+        g_cullResults.push(slot);
+    }
+}
+
+// Ask the culling thread for the frame at a time
+void requestCulling(uint32_t slot, double time) {
+    CulledFrame& frame = g_culledFrames[slot];
+    frame.time = time;
+    glfwGetWindowSize(g_window, &frame.width, &frame.height);
+    g_cullRequests.push(slot);
+}
+
+// Draw the frame culled in the other thread, which meanwhile culls the next one
+void renderCulledFrame() {
+    double waitStart = glfwGetTime();
+    uint32_t slot;
+    while(!g_cullResults.pop(&slot)) {
+        std::this_thread::yield();
+    }
+    g_cullWaitTime += glfwGetTime() - waitStart;
+
+    // The next frame starts about one frame time after this one
+    requestCulling(1 - slot, g_actualTime + g_lastFrameTime);
+
+    const CulledFrame& frame = g_culledFrames[slot];
+    setCamera(frame.camera);
+    g_scene->drawInstances(frame.visible);
+    g_numRenderedInstances += frame.visible.size();
+}
+
+// Box containing all the positions of the camera along the route
+void getCameraBounds(glm::vec3* min, glm::vec3* max) {
+    const glm::vec3 scale(g_gridResoulution, g_scene->getSize().y, g_gridResoulution);
+    *min = glm::vec3( std::numeric_limits<float>::infinity());
+    *max = glm::vec3(-std::numeric_limits<float>::infinity());
+    const uint32_t steps = 10000;
+    for(uint32_t i = 0; i <= steps; ++i) {
+        glm::vec3 p = evalBSpline(dirPoints, double(i) / steps) * scale;
+        *min = glm::min(*min, p);
+        *max = glm::max(*max, p);
+    }
+    // Margin, so the camera never leaves the region
+    glm::vec3 margin = 0.01f * (*max - *min) + 1e-3f;
+    *min -= margin;
+    *max += margin;
+}
+
+// Load all the meshes in a scene, sharing the geometry arena if there are several
+bool loadScene() {
+    g_scene = new Scene(g_meshFiles.size() > 1);
     try {
-        g_mesh->loadMesh(MESH_TO_LOAD);
+        for(const std::string& file : g_meshFiles) {
+            Mesh* mesh = g_scene->addMesh();
+            mesh->setCompressedVertices(g_compressVertices);
+            mesh->setOptimize(g_optimizeMesh);
+            mesh->setNumLods(g_numLods);
+            mesh->setMeshlets(g_useMeshlets);
+            mesh->setResidency(g_meshResidency);
+            mesh->loadMesh(file.c_str(), g_useMeshCache);
+        }
     } catch(const std::exception& e){
         std::cerr << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int bakePVS() {
+    if(!loadScene()) {
+        return 1;
+    }
+    g_scene->setInstances(g_instanceTransforms, g_meshIds);
+
+    uint32_t idProgram = loadProgram(SHADER_ID_VERTEX, SHADER_ID_FRAGMENT);
+    if(idProgram == 0){
         return 1;
     }
 
-    std::cout << "Loaded mesh with:\n\t" << g_mesh->numVertices() <<
-                 " vertices\n\t" << g_mesh->numFaces() << " faces" << std::endl;
+    glm::vec3 min, max;
+    getCameraBounds(&min, &max);
+    glm::ivec3 cells(g_pvsCells, std::max(1u, g_pvsCells / 2), g_pvsCells);
+
+    double start = glfwGetTime();
+    bool ok = PVS::bake(g_pvsFileName, g_scene, g_instanceTransforms.size(), idProgram,
+                        min, max, cells, g_pvsSamples, g_pvsResolution);
+    if(ok) {
+        std::cout << "Baked PVS with " << cells.x * cells.y * cells.z << " cells in " <<
+                     glfwGetTime() - start << " s to " << g_pvsFileName << std::endl;
+    }
+
+    glDeleteProgram(idProgram);
+    delete g_scene;
+    return ok ? 0 : 1;
+}
+
+// Two-phase culling against the Hi-Z pyramid: the instances visible last frame
+// are rendered first, and the rest are tested against the resulting depth
+void renderHiZCulling() {
+    TraceScope scope("renderHiZCulling");
+    updateFrustumCulling();
+
+    g_hizDrawList.clear();
+    for(uint32_t i : g_frustumCullingPos) {
+        if(g_hizVisible[i]) {
+            g_hizDrawList.push_back(i);
+        }
+    }
+    g_scene->drawInstances(g_hizDrawList);
+    g_numRenderedInstances += g_hizDrawList.size();
+
+    int32_t width, height;
+    glfwGetFramebufferSize(g_window, &width, &height);
+    g_hiz->build(width, height, g_currentViewProjMatrix);
+
+    if(g_hiz->usesCompute()) {
+        g_hizBoxes.clear();
+        for(uint32_t i : g_frustumCullingPos) {
+            g_hizBoxes.push_back(glm::vec4(g_scene->getInstanceMin(i), 1.0f));
+            g_hizBoxes.push_back(glm::vec4(g_scene->getInstanceMax(i), 1.0f));
+        }
+        g_hiz->testBoxesGPU(g_hizBoxes, g_hizResults);
+    } else {
+        g_hizResults.resize(g_frustumCullingPos.size());
+        for(uint32_t k = 0; k < g_frustumCullingPos.size(); ++k) {
+            uint32_t i = g_frustumCullingPos[k];
+            g_hizResults[k] = g_hiz->testBox(g_scene->getInstanceMin(i), g_scene->getInstanceMax(i));
+        }
+    }
+
+    g_hizDrawList.clear();
+    for(uint32_t k = 0; k < g_frustumCullingPos.size(); ++k) {
+        uint32_t i = g_frustumCullingPos[k];
+        if(g_hizResults[k] && !g_hizVisible[i]) {
+            g_hizDrawList.push_back(i);
+        }
+    }
+    g_scene->drawInstances(g_hizDrawList);
+    g_numRenderedInstances += g_hizDrawList.size();
+
+    // Instances out of the frustum are not visible
+    std::fill(g_hizVisible.begin(), g_hizVisible.end(), 0);
+    for(uint32_t k = 0; k < g_frustumCullingPos.size(); ++k) {
+        g_hizVisible[g_frustumCullingPos[k]] = g_hizResults[k] != 0;
+    }
+}
+
+// Fill the depth buffer with good occluders before issuing any query
+void renderPrepass(const std::vector<uint32_t>& lastRendered) {
+    TraceScope scope("renderPrepass");
+    double cpuStart = glfwGetTime();
+
+    // Read the timer of the frame issued two frames ago, to not stall in the actual one
+    uint32_t queryIdx = g_numFrames % 2;
+    if(g_numFrames >= 2) {
+        uint64_t elapsed;
+        glGetQueryObjectui64v(g_prepassTimeQueries[queryIdx], GL_QUERY_RESULT, &elapsed);
+        g_prepassGpuTime += elapsed;
+        ++g_prepassGpuTimeFrames;
+    }
+
+    if(g_prepass == Prepass::ePrepassOccluders) {
+        updateFrustumCulling();
+        g_occluders->select(&g_frustumCullingPos,
+                            g_currentViewProjMatrix, g_numOccluders, g_prepassSelected);
+    } else {
+        g_occluders->select(&lastRendered,
+                            g_currentViewProjMatrix, g_numOccluders, g_prepassSelected);
+    }
+
+    glBeginQuery(GL_TIME_ELAPSED, g_prepassTimeQueries[queryIdx]);
+    Trace::beginGpu("prepass");
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    for(uint32_t i : g_prepassSelected) {
+        if(g_prepass == Prepass::ePrepassOccluders) {
+            g_occluders->drawOnlyInstance(i);
+        } else {
+            g_scene->drawOnlyInstance(i);
+        }
+    }
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    Trace::endGpu();
+    glEndQuery(GL_TIME_ELAPSED);
+
+    g_prepassCpuTime += glfwGetTime() - cpuStart;
+}
+
+// Read the samples of the frame issued two frames ago, to not stall in the actual one
+void beginSamplesQuery() {
+    uint32_t queryIdx = g_numFrames % 2;
+    if(g_numFrames >= 2) {
+        uint64_t samples;
+        glGetQueryObjectui64v(g_samplesQueries[queryIdx], GL_QUERY_RESULT, &samples);
+        g_samplesPassed += samples;
+        ++g_samplesPassedFrames;
+    }
+    glBeginQuery(GL_SAMPLES_PASSED, g_samplesQueries[queryIdx]);
+}
+
+void endSamplesQuery() {
+    glEndQuery(GL_SAMPLES_PASSED);
+}
+
+// Add the allocations since the end of the last phase to this one
+void endAllocationPhase(AllocationPhase phase) {
+    const MemoryStats::Allocations now = MemoryStats::getAllocations();
+    g_phaseAllocations[phase].count += now.count - g_phaseStart.count;
+    g_phaseAllocations[phase].bytes += now.bytes - g_phaseStart.bytes;
+    g_phaseStart = now;
+}
+
+// Read the statistics of the frame issued two frames ago, and write the frame
+void readPipelineStatistics(uint32_t queryIdx) {
+    FrameWriter::Frame& frame = g_pendingFrames[queryIdx];
+    frame.numStats = NUM_PIPELINE_STATS;
+    for(uint32_t s = 0; s < NUM_PIPELINE_STATS; ++s) {
+        glGetQueryObjectui64v(g_pipelineStatQueries[queryIdx][s], GL_QUERY_RESULT, &frame.stats[s]);
+        g_pipelineStatsSum[s] += frame.stats[s];
+    }
+    ++g_pipelineStatsFrames;
+    if(g_frameWriter != nullptr) {
+        g_frameWriter->push(frame);
+    }
+}
+
+// Stream the frame to the out file, once its statistics are read if needed
+void recordFrame(uint64_t frame, double time, double delta) {
+    g_lastFrameTime = delta;
+    if(g_frameWriter == nullptr) {
+        return;
+    }
+    FrameWriter::Frame& f = g_pendingFrames[frame % 2];
+    f.time = time;
+    f.delta = delta;
+    f.numStats = 0;
+    if(!g_pipelineStatistics) {
+        g_frameWriter->push(f);
+    }
+}
+
+void beginPipelineStatistics() {
+    uint32_t queryIdx = g_numFrames % 2;
+    if(g_numFrames >= 2) {
+        readPipelineStatistics(queryIdx);
+    }
+    for(uint32_t s = 0; s < NUM_PIPELINE_STATS; ++s) {
+        glBeginQuery(PIPELINE_STAT_TARGETS[s], g_pipelineStatQueries[queryIdx][s]);
+    }
+}
+
+void endPipelineStatistics() {
+    for(uint32_t s = 0; s < NUM_PIPELINE_STATS; ++s) {
+        glEndQuery(PIPELINE_STAT_TARGETS[s]);
+    }
+}
+
+void printMemoryStatistics() {
+    if(MemoryStats::isTrackingAllocations()) {
+        const char* names[eNumPhases] = {"load", "setup", "frames"};
+        std::cout << "Allocations:";
+        for(uint32_t p = 0; p < eNumPhases; ++p) {
+            std::cout << " " << names[p] << " " << g_phaseAllocations[p].count <<
+                         " (" << double(g_phaseAllocations[p].bytes) / (1024.0 * 1024.0) << " MB)";
+        }
+        std::cout << std::endl;
+        if(g_numFrames != 0) {
+            std::cout << "Allocations per frame: " <<
+                         double(g_phaseAllocations[ePhaseFrames].count) / double(g_numFrames) << " (" <<
+                         double(g_phaseAllocations[ePhaseFrames].bytes) / double(g_numFrames) << " bytes), at most " <<
+                         g_maxFrameAllocations << ", in " << g_framesAllocating << " of " << g_numFrames <<
+                         " frames" << std::endl;
+        }
+    }
+    std::cout << "Memory: " << double(MemoryStats::getPeakResidentBytes()) / (1024.0 * 1024.0) <<
+                 " MB peak resident, " << double(MemoryStats::getGLBufferBytes()) / (1024.0 * 1024.0) <<
+                 " MB in GL buffers" << std::endl;
+}
+
+void printStatistics() {
+    if(g_numFrames == 0) {
+        return;
+    }
+    double rendered = double(g_numRenderedInstances) / double(g_numFrames);
+    std::cout << "Rendered instances per frame: " << rendered << " of " << g_instanceTransforms.size() <<
+                 " (" << 100.0 * (1.0 - rendered / double(g_instanceTransforms.size())) << "% culled)" << std::endl;
+    std::cout << "Rendered triangles per frame: " <<
+                 double(g_scene->getDrawnFaces()) / double(g_numFrames) << std::endl;
+    if(g_scene->getTestedMeshlets() != 0) {
+        std::cout << "Meshlets: " << 100.0 * double(g_scene->getCulledMeshlets()) / double(g_scene->getTestedMeshlets()) <<
+                     "% culled" << std::endl;
+    }
+
+    if(g_reprojection != nullptr) {
+        std::cout << "Reprojection: " << double(g_skippedQueries) / double(g_numFrames) <<
+                     " queries skipped, " << 1e3 * g_reprojectionCpuTime / double(g_numFrames) <<
+                     " ms CPU per frame, " << g_reprojection->getUnfinishedFrames() <<
+                     " frames without the depth copy finished" << std::endl;
+    }
+
+    if(g_frustumCullingCalls != 0) {
+        std::cout << "Frustum culling ";
+        if(g_frustumBVH != nullptr) {
+            std::cout << "with the BVH: ";
+        } else {
+            std::cout << "with " << g_jobs->numThreads() << " threads: ";
+        }
+        std::cout << 1e3 * g_frustumCullingCpuTime / double(g_frustumCullingCalls) << " ms CPU" << std::endl;
+    }
+    if(g_pipelineCulling) {
+        std::cout << "Culling thread: render thread waited " <<
+                     1e3 * g_cullWaitTime / double(g_numFrames) << " ms per frame" << std::endl;
+    }
+
+    if(g_sortFrontToBack) {
+        const uint64_t sorts = g_depthSorter.getIncrementalSorts() + g_depthSorter.getRadixSorts();
+        std::cout << "Front to back sort: " << 1e3 * g_sortCpuTime / double(sorts) << " ms CPU, " <<
+                     100.0 * double(g_depthSorter.getIncrementalSorts()) / double(sorts) <<
+                     "% incremental, the rest radix sorted" << std::endl;
+    }
+    if(g_samplesPassedFrames != 0) {
+        int32_t width, height;
+        glfwGetFramebufferSize(g_window, &width, &height);
+        const double samples = double(g_samplesPassed) / double(g_samplesPassedFrames);
+        std::cout << "Samples passing the depth test per frame: " << samples << " (" <<
+                     samples / double(width * height) << " per pixel)" << std::endl;
+    }
+
+    if(g_pipelineStatsFrames != 0) {
+        std::cout << "Pipeline statistics per frame:";
+        for(uint32_t s = 0; s < NUM_PIPELINE_STATS; ++s) {
+            std::cout << "\n\t" << double(g_pipelineStatsSum[s]) / double(g_pipelineStatsFrames) <<
+                         " " << PIPELINE_STAT_NAMES[s];
+        }
+        std::cout << std::endl;
+    }
+    if(g_frameWriter != nullptr && g_frameWriter->getFullWaits() != 0) {
+        std::cout << "Frame writer: waited " << g_frameWriter->getFullWaits() << " times" << std::endl;
+    }
+
+    if(g_prepass != Prepass::ePrepassNone) {
+        double gpuMs = g_prepassGpuTimeFrames == 0 ? 0.0 :
+                           1e-6 * double(g_prepassGpuTime) / double(g_prepassGpuTimeFrames);
+        std::cout << "Prepass with " << g_numOccluders << " occluders: " <<
+                     gpuMs << " ms GPU, " <<
+                     1e3 * g_prepassCpuTime / double(g_numFrames) << " ms CPU per frame" << std::endl;
+    }
+}
+
+int mainLoop() {
+    TraceScope scope("mainLoop");
+    double loadStart = glfwGetTime();
+    if(!loadScene()) {
+        return 1;
+    }
+    std::cout << "Loaded " << g_scene->numMeshes() << " meshes in " << glfwGetTime() - loadStart << " s" << std::endl;
+    endAllocationPhase(ePhaseLoad);
+
+    for(uint32_t m = 0; m < g_scene->numMeshes(); ++m) {
+        const Mesh* mesh = g_scene->getMesh(m);
+        std::cout << "Mesh " << g_meshFiles[m] << (mesh->isLoadedFromCache() ? " from cache" : "") <<
+                     " with:\n\t" << mesh->numVertices() <<
+                     " vertices\n\t" << mesh->numFaces() << " faces\n\t" << mesh->getVertexSize() << " bytes per vertex" << std::endl;
+
+        const MeshOptimizer::VertexCacheStats unoptimized = mesh->getUnoptimizedVertexCacheStats();
+        const MeshOptimizer::VertexCacheStats stats = mesh->getVertexCacheStats();
+        if(unoptimized.acmr > 0.0f) {
+            std::cout << "Vertex cache before optimizing: ACMR " << unoptimized.acmr <<
+                         " ATVR " << unoptimized.atvr << std::endl;
+        }
+        std::cout << "Vertex cache: ACMR " << stats.acmr << " ATVR " << stats.atvr << std::endl;
+        if(mesh->numLods() > 1) {
+            std::cout << "Levels of detail:";
+            for(uint32_t l = 0; l < mesh->numLods(); ++l) {
+                std::cout << " " << mesh->numLodFaces(l);
+            }
+            std::cout << " faces" << std::endl;
+        }
+        if(mesh->numMeshlets() != 0) {
+            std::cout << "Meshlets: " << mesh->numMeshlets() << std::endl;
+        }
+    }
 
     g_normProgram = loadProgram(SHADER_VERTEX, SHADER_FRAGMENT);
     if(g_normProgram == 0){
@@ -388,30 +1165,85 @@ int mainLoop() {
     }
 
     glEnable(GL_DEPTH_TEST);
+    // Instances already in the depth buffer by the prepass need to pass again
+    glDepthFunc(GL_LEQUAL);
     glEnable(GL_CULL_FACE);
     glClearColor(0.3f, 0.3f, 0.3f, 1.0f);
 
+    // The uniforms of each mesh are set by the scene before its draws
     glUseProgram(g_normProgram);
-    glUniformMatrix4fv(0, 1, GL_FALSE, glm::value_ptr(g_mesh->getModelMatrix()));
+    glUniform1i(5, g_compressVertices ? 1 : 0);
 
-    // Set all the instances into the mesh
-    g_mesh->setInstances(g_gridPositions);
+    // Set all the instances into the meshes
+    g_scene->setInstances(g_instanceTransforms, g_meshIds);
 
     if(g_mode == Mode::eOcclusionCulling) {
-        g_queryObjects.resize(g_gridPositions.size());
-        glGenQueries(g_gridPositions.size(), g_queryObjects.data());
-        g_occlusionLastVisible.resize(g_gridPositions.size(), -10.0);
+        g_queryObjects.resize(g_instanceTransforms.size());
+        glGenQueries(g_instanceTransforms.size(), g_queryObjects.data());
+        g_occlusionLastVisible.resize(g_instanceTransforms.size(), -10.0);
         
-        g_occlusionCullingRendered.resize(g_gridPositions.size(), 0);
+        g_occlusionCullingRendered.resize(g_instanceTransforms.size(), 0);
+        g_occlusionQueryIssued.resize(g_instanceTransforms.size(), 1);
     }
 
     ChcPP chc;
-    if(g_mode == Mode::eCHC) {
-        chc.setMesh(g_mesh);
-        chc.setPositions(&g_gridPositions);
+    if(g_mode == Mode::eCHC || g_mode == Mode::eCHCHiZ) {
+        chc.setScene(g_scene);
         chc.buildBVH();
     }
 
+    if(g_prepass != Prepass::ePrepassNone) {
+        g_occluders = new Occluders();
+        try {
+            g_occluders->build(g_scene);
+        } catch(const std::exception& e){
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        std::cout << "Occluder with " << g_occluders->numBoxes() << " boxes, covering " <<
+                     100.0f * g_occluders->getCoverage() << "% of the bounding box" << std::endl;
+        glGenQueries(2, g_prepassTimeQueries);
+    }
+
+    if(g_mode == Mode::eFrustumCulling || g_mode == Mode::ePVS) {
+        glGenQueries(2, g_samplesQueries);
+    }
+    if(g_pipelineStatistics) {
+        glGenQueries(2 * NUM_PIPELINE_STATS, &g_pipelineStatQueries[0][0]);
+    }
+
+    if(g_mode == Mode::ePVS && !g_pvs.load(g_pvsFileName, g_scene, g_instanceTransforms.size())) {
+        std::cerr << "Can't load the PVS " << g_pvsFileName <<
+                     ", bake it for this resolution with -bakepvs" << std::endl;
+        return 1;
+    }
+
+    if(g_useReprojection && (g_mode == Mode::eOcclusionCulling || g_mode == Mode::eCHC)) {
+        g_reprojection = new DepthReprojection();
+        chc.setReprojection(g_reprojection);
+    }
+
+    if(g_mode == Mode::eHiZ || g_mode == Mode::eCHCHiZ) {
+        g_hizBuildProgram = loadComputeProgram(SHADER_HIZ_BUILD);
+        g_hizTestProgram = loadComputeProgram(SHADER_HIZ_TEST);
+        if(g_hizBuildProgram == 0 || g_hizTestProgram == 0){
+            return 1;
+        }
+        g_hiz = new HiZ();
+        g_hiz->setPrograms(g_hizBuildProgram, g_hizTestProgram);
+        g_hiz->setUseCompute(g_hizCompute);
+        g_hizVisible.resize(g_instanceTransforms.size(), 0);
+    }
+
+    g_jobs = new JobSystem(g_numThreads);
+    if(g_useFrustumBVH) {
+        g_frustumBVH = new FrustumBVH();
+        g_frustumBVH->build(g_scene);
+    }
+    if(g_cullingScaling) {
+        printCullingScaling();
+    }
+
     g_startTime = glfwGetTime();
     g_actualTime = g_startTime;
     g_endTime += g_startTime;
@@ -420,41 +1252,137 @@ int mainLoop() {
     g_actualTime = 8;
     g_endTime = 10;
     */
+    if(g_pipelineCulling) {
+        g_cullThread = std::thread(cullThreadLoop);
+        requestCulling(0, g_actualTime);
+    }
+    endAllocationPhase(ePhaseSetup);
     while (!glfwWindowShouldClose(g_window))
     {
+        TraceScope frameScope("frame");
+        Trace::beginGpu("frame");
+        if(g_pipelineStatistics) {
+            beginPipelineStatistics();
+        }
         glClear(GL_COLOR_BUFFER_BIT);
         glClear(GL_DEPTH_BUFFER_BIT);
 
-        updateCamera();
+        // Otherwise the camera is the one of the culled frame
+        if(!g_pipelineCulling) {
+            updateCamera();
+        }
+
+        if(g_reprojection != nullptr) {
+            double cpuStart = glfwGetTime();
+            g_reprojection->reproject(g_currentViewProjMatrix);
+            g_reprojectionCpuTime += glfwGetTime() - cpuStart;
+        }
+
+        // The fragments shaded, with early depth testing, of the two orders
+        const bool countSamples = g_mode == Mode::eFrustumCulling || g_mode == Mode::ePVS;
+        if(countSamples) {
+            beginSamplesQuery();
+        }
 
         switch (g_mode) {
         case Mode::eUnoptimized:
-            g_mesh->draw();
+            g_scene->draw();
+            g_numRenderedInstances += g_instanceTransforms.size();
             break;
         case Mode::eFrustumCulling:
-            updateFrustumCulling();
-            for(uint32_t i = 0; i < g_frustumCullingPos.size(); ++i){
-                g_mesh->drawOnlyInstance(g_frustumCullingPos[i]);
+            if(g_pipelineCulling) {
+                renderCulledFrame();
+                break;
             }
+            updateFrustumCulling();
+            sortFrontToBack(g_cameraPosition, g_currentViewMatrix, g_frustumCullingPos);
+            g_scene->drawInstances(g_frustumCullingPos);
+            g_numRenderedInstances += g_frustumCullingPos.size();
             break;
         case Mode::eOcclusionCulling:
-            
+            if(g_prepass != Prepass::ePrepassNone) {
+                renderPrepass(g_occlusionRenderedList);
+            }
+
             launchOcclusionQueries();
+            g_numRenderedInstances += g_occlusionRenderedList.size();
 
             break;
         case Mode::eCHC:
+        {
+            if(g_prepass != Prepass::ePrepassNone) {
+                renderPrepass(chc.getRendered());
+            }
+
+            // Only the allocations of this thread, not the ones of the others
+            const uint64_t allocations = MemoryStats::getThreadAllocations().count;
             chc.executeCHCPP(g_cameraPosition, g_currentViewProjMatrix);
+            if(g_checkAllocations && g_numFrames >= CHC_WARMUP_FRAMES &&
+                MemoryStats::getThreadAllocations().count != allocations) {
+                ++g_chcAllocatingFrames;
+            }
+            g_numRenderedInstances += chc.getRendered().size();
+            g_skippedQueries += chc.getSkippedQueries();
+
+            break;
+        }
+        case Mode::ePVS:
+            if(g_pipelineCulling) {
+                renderCulledFrame();
+                break;
+            }
+            updatePVSCulling();
+            sortFrontToBack(g_cameraPosition, g_currentViewMatrix, g_frustumCullingPos);
+            g_scene->drawInstances(g_frustumCullingPos);
+            g_numRenderedInstances += g_frustumCullingPos.size();
+            break;
+        case Mode::eHiZ:
+            renderHiZCulling();
 
             break;
+        case Mode::eCHCHiZ:
+        {
+            int32_t width, height;
+            glfwGetFramebufferSize(g_window, &width, &height);
+            chc.executeHiZ(g_cameraPosition, g_currentViewProjMatrix, *g_hiz, width, height);
+            g_numRenderedInstances += chc.getRendered().size();
+
+            break;
+        }
         default:
             assert(false);
             break;
         }
-        glfwSwapBuffers(g_window);
+        if(countSamples) {
+            endSamplesQuery();
+        }
+        if(g_reprojection != nullptr) {
+            int32_t width, height;
+            glfwGetFramebufferSize(g_window, &width, &height);
+            g_reprojection->capture(width, height, g_currentViewProjMatrix);
+        }
+
+        if(g_pipelineStatistics) {
+            endPipelineStatistics();
+        }
+        Trace::endGpu();
+        {
+            TraceScope swapScope("swapBuffers");
+            glfwSwapBuffers(g_window);
+        }
+        Trace::collectGpu();
+        ++g_numFrames;
 
         double newTime = glfwGetTime();
-        g_FramerateBuffer.push_back({newTime - g_startTime, newTime - g_actualTime});
+        recordFrame(g_numFrames - 1, newTime - g_startTime, newTime - g_actualTime);
         g_actualTime = newTime;
+
+        const uint64_t allocations = g_phaseAllocations[ePhaseFrames].count;
+        endAllocationPhase(ePhaseFrames);
+        const uint64_t frameAllocations = g_phaseAllocations[ePhaseFrames].count - allocations;
+        g_maxFrameAllocations = std::max(g_maxFrameAllocations, frameAllocations);
+        g_framesAllocating += frameAllocations != 0 ? 1 : 0;
+
         if(g_endTime < g_actualTime){
             glfwSetWindowShouldClose(g_window, GLFW_TRUE);
         }
@@ -462,14 +1390,63 @@ int mainLoop() {
         glfwPollEvents();
     }
 
+    if(g_pipelineCulling) {
+        // After the frame still being culled
+        g_cullRequests.push(STOP_CULLING);
+        g_cullThread.join();
+    }
+
+    if(g_pipelineStatistics) {
+        // The last two frames
+        for(uint64_t f = g_numFrames < 2 ? 0 : g_numFrames - 2; f < g_numFrames; ++f) {
+            readPipelineStatistics(f % 2);
+        }
+    }
+
+    printStatistics();
+    printMemoryStatistics();
+
+    // Only counted with -checkallocations
+    int ret = 0;
+    if(g_chcAllocatingFrames != 0) {
+        std::cerr << "CHC++ allocated in " << g_chcAllocatingFrames << " frames after the first " <<
+                     CHC_WARMUP_FRAMES << std::endl;
+        ret = 1;
+    }
+
+    if(g_mode == Mode::eFrustumCulling || g_mode == Mode::ePVS) {
+        glDeleteQueries(2, g_samplesQueries);
+    }
+    if(g_pipelineStatistics) {
+        glDeleteQueries(2 * NUM_PIPELINE_STATS, &g_pipelineStatQueries[0][0]);
+    }
+    if(g_occluders != nullptr) {
+        glDeleteQueries(2, g_prepassTimeQueries);
+        delete g_occluders;
+    }
+    if(g_reprojection != nullptr) {
+        delete g_reprojection;
+    }
+    if(g_hiz != nullptr) {
+        delete g_hiz;
+        glDeleteProgram(g_hizBuildProgram);
+        glDeleteProgram(g_hizTestProgram);
+    }
     glDeleteProgram(g_normProgram);
-    delete g_mesh;
-    return 0;
+    delete g_frustumBVH;
+    delete g_jobs;
+    delete g_scene;
+    return ret;
 }
 
 void printUsage(){
     std::cout <<
-        "./visibility resolution [-time=time] [-mode=mode] [-out=outfile]\n"
+        "./visibility resolution [-time=time] [-mode=mode] [-out=outfile] [-prepass=prepass] [-occluders=k] [-hiz=hiz] [-reproject]\n"
+        "\t[-pvs=pvsfile] [-bakepvs] [-pvscells=cells] [-pvssamples=samples] [-pvsresolution=faceres] [-nocache]\n"
+        "\t[-compress] [-optimize] [-lods=lods] [-loderror=pixels] [-meshlets] [-residency=residency] [-meshes=meshes]\n"
+        "\t[-irregular] [-threads=threads] [-cullscaling] [-pipeline] [-bvhfrustum] [-sort]\n"
+        "\t[-trace=tracefile] [-pipelinestats] [-report=prefix] [-warmup=seconds] [-checkallocations]\n"
+        "./visibility -compare=base,other [-warmup=seconds]\n"
         "\tresolution = int\n"
         "\ttime = double (default 30)\n"
         "\tmode = int (default 0)\n"
@@ -477,7 +1454,51 @@ void printUsage(){
         "\t\t 1 is frustum culling\n"
         "\t\t 2 is occlusion culling\n"
         "\t\t 3 is CHC++\n"
-        "\toutfile = output file for framerate (optional)\n"
+        "\t\t 4 is Hi-Z culling\n"
+        "\t\t 5 is Hi-Z culling over the CHC++ BVH\n"
+        "\t\t 6 is PVS+frustum culling\n"
+        "\toutfile = output file for framerate, written while running (optional)\n"
+        "\tpipelinestats = count the vertices, primitives and fragment shader invocations of each frame, written\n"
+        "\t\t to outfile after the frame times, and averaged in the statistics\n"
+        "\tprefix = write the mean, median, deviation and percentiles of the frame times, with confidence intervals,\n"
+        "\t\t for the whole route and each of its segments to prefix.json and prefix.csv\n"
+        "\tseconds = double, time at the start left out of the frame time statistics (default 1)\n"
+        "\tbase, other = outfiles of two runs, compares their frame times and exits with 1 if other is significantly slower\n"
+        "\ttracefile = Chrome trace JSON of the CPU and GPU work of the frames, for chrome://tracing or Perfetto (optional)\n"
+        "\tprepass = depth prepass before the queries of modes 2 and 3 (optional)\n"
+        "\t\t occluders renders the simplified occluders\n"
+        "\t\t visible renders the instances visible the last frame\n"
+        "\tk = int, number of instances in the prepass (default 16)\n"
+        "\thiz = where to build the Hi-Z pyramid of modes 4 and 5 (default gpu)\n"
+        "\t\t gpu uses a compute shader\n"
+        "\t\t cpu reads back the depth buffer\n"
+        "\tpvsfile = PVS of mode 6 (default pvs.bin)\n"
+        "\tbakepvs = bake the PVS for the resolution to pvsfile, and exit\n"
+        "\tcells = int, view cells of the PVS in x and z, half in y (default 8)\n"
+        "\tsamples = int, renders per cell and axis when baking (default 2)\n"
+        "\tfaceres = int, size of the renders of each direction when baking (default " << PVS::DEFAULT_FACE_RESOLUTION << "),\n"
+        "\t\t as many pixels per degree as the center of the view. The sets of the neighbour cells are added to\n"
+        "\t\t each one, but an instance hidden or under a pixel from all their samples is still missing\n"
+        "\tnocache = always parse the ply, without reading or writing the binary mesh cache\n"
+        "\toptimize = reorder the triangles and vertices of the mesh for the vertex cache and overdraw\n"
+        "\tlods = int, levels of detail of the mesh, each with half the triangles (default 1)\n"
+        "\tpixels = float, error on screen allowed when selecting the level of detail (default 1)\n"
+        "\tmeshlets = split the mesh in clusters, and skip the ones out of the frustum or facing away\n"
+        "\tresidency = what is kept in memory of the mesh after uploading it (default keep)\n"
+        "\t\t keep keeps the vertices and faces\n"
+        "\t\t spill frees them, and maps the cache file when they are needed\n"
+        "\t\t release frees them, the occluders of the prepass can't be built\n"
+        "\tcompress = upload the vertices with 16 bit positions, octahedral normals and half float uvs\n"
+        "\tmeshes = comma separated ply files, the grid alternates between them (default " << MESH_TO_LOAD << ")\n"
+        "\tirregular = random rotation, scale and position inside of its cell for each instance\n"
+        "\tthreads = int, threads of the frustum culling (default 1)\n"
+        "\tcullscaling = time the frustum culling from 1 thread up to the number of cores, and with the BVH, before running\n"
+        "\tbvhfrustum = frustum culling over a BVH of the instances, skipping the planes the parents are inside of\n"
+        "\tpipeline = cull the next frame in another thread while rendering the actual one, modes 1 and 6\n"
+        "\tsort = draw the instances of modes 1 and 6 front to back, reusing the order of the last frame\n"
+        "\treproject = skip the queries of modes 2 and 3 for instances hidden by the depth of two frames ago\n"
+        "\tcheckallocations = exit with 1 if CHC++ allocates in a frame after the first " << CHC_WARMUP_FRAMES << ", mode 3\n"
+        "\t\t Needs a build with cmake -DTRACK_ALLOCATIONS=ON, e.g. ./visibility 16 -mode=3 -time=5 -checkallocations\n"
           <<       std::endl;
 }
 
@@ -488,6 +1509,24 @@ bool getArgs(const Args& args) {
             return false;
     }
 
+    if(args.has("warmup")) {
+        g_warmupTime = std::stod(args.get("warmup"));
+        assert(g_warmupTime >= 0.0);
+    }
+    // Nothing else is needed to compare two runs
+    if(args.has("compare")) {
+        std::stringstream files(args.get("compare"));
+        std::string file;
+        while(std::getline(files, file, ',')) {
+            g_compareFiles.push_back(file);
+        }
+        if(g_compareFiles.size() != 2) {
+            printUsage();
+            return false;
+        }
+        return true;
+    }
+
     if(args.has("time")){
         g_endTime = std::stod( args.get("time") );
         assert(g_endTime > 0.0);
@@ -496,13 +1535,124 @@ bool getArgs(const Args& args) {
     }
     if(args.has("mode")) {
         g_mode = static_cast<Mode>(std::stoi(args.get("mode")));
-        assert(g_mode < 4);
+        assert(g_mode < 7);
     }else{
         g_mode = Mode::eUnoptimized;
     }
     if(args.has("out")) {
         g_outFileName = args.get("out");
     }
+    if(args.has("trace")) {
+        g_traceFileName = args.get("trace");
+    }
+    if(args.has("report")) {
+        g_reportPrefix = args.get("report");
+        if(g_outFileName.empty()) {
+            std::cerr << "-report reads the frame times back from the outfile of -out" << std::endl;
+            return false;
+        }
+    }
+    if(args.has("prepass")) {
+        if(args.get("prepass") == "occluders") {
+            g_prepass = Prepass::ePrepassOccluders;
+        } else if(args.get("prepass") == "visible") {
+            g_prepass = Prepass::ePrepassLastVisible;
+        } else {
+            printUsage();
+            return false;
+        }
+    }
+    if(args.has("hiz")) {
+        if(args.get("hiz") == "gpu") {
+            g_hizCompute = true;
+        } else if(args.get("hiz") == "cpu") {
+            g_hizCompute = false;
+        } else {
+            printUsage();
+            return false;
+        }
+    }
+    if(args.has("residency")) {
+        if(args.get("residency") == "keep") {
+            g_meshResidency = Mesh::eResidencyKeep;
+        } else if(args.get("residency") == "spill") {
+            g_meshResidency = Mesh::eResidencySpill;
+        } else if(args.get("residency") == "release") {
+            g_meshResidency = Mesh::eResidencyRelease;
+        } else {
+            printUsage();
+            return false;
+        }
+    }
+    g_useReprojection = args.has("reproject");
+    if(args.has("pvs")) {
+        g_pvsFileName = args.get("pvs");
+    }
+    g_bakePVS = args.has("bakepvs");
+    g_useMeshCache = !args.has("nocache");
+    g_compressVertices = args.has("compress");
+    g_optimizeMesh = args.has("optimize");
+    g_useMeshlets = args.has("meshlets");
+    g_irregularGrid = args.has("irregular");
+    g_cullingScaling = args.has("cullscaling");
+    g_pipelineCulling = args.has("pipeline");
+    g_useFrustumBVH = args.has("bvhfrustum");
+    g_sortFrontToBack = args.has("sort");
+    g_pipelineStatistics = args.has("pipelinestats");
+    g_checkAllocations = args.has("checkallocations");
+    if(g_checkAllocations && (g_mode != Mode::eCHC || !MemoryStats::isTrackingAllocations())) {
+        std::cerr << "-checkallocations is only for mode 3, built with TRACK_ALLOCATIONS" << std::endl;
+        return false;
+    }
+    if(g_sortFrontToBack && g_mode != Mode::eFrustumCulling && g_mode != Mode::ePVS) {
+        std::cerr << "-sort is only for modes 1 and 6" << std::endl;
+        return false;
+    }
+    if(g_pipelineCulling && g_mode != Mode::eFrustumCulling && g_mode != Mode::ePVS) {
+        std::cerr << "-pipeline is only for modes 1 and 6" << std::endl;
+        return false;
+    }
+    if(args.has("threads")) {
+        g_numThreads = std::stoi(args.get("threads"));
+        assert(g_numThreads != 0);
+    }
+    if(args.has("lods")) {
+        g_numLods = std::stoi(args.get("lods"));
+        assert(g_numLods != 0);
+    }
+    if(args.has("loderror")) {
+        g_lodPixelError = std::stof(args.get("loderror"));
+        assert(g_lodPixelError > 0.0f);
+    }
+    if(args.has("pvscells")) {
+        g_pvsCells = std::stoi(args.get("pvscells"));
+        assert(g_pvsCells != 0);
+    }
+    if(args.has("pvssamples")) {
+        g_pvsSamples = std::stoi(args.get("pvssamples"));
+        assert(g_pvsSamples != 0);
+    }
+    if(args.has("pvsresolution")) {
+        g_pvsResolution = std::stoi(args.get("pvsresolution"));
+        assert(g_pvsResolution != 0);
+    }
+    if(args.has("occluders")) {
+        g_numOccluders = std::stoi(args.get("occluders"));
+    }
+    if(args.has("meshes")) {
+        g_meshFiles.clear();
+        std::stringstream files(args.get("meshes"));
+        std::string file;
+        while(std::getline(files, file, ',')) {
+            if(!file.empty()) {
+                g_meshFiles.push_back(file);
+            }
+        }
+        if(g_meshFiles.empty()) {
+            printUsage();
+            return false;
+        }
+    }
 
     uint32_t resoulution = std::stoi( args.get(1) );
     assert(resoulution != 0);
@@ -511,16 +1661,40 @@ bool getArgs(const Args& args) {
     return true;
 }
 
-void writeFramerate() {
-    std::ofstream stream(g_outFileName, std::ofstream::out | std::ofstream::trunc);
-
-    assert(stream);
+// Segments of the B-spline of the camera route
+uint32_t numRouteSegments() {
+    return uint32_t(dirPoints.size() - 2);
+}
 
-    for(const auto& t : g_FramerateBuffer) {
-        stream << t.first << "\t" << t.second << "\n";
+// From the out file, the frames are not kept in memory
+void writeReport() {
+    std::vector<std::pair<double, double>> frames;
+    if(!FrameReport::readFrames(g_outFileName, frames)) {
+        std::cerr << "Can't read the frame times of " << g_outFileName << std::endl;
+        return;
+    }
+    FrameReport report(frames, g_endTime - g_startTime, numRouteSegments(), g_warmupTime);
+    const FrameReport::Summary& total = report.getTotal();
+    std::cout << "Frame time: mean " << total.mean << " ms [" << total.meanLow << ", " << total.meanHigh <<
+                 "], median " << total.median << " ms, p99 " << total.p99 << " ms" << std::endl;
+    if(!report.writeJSON(g_reportPrefix + ".json") || !report.writeCSV(g_reportPrefix + ".csv")) {
+        std::cerr << "Can't write the report " << g_reportPrefix << std::endl;
     }
+}
 
-    stream.close();
+// Compare the frame times of two -out files, 1 if the second is significantly slower
+int compareRuns() {
+    std::vector<std::pair<double, double>> frames[2];
+    for(uint32_t r = 0; r < 2; ++r) {
+        if(!FrameReport::readFrames(g_compareFiles[r], frames[r]) || frames[r].empty()) {
+            std::cerr << "Can't read the frame times of " << g_compareFiles[r] << std::endl;
+            return 1;
+        }
+    }
+    // Each run lasted about until its last frame
+    FrameReport base(frames[0], frames[0].back().first, numRouteSegments(), g_warmupTime);
+    FrameReport other(frames[1], frames[1].back().first, numRouteSegments(), g_warmupTime);
+    return FrameReport::compare(base, other, std::cout) ? 1 : 0;
 }
 
 int main(int argc, char** argv) {
@@ -528,14 +1702,45 @@ int main(int argc, char** argv) {
     int ret = 1;
     if(getArgs(Args(argc, argv)))
     {
+        if(!g_compareFiles.empty()) {
+            return compareRuns();
+        }
+
         startupGLFW();
 
-        g_FramerateBuffer.reserve(60 * g_endTime);
+        if(g_bakePVS) {
+            ret = bakePVS();
+            glfwTerminate();
+            return ret;
+        }
 
-        ret = mainLoop();
+        if(!g_traceFileName.empty()) {
+            Trace::enable();
+        }
 
         if(!g_outFileName.empty()) {
-            writeFramerate();
+            g_frameWriter = new FrameWriter();
+            if(!g_frameWriter->open(g_outFileName)) {
+                std::cerr << "Can't write the frame times to " << g_outFileName << std::endl;
+                glfwTerminate();
+                return 1;
+            }
+        }
+
+        ret = mainLoop();
+
+        if(g_frameWriter != nullptr) {
+            g_frameWriter->close();
+            delete g_frameWriter;
+        }
+        if(!g_reportPrefix.empty()) {
+            writeReport();
+        }
+        if(!g_traceFileName.empty()) {
+            Trace::collectGpu(true);
+            if(!Trace::write(g_traceFileName)) {
+                std::cerr << "Can't write the trace " << g_traceFileName << std::endl;
+            }
         }
 
         glfwTerminate();